@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "block_allocation.h"
+#include "utils.h"
+
+/*
+ * Replays one randomised trace against every block allocator. Each step
+ * picks a slot: a live slot is freed, an empty one gets a new block of a log
+ * uniform size, like meshes being streamed in and out of a vertex buffer.
+ */
+
+#define TABLE_SIZE (64l << 20)
+#define SLOT_COUNT 4096
+#define STEP_COUNT 1000000
+#define MIN_BLOCK_SIZE 256
+#define MAX_BLOCK_SIZE (256 << 10)
+
+struct trace_step {
+  int slot;
+  long size, alignment;
+};
+
+static struct trace_step *create_trace(unsigned int seed);
+static double now(void);
+static void run_trace(const char *name, enum block_allocator allocator,
+    const struct trace_step *trace);
+
+static const long ALIGNMENTS[] = { 4, 16, 256 };
+
+static struct trace_step *
+create_trace(unsigned int seed)
+{
+  struct trace_step *trace;
+  double log_min, log_max;
+  int i;
+
+  srand(seed);
+  log_min = log(MIN_BLOCK_SIZE);
+  log_max = log(MAX_BLOCK_SIZE);
+  trace = xmalloc(STEP_COUNT * sizeof(struct trace_step));
+  for (i = 0; i < STEP_COUNT; i++) {
+    trace[i].slot = rand() % SLOT_COUNT;
+    trace[i].size = exp(log_min + (log_max - log_min) * rand() / RAND_MAX);
+    trace[i].alignment = ALIGNMENTS[rand() % 3];
+  }
+  return trace;
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+run_trace(const char *name, enum block_allocator allocator,
+    const struct trace_step *trace)
+{
+  struct block_allocation_table table;
+  struct block_allocation_stats stats;
+  long *offsets;
+  int i, failures, frees;
+  double start, seconds;
+
+  offsets = xmalloc(SLOT_COUNT * sizeof(long));
+  for (i = 0; i < SLOT_COUNT; i++)
+    offsets[i] = -1;
+  init_block_allocation_table(&table, TABLE_SIZE, allocator);
+  failures = frees = 0;
+  start = now();
+  for (i = 0; i < STEP_COUNT; i++) {
+    if (offsets[trace[i].slot] >= 0) {
+      free_block(&table, offsets[trace[i].slot]);
+      offsets[trace[i].slot] = -1;
+      frees++;
+    } else {
+      offsets[trace[i].slot] = allocate_aligned_block(&table, trace[i].size,
+          trace[i].alignment);
+      if (offsets[trace[i].slot] < 0)
+        failures++;
+    }
+  }
+  seconds = now() - start;
+  get_block_allocation_stats(&table, &stats);
+  printf("%-5s %7.1f ns/op  %7d frees  %7d failed allocations  "
+      "%5.1f MiB live  %4d free blocks  fragmentation %.3f\n",
+      name, seconds * 1e9 / STEP_COUNT, frees, failures,
+      stats.live_size / (double)(1 << 20), stats.free_block_count,
+      stats.fragmentation);
+  destroy_block_allocation_table(&table);
+  free(offsets);
+}
+
+int
+main(int argc, char **argv)
+{
+  struct trace_step *trace;
+
+  trace = create_trace(argc > 1 ? atoi(argv[1]) : 1);
+  run_trace("bump", BLOCK_ALLOCATOR_BUMP, trace);
+  run_trace("list", BLOCK_ALLOCATOR_LIST, trace);
+  run_trace("tlsf", BLOCK_ALLOCATOR_TLSF, trace);
+  free(trace);
+  return 0;
+}
@@ -8,11 +8,20 @@ layout(set = 0, binding = 0) uniform camera_uniform_buffer {
 layout(set = 1, binding = 0) uniform sampler2D texture_sampler;
 
 layout(location = 0) in vec2 in_uv;
+layout(location = 1) in vec3 in_normal;
 
 layout(location = 0) out vec4 out_color;
 
+/* Same light as the voxel block. */
+const vec3 light_dir = normalize(vec3(1.0f, -2.0f, 0.5f));
+const float ambient = 0.4f;
+
 void
 main()
 {
-  out_color = texture(texture_sampler, in_uv);
+  /* Meshes without normals have zero ones and are left unlit. */
+  float diffuse = dot(in_normal, in_normal) > 0.0f
+    ? max(dot(normalize(in_normal), -light_dir), 0.0f) : 1.0f;
+  vec4 color = texture(texture_sampler, in_uv);
+  out_color = vec4(color.rgb * (ambient + (1.0f - ambient) * diffuse), color.a);
 }
@@ -6,15 +6,65 @@ layout(set = 0, binding = 0) uniform camera_uniform_buffer {
   mat4 proj;
 };
 
+struct object_data {
+  mat4 model;
+  vec3 position_offset;
+  uint draw;
+  vec4 position_scale;
+};
+
+layout(std430, set = 0, binding = 1) readonly buffer object_buffer {
+  object_data objects[];
+};
+
+/*
+ * Objects of the instances that survived culling, indexed by
+ * gl_InstanceIndex from the start of each draw's list.
+ */
+layout(std430, set = 0, binding = 2) readonly buffer instance_buffer {
+  uint instances[];
+};
+
+#ifdef PACKED_VERTICES
+layout(location = 0) in vec4 in_position;
+layout(location = 1) in vec2 in_uv;
+layout(location = 2) in vec2 in_normal;
+#else
 layout(location = 0) in vec3 in_position;
 layout(location = 1) in vec2 in_uv;
 layout(location = 2) in vec3 in_normal;
+#endif
 
 layout(location = 0) out vec2 out_uv;
+layout(location = 1) out vec3 out_normal;
+
+#ifdef PACKED_VERTICES
+/* Inverse of the octahedral encoding in pack_vertices. */
+vec3
+decode_normal(vec2 e)
+{
+  vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));
+  float t = max(-n.z, 0.0f);
+  n.x += n.x >= 0.0f ? -t : t;
+  n.y += n.y >= 0.0f ? -t : t;
+  return normalize(n);
+}
+#endif
 
 void
 main()
 {
-  gl_Position = proj * view * model * vec4(in_position, 1.0f);
+  object_data object = objects[instances[gl_InstanceIndex]];
+#ifdef PACKED_VERTICES
+  vec3 position = object.position_offset + in_position.xyz * object.position_scale.xyz;
+  vec3 normal = decode_normal(in_normal);
+#else
+  vec3 position = in_position;
+  vec3 normal = in_normal;
+#endif
+  mat4 world = model * object.model;
+  gl_Position = proj * view * world * vec4(position, 1.0f);
   out_uv = in_uv;
+  /* Models are rotations, translations and uniform scales. */
+  out_normal = mat3(world) * normal;
 }
@@ -0,0 +1,18 @@
+#version 450
+
+layout(set = 0, binding = 0, rgba8) uniform readonly image2D trace_color;
+layout(set = 0, binding = 1, r32f) uniform readonly image2D trace_depth;
+
+layout(location = 0) out vec4 out_color;
+
+/* Depth tests the traced voxels against the triangles already drawn. */
+void
+main()
+{
+  ivec2 p = ivec2(gl_FragCoord.xy);
+  float depth = imageLoad(trace_depth, p).r;
+  if (depth >= 1.0f)
+    discard;
+  out_color = imageLoad(trace_color, p);
+  gl_FragDepth = depth;
+}
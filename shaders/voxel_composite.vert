@@ -0,0 +1,9 @@
+#version 450
+
+/* One triangle covering the screen. */
+void
+main()
+{
+  vec2 uv = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+  gl_Position = vec4(uv * 2.0f - 1.0f, 0.0f, 1.0f);
+}
@@ -0,0 +1,232 @@
+/*
+ * Voxel block ray traversal and shading shared by the fragment and compute
+ * tracers. The includer declares the block uniforms, block_voxels,
+ * block_distances and the occupancy and brick buffers.
+ */
+
+struct HitData {
+  float distance;
+  uint voxel;
+  vec3 normal;
+};
+
+const float mat_specular = 1.0f;
+const float mat_diffuse = 0.3f;
+const float mat_ambient = 0.3f;
+const float mat_shininess = 4.0f;
+
+const vec3 light_dir = normalize(vec3(1.0f, -2.0f, 0.5f));
+const float light_specular = 0.5f;
+const float light_diffuse = 0.9f;
+
+/* Nudges a point on a cell boundary into the cell the ray is entering. */
+const float cell_epsilon = 1e-3f;
+
+bool
+cell_occupied(int level, ivec3 cell)
+{
+  int dims = (block_scale + (1 << level) - 1) >> level;
+  uint index = uint((cell.z * dims + cell.y) * dims + cell.x);
+  return (occupancy_bits[occupancy_offsets[level] + index / 32] >> (index % 32) & 1u) != 0;
+}
+
+/* The 64 bit mask of a 4x4x4 brick, one bit per solid voxel. */
+uvec2
+brick_mask(ivec3 brick)
+{
+  int dims = (block_scale + 3) >> 2;
+  return bricks[(brick.z * dims + brick.y) * dims + brick.x];
+}
+
+bool
+mask_bit(uvec2 mask, ivec3 offset)
+{
+  int bit = (offset.z * 4 + offset.y) * 4 + offset.x;
+  return ((bit < 32 ? mask.x : mask.y) >> (bit & 31) & 1u) != 0;
+}
+
+ivec3
+cell_at(vec3 origin, vec3 dir, float t)
+{
+  return clamp(ivec3(floor(origin + dir * (t + cell_epsilon))),
+      ivec3(0), ivec3(block_scale - 1));
+}
+
+/*
+ * Clips the ray to the block, giving where it enters and leaves and the
+ * normal of the face it enters through. Distances are in voxels from origin.
+ */
+bool
+enter_block(vec3 origin, vec3 inv_dir, out float t, out float t_exit, out vec3 normal)
+{
+  vec3 t0 = -origin * inv_dir;
+  vec3 t1 = (vec3(block_scale) - origin) * inv_dir;
+  vec3 t_low = min(t0, t1), t_high = max(t0, t1);
+  t = max(max(t_low.x, t_low.y), max(t_low.z, 0.0f));
+  t_exit = min(min(t_high.x, t_high.y), t_high.z);
+  normal = vec3(0.0f, 0.0f, 0.0f);
+  if (t == t_low.x)
+    normal.x = -sign(inv_dir.x);
+  else if (t == t_low.y)
+    normal.y = -sign(inv_dir.y);
+  else if (t == t_low.z)
+    normal.z = -sign(inv_dir.z);
+  return t < t_exit;
+}
+
+/* Where the ray leaves the box from low to high, and through which face. */
+float
+leave_box(vec3 origin, vec3 dir, vec3 inv_dir, vec3 low, vec3 high, out vec3 normal)
+{
+  vec3 t_next = (mix(low, high, greaterThanEqual(dir, vec3(0.0f))) - origin) * inv_dir;
+  if (t_next.x < t_next.y && t_next.x < t_next.z) {
+    normal = vec3(-sign(dir.x), 0.0f, 0.0f);
+    return t_next.x;
+  } else if (t_next.y < t_next.z) {
+    normal = vec3(0.0f, -sign(dir.y), 0.0f);
+    return t_next.y;
+  }
+  normal = vec3(0.0f, 0.0f, -sign(dir.z));
+  return t_next.z;
+}
+
+/*
+ * Walks the ray voxel by voxel through the brick it is in at t. The brick's
+ * mask is loaded once and the voxel image is only read where it has a bit
+ * set, an empty brick reads nothing more. Returns whether it hit.
+ */
+bool
+trace_brick(vec3 origin, vec3 dir, vec3 inv_dir, float t, float t_exit, inout HitData hit)
+{
+  ivec3 pos, brick;
+  uvec2 mask;
+  uint voxel;
+
+  pos = cell_at(origin, dir, t);
+  brick = pos >> 2;
+  mask = brick_mask(brick);
+  if (mask == uvec2(0u))
+    return false;
+  while (t < t_exit && (pos >> 2) == brick) {
+    if (mask_bit(mask, pos & 3)) {
+      voxel = imageLoad(block_voxels, pos).x;
+      if (voxel != 0) {
+        hit.distance = t;
+        hit.voxel = voxel;
+        return true;
+      }
+    }
+    t = leave_box(origin, dir, inv_dir, vec3(pos), vec3(pos) + 1.0f, hit.normal);
+    pos = cell_at(origin, dir, t);
+  }
+  return false;
+}
+
+/*
+ * Walks the occupancy pyramid from its top level: occupied cells are
+ * descended into, empty ones are stepped over whole, and stepping into a
+ * new parent cell climbs back a level. Only level 0 reads the voxel image.
+ * With packed occupancy the walk stops at level 2, whose 4x4x4 cells are
+ * traced through their brick masks instead of the two levels below.
+ */
+HitData
+trace_occupancy(vec3 origin, vec3 dir)
+{
+  vec3 inv_dir, cell_low;
+  ivec3 pos, next;
+  float t, t_exit;
+  int level, top;
+  uint voxel;
+  HitData hit, no_hit;
+
+  no_hit.distance = 0.0f;
+  no_hit.voxel = 0;
+  no_hit.normal = vec3(0.0f, 0.0f, 0.0f);
+  inv_dir = 1.0f / dir;
+  if (!enter_block(origin, inv_dir, t, t_exit, hit.normal))
+    return no_hit;
+
+  top = block_packed_occupancy != 0 ? max(int(occupancy_top), 2) : int(occupancy_top);
+  level = top;
+  pos = cell_at(origin, dir, t);
+  while (t < t_exit) {
+    if (block_packed_occupancy != 0 && level == 2) {
+      if (trace_brick(origin, dir, inv_dir, t, t_exit, hit))
+        return hit;
+    } else if (level > 0 && cell_occupied(level, pos >> level)) {
+      level--;
+      continue;
+    } else if (level == 0) {
+      voxel = imageLoad(block_voxels, pos).x;
+      if (voxel != 0) {
+        hit.distance = t;
+        hit.voxel = voxel;
+        return hit;
+      }
+    }
+
+    cell_low = vec3((pos >> level) << level);
+    t = leave_box(origin, dir, inv_dir, cell_low, cell_low + float(1 << level), hit.normal);
+    next = cell_at(origin, dir, t);
+    if (level < top && (next >> (level + 1)) != (pos >> (level + 1)))
+      level++;
+    pos = next;
+  }
+  return no_hit;
+}
+
+/*
+ * Leaps over the cube of voxels around each empty one that its distance to
+ * the nearest solid voxel proves empty.
+ */
+HitData
+trace_distance_field(vec3 origin, vec3 dir)
+{
+  vec3 inv_dir;
+  ivec3 pos;
+  float t, t_exit;
+  uint voxel, distance;
+  HitData hit, no_hit;
+
+  no_hit.distance = 0.0f;
+  no_hit.voxel = 0;
+  no_hit.normal = vec3(0.0f, 0.0f, 0.0f);
+  inv_dir = 1.0f / dir;
+  if (!enter_block(origin, inv_dir, t, t_exit, hit.normal))
+    return no_hit;
+
+  while (t < t_exit) {
+    pos = cell_at(origin, dir, t);
+    distance = imageLoad(block_distances, pos).x;
+    if (distance == 0) {
+      voxel = imageLoad(block_voxels, pos).x;
+      hit.distance = t;
+      hit.voxel = voxel;
+      return hit;
+    }
+    t = leave_box(origin, dir, inv_dir, vec3(pos) - float(distance - 1),
+        vec3(pos) + float(distance), hit.normal);
+  }
+  return no_hit;
+}
+
+HitData
+trace_ray(vec3 origin, vec3 dir)
+{
+  if (block_distance_field != 0)
+    return trace_distance_field(origin, dir);
+  return trace_occupancy(origin, dir);
+}
+
+float
+compute_illumination(vec3 normal, vec3 viewer)
+{
+  vec3 reflection;
+  float illumination;
+  reflection = 2 * normal * dot(normal, -light_dir) + light_dir;
+  illumination
+    = mat_diffuse * light_diffuse * dot(normal, -light_dir)
+    + mat_specular * light_specular * pow(dot(reflection, viewer), mat_shininess)
+    + mat_ambient;
+  return illumination;
+}
@@ -1,28 +1,590 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include "block_allocation.h"
+#include "utils.h"
+
+#define TLSF_SL_BITS 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_BITS)
+#define TLSF_FL_COUNT 64
+
+/*
+ * TLSF bookkeeping lives on the host since the managed ranges are usually
+ * in device memory. Blocks are nodes in a pool, linked to their physical
+ * neighbours and to the free list of their size class; unused nodes are
+ * chained through next_free.
+ */
+struct tlsf_block {
+  long offset, size;
+  int free;
+  int prev_phys, next_phys;
+  int prev_free, next_free;
+};
+
+/* Open addressing entry mapping the offset of a live block to its node. */
+struct tlsf_live_entry {
+  long offset;
+  int block;
+};
+
+struct tlsf {
+  uint64_t fl_bitmap;
+  uint32_t sl_bitmap[TLSF_FL_COUNT];
+  int heads[TLSF_FL_COUNT][TLSF_SL_COUNT];
+  struct tlsf_block *blocks;
+  int block_capacity, unused_block, first_block;
+  struct tlsf_live_entry *live;
+  int live_capacity, live_count;
+};
+
+static long align_offset(long offset, long alignment);
+static int find_block(const struct block_allocation_table *table, long offset);
+static void insert_block(struct block_allocation_table *table, int index,
+    long offset, long size);
+static void remove_blocks(struct block_allocation_table *table, int index, int count);
+static long list_allocate(struct block_allocation_table *table, long block_size,
+    long alignment);
+static void list_free(struct block_allocation_table *table, long offset);
+static int tlsf_log2(uint64_t x);
+static void tlsf_mapping(long size, int *fl, int *sl);
+static int tlsf_new_block(struct tlsf *tlsf);
+static void tlsf_release_block(struct tlsf *tlsf, int block);
+static void tlsf_insert_free(struct tlsf *tlsf, int block);
+static void tlsf_remove_free(struct tlsf *tlsf, int block);
+static uint32_t tlsf_hash_offset(long offset);
+static void tlsf_live_insert(struct tlsf *tlsf, long offset, int block);
+static int tlsf_live_remove(struct tlsf *tlsf, long offset);
+static struct tlsf *tlsf_create(long size);
+static long tlsf_allocate(struct tlsf *tlsf, long block_size, long alignment);
+static void tlsf_free(struct tlsf *tlsf, long offset);
+static void tlsf_destroy(struct tlsf *tlsf);
+static void count_block(struct block_allocation_stats *stats, long size, int free);
+
+static long
+align_offset(long offset, long alignment)
+{
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+/* Binary search for the block starting at offset, -1 if there is none. */
+static int
+find_block(const struct block_allocation_table *table, long offset)
+{
+  int low, high, mid;
+  low = 0;
+  high = table->block_count - 1;
+  while (low <= high) {
+    mid = (low + high) / 2;
+    if (table->blocks[mid].offset == offset)
+      return mid;
+    if (table->blocks[mid].offset < offset)
+      low = mid + 1;
+    else
+      high = mid - 1;
+  }
+  return -1;
+}
+
+static void
+insert_block(struct block_allocation_table *table, int index, long offset,
+    long size)
+{
+  if (table->block_count == table->block_capacity) {
+    table->block_capacity *= 2;
+    table->blocks = xrealloc(table->blocks,
+        table->block_capacity * sizeof(struct allocation_block));
+  }
+  memmove(&table->blocks[index + 1], &table->blocks[index],
+      (table->block_count - index) * sizeof(struct allocation_block));
+  table->blocks[index].offset = offset;
+  table->blocks[index].size = size;
+  table->blocks[index].free = 1;
+  table->block_count++;
+}
+
+static void
+remove_blocks(struct block_allocation_table *table, int index, int count)
+{
+  memmove(&table->blocks[index], &table->blocks[index + count],
+      (table->block_count - index - count) * sizeof(struct allocation_block));
+  table->block_count -= count;
+}
+
+/*
+ * Best fit: the smallest free block that can hold an aligned block_size is
+ * split, the alignment gap before and the tail after staying free.
+ */
+static long
+list_allocate(struct block_allocation_table *table, long block_size, long alignment)
+{
+  int i, best;
+  long gap;
+  struct allocation_block *block;
+
+  best = -1;
+  for (i = 0; i < table->block_count; i++) {
+    block = &table->blocks[i];
+    if (block->free
+        && align_offset(block->offset, alignment) + block_size
+          <= block->offset + block->size
+        && (best < 0 || block->size < table->blocks[best].size)) {
+      best = i;
+      if (block->size == block_size)
+        break;
+    }
+  }
+  if (best < 0)
+    return -1;
+  gap = align_offset(table->blocks[best].offset, alignment) - table->blocks[best].offset;
+  if (gap > 0) {
+    insert_block(table, best + 1, table->blocks[best].offset + gap,
+        table->blocks[best].size - gap);
+    table->blocks[best].size = gap;
+    best++;
+  }
+  if (table->blocks[best].size > block_size)
+    insert_block(table, best + 1, table->blocks[best].offset + block_size,
+        table->blocks[best].size - block_size);
+  block = &table->blocks[best];
+  block->size = block_size;
+  block->free = 0;
+  return block->offset;
+}
+
+/* The freed block is merged with free neighbours, so no two are adjacent. */
+static void
+list_free(struct block_allocation_table *table, long offset)
+{
+  int i;
+  struct allocation_block *block;
+
+  i = find_block(table, offset);
+  if (i < 0 || table->blocks[i].free) {
+    fprintf(stderr, "Freeing unallocated block at %ld.\n", offset);
+    exit(1);
+  }
+  block = &table->blocks[i];
+  block->free = 1;
+  if (i + 1 < table->block_count && table->blocks[i + 1].free) {
+    block->size += table->blocks[i + 1].size;
+    remove_blocks(table, i + 1, 1);
+  }
+  if (i > 0 && table->blocks[i - 1].free) {
+    table->blocks[i - 1].size += block->size;
+    remove_blocks(table, i, 1);
+  }
+}
+
+static int
+tlsf_log2(uint64_t x)
+{
+  return 63 - __builtin_clzll(x);
+}
+
+/*
+ * The first level splits sizes by power of two, the second splits each power
+ * of two linearly into TLSF_SL_COUNT classes. Sizes below TLSF_SL_COUNT all
+ * share first level 0 with one class per size.
+ */
+static void
+tlsf_mapping(long size, int *fl, int *sl)
+{
+  int log;
+  if (size < TLSF_SL_COUNT) {
+    *fl = 0;
+    *sl = size;
+    return;
+  }
+  log = tlsf_log2(size);
+  *fl = log - TLSF_SL_BITS + 1;
+  *sl = (size >> (log - TLSF_SL_BITS)) ^ TLSF_SL_COUNT;
+}
+
+static int
+tlsf_new_block(struct tlsf *tlsf)
+{
+  int block, i;
+  if (tlsf->unused_block < 0) {
+    i = tlsf->block_capacity;
+    tlsf->block_capacity *= 2;
+    tlsf->blocks = xrealloc(tlsf->blocks,
+        tlsf->block_capacity * sizeof(struct tlsf_block));
+    for (; i < tlsf->block_capacity; i++)
+      tlsf->blocks[i].next_free = i + 1 < tlsf->block_capacity ? i + 1 : tlsf->unused_block;
+    tlsf->unused_block = tlsf->block_capacity / 2;
+  }
+  block = tlsf->unused_block;
+  tlsf->unused_block = tlsf->blocks[block].next_free;
+  return block;
+}
+
+static void
+tlsf_release_block(struct tlsf *tlsf, int block)
+{
+  tlsf->blocks[block].next_free = tlsf->unused_block;
+  tlsf->unused_block = block;
+}
+
+static void
+tlsf_insert_free(struct tlsf *tlsf, int block)
+{
+  int fl, sl, head;
+  tlsf_mapping(tlsf->blocks[block].size, &fl, &sl);
+  head = tlsf->heads[fl][sl];
+  tlsf->blocks[block].free = 1;
+  tlsf->blocks[block].prev_free = -1;
+  tlsf->blocks[block].next_free = head;
+  if (head >= 0)
+    tlsf->blocks[head].prev_free = block;
+  tlsf->heads[fl][sl] = block;
+  tlsf->fl_bitmap |= 1ull << fl;
+  tlsf->sl_bitmap[fl] |= 1u << sl;
+}
+
+static void
+tlsf_remove_free(struct tlsf *tlsf, int block)
+{
+  int fl, sl, prev, next;
+  tlsf_mapping(tlsf->blocks[block].size, &fl, &sl);
+  prev = tlsf->blocks[block].prev_free;
+  next = tlsf->blocks[block].next_free;
+  if (prev >= 0)
+    tlsf->blocks[prev].next_free = next;
+  else
+    tlsf->heads[fl][sl] = next;
+  if (next >= 0)
+    tlsf->blocks[next].prev_free = prev;
+  if (tlsf->heads[fl][sl] < 0) {
+    tlsf->sl_bitmap[fl] &= ~(1u << sl);
+    if (tlsf->sl_bitmap[fl] == 0)
+      tlsf->fl_bitmap &= ~(1ull << fl);
+  }
+  tlsf->blocks[block].free = 0;
+}
+
+static uint32_t
+tlsf_hash_offset(long offset)
+{
+  return ((uint64_t)offset * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+static void
+tlsf_live_insert(struct tlsf *tlsf, long offset, int block)
+{
+  struct tlsf_live_entry *old;
+  int old_capacity, i;
+  uint32_t slot, mask;
+
+  if (tlsf->live_count * 2 >= tlsf->live_capacity) {
+    old = tlsf->live;
+    old_capacity = tlsf->live_capacity;
+    tlsf->live_capacity *= 2;
+    tlsf->live = xmalloc(tlsf->live_capacity * sizeof(struct tlsf_live_entry));
+    for (i = 0; i < tlsf->live_capacity; i++)
+      tlsf->live[i].block = -1;
+    tlsf->live_count = 0;
+    for (i = 0; i < old_capacity; i++)
+      if (old[i].block >= 0)
+        tlsf_live_insert(tlsf, old[i].offset, old[i].block);
+    free(old);
+  }
+  mask = tlsf->live_capacity - 1;
+  for (slot = tlsf_hash_offset(offset) & mask; tlsf->live[slot].block >= 0;
+      slot = (slot + 1) & mask)
+    ;
+  tlsf->live[slot].offset = offset;
+  tlsf->live[slot].block = block;
+  tlsf->live_count++;
+}
+
+/*
+ * Linear probing with backward shift deletion: later entries of the probe
+ * sequence are moved into the hole so lookups never need tombstones.
+ */
+static int
+tlsf_live_remove(struct tlsf *tlsf, long offset)
+{
+  uint32_t slot, next, home, mask;
+  int block;
+
+  mask = tlsf->live_capacity - 1;
+  for (slot = tlsf_hash_offset(offset) & mask; tlsf->live[slot].block >= 0;
+      slot = (slot + 1) & mask)
+    if (tlsf->live[slot].offset == offset)
+      break;
+  if ( (block = tlsf->live[slot].block) < 0)
+    return -1;
+  for (next = (slot + 1) & mask; tlsf->live[next].block >= 0; next = (next + 1) & mask) {
+    home = tlsf_hash_offset(tlsf->live[next].offset) & mask;
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      tlsf->live[slot] = tlsf->live[next];
+      slot = next;
+    }
+  }
+  tlsf->live[slot].block = -1;
+  tlsf->live_count--;
+  return block;
+}
+
+static struct tlsf *
+tlsf_create(long size)
+{
+  struct tlsf *tlsf;
+  int fl, sl, i;
+
+  tlsf = xmalloc(sizeof(struct tlsf));
+  tlsf->fl_bitmap = 0;
+  for (fl = 0; fl < TLSF_FL_COUNT; fl++) {
+    tlsf->sl_bitmap[fl] = 0;
+    for (sl = 0; sl < TLSF_SL_COUNT; sl++)
+      tlsf->heads[fl][sl] = -1;
+  }
+  tlsf->block_capacity = 64;
+  tlsf->blocks = xmalloc(tlsf->block_capacity * sizeof(struct tlsf_block));
+  for (i = 0; i < tlsf->block_capacity; i++)
+    tlsf->blocks[i].next_free = i + 1 < tlsf->block_capacity ? i + 1 : -1;
+  tlsf->unused_block = 0;
+  tlsf->live_capacity = 64;
+  tlsf->live_count = 0;
+  tlsf->live = xmalloc(tlsf->live_capacity * sizeof(struct tlsf_live_entry));
+  for (i = 0; i < tlsf->live_capacity; i++)
+    tlsf->live[i].block = -1;
+  tlsf->first_block = -1;
+  if (size > 0) {
+    tlsf->first_block = tlsf_new_block(tlsf);
+    tlsf->blocks[tlsf->first_block].offset = 0;
+    tlsf->blocks[tlsf->first_block].size = size;
+    tlsf->blocks[tlsf->first_block].prev_phys = -1;
+    tlsf->blocks[tlsf->first_block].next_phys = -1;
+    tlsf_insert_free(tlsf, tlsf->first_block);
+  }
+  return tlsf;
+}
+
+/*
+ * The request is rounded up to the next class boundary so any block in the
+ * class found by the bitmaps fits, without walking its free list.
+ */
+static long
+tlsf_allocate(struct tlsf *tlsf, long block_size, long alignment)
+{
+  long search_size, aligned, gap;
+  int fl, sl, block, split;
+  uint64_t fl_map;
+  uint32_t sl_map;
+
+  search_size = block_size + alignment - 1;
+  if (search_size >= TLSF_SL_COUNT)
+    search_size += (1l << (tlsf_log2(search_size) - TLSF_SL_BITS)) - 1;
+  tlsf_mapping(search_size, &fl, &sl);
+  sl_map = fl < TLSF_FL_COUNT ? tlsf->sl_bitmap[fl] & (~0u << sl) : 0;
+  if (sl_map == 0) {
+    fl_map = fl + 1 < TLSF_FL_COUNT ? tlsf->fl_bitmap & (~0ull << (fl + 1)) : 0;
+    if (fl_map != 0) {
+      fl = __builtin_ctzll(fl_map);
+      sl_map = tlsf->sl_bitmap[fl];
+    }
+  }
+  if (sl_map != 0) {
+    sl = __builtin_ctz(sl_map);
+    block = tlsf->heads[fl][sl];
+  } else {
+    /* Nothing in the larger classes, the head of the exact class may fit. */
+    tlsf_mapping(block_size + alignment - 1, &fl, &sl);
+    block = tlsf->heads[fl][sl];
+    if (block < 0 || align_offset(tlsf->blocks[block].offset, alignment) + block_size
+        > tlsf->blocks[block].offset + tlsf->blocks[block].size)
+      return -1;
+  }
+  tlsf_remove_free(tlsf, block);
+
+  aligned = align_offset(tlsf->blocks[block].offset, alignment);
+  if ( (gap = aligned - tlsf->blocks[block].offset) > 0) {
+    split = tlsf_new_block(tlsf);
+    tlsf->blocks[split].offset = tlsf->blocks[block].offset;
+    tlsf->blocks[split].size = gap;
+    tlsf->blocks[split].prev_phys = tlsf->blocks[block].prev_phys;
+    tlsf->blocks[split].next_phys = block;
+    if (tlsf->blocks[split].prev_phys >= 0)
+      tlsf->blocks[tlsf->blocks[split].prev_phys].next_phys = split;
+    else
+      tlsf->first_block = split;
+    tlsf->blocks[block].prev_phys = split;
+    tlsf->blocks[block].offset = aligned;
+    tlsf->blocks[block].size -= gap;
+    tlsf_insert_free(tlsf, split);
+  }
+  if (tlsf->blocks[block].size > block_size) {
+    split = tlsf_new_block(tlsf);
+    tlsf->blocks[split].offset = aligned + block_size;
+    tlsf->blocks[split].size = tlsf->blocks[block].size - block_size;
+    tlsf->blocks[split].prev_phys = block;
+    tlsf->blocks[split].next_phys = tlsf->blocks[block].next_phys;
+    if (tlsf->blocks[split].next_phys >= 0)
+      tlsf->blocks[tlsf->blocks[split].next_phys].prev_phys = split;
+    tlsf->blocks[block].next_phys = split;
+    tlsf->blocks[block].size = block_size;
+    tlsf_insert_free(tlsf, split);
+  }
+  tlsf_live_insert(tlsf, aligned, block);
+  return aligned;
+}
+
+static void
+tlsf_free(struct tlsf *tlsf, long offset)
+{
+  int block, next, prev;
+
+  if ( (block = tlsf_live_remove(tlsf, offset)) < 0) {
+    fprintf(stderr, "Freeing unallocated block at %ld.\n", offset);
+    exit(1);
+  }
+  next = tlsf->blocks[block].next_phys;
+  if (next >= 0 && tlsf->blocks[next].free) {
+    tlsf_remove_free(tlsf, next);
+    tlsf->blocks[block].size += tlsf->blocks[next].size;
+    tlsf->blocks[block].next_phys = tlsf->blocks[next].next_phys;
+    if (tlsf->blocks[block].next_phys >= 0)
+      tlsf->blocks[tlsf->blocks[block].next_phys].prev_phys = block;
+    tlsf_release_block(tlsf, next);
+  }
+  prev = tlsf->blocks[block].prev_phys;
+  if (prev >= 0 && tlsf->blocks[prev].free) {
+    tlsf_remove_free(tlsf, prev);
+    tlsf->blocks[prev].size += tlsf->blocks[block].size;
+    tlsf->blocks[prev].next_phys = tlsf->blocks[block].next_phys;
+    if (tlsf->blocks[prev].next_phys >= 0)
+      tlsf->blocks[tlsf->blocks[prev].next_phys].prev_phys = prev;
+    tlsf_release_block(tlsf, block);
+    block = prev;
+  }
+  tlsf_insert_free(tlsf, block);
+}
+
+static void
+tlsf_destroy(struct tlsf *tlsf)
+{
+  free(tlsf->blocks);
+  free(tlsf->live);
+  free(tlsf);
+}
+
+static void
+count_block(struct block_allocation_stats *stats, long size, int free)
+{
+  if (!free) {
+    stats->live_size += size;
+    stats->live_block_count++;
+  } else if (size > 0) {
+    stats->free_size += size;
+    stats->free_block_count++;
+    if (size > stats->largest_free_block)
+      stats->largest_free_block = size;
+  }
+}
 
 void
-init_block_allocation_table(struct block_allocation_table *table, long size)
+init_block_allocation_table(struct block_allocation_table *table, long size,
+    enum block_allocator allocator)
 {
+  table->allocator = allocator;
   table->size = size;
-  table->free = 0;
+  table->bump = 0;
+  table->block_count = table->block_capacity = 0;
+  table->blocks = NULL;
+  table->tlsf = NULL;
+  switch (allocator) {
+  case BLOCK_ALLOCATOR_BUMP:
+    break;
+  case BLOCK_ALLOCATOR_LIST:
+    table->block_capacity = 16;
+    table->blocks = xmalloc(table->block_capacity * sizeof(struct allocation_block));
+    if (size > 0)
+      insert_block(table, 0, 0, size);
+    break;
+  case BLOCK_ALLOCATOR_TLSF:
+    table->tlsf = tlsf_create(size);
+    break;
+  }
 }
 
 long
 allocate_block(struct block_allocation_table *table, long block_size)
+{
+  return allocate_aligned_block(table, block_size, 1);
+}
+
+/* Returns -1 if there is no free range large enough. */
+long
+allocate_aligned_block(struct block_allocation_table *table, long block_size,
+    long alignment)
 {
   long offset;
-  offset = table->free;
-  table->free += block_size;
-  return offset;
+
+  /* Empty blocks would share an offset with their neighbour. */
+  if (block_size <= 0)
+    block_size = 1;
+  switch (table->allocator) {
+  case BLOCK_ALLOCATOR_BUMP:
+    offset = align_offset(table->bump, alignment);
+    if (offset + block_size > table->size)
+      return -1;
+    table->bump = offset + block_size;
+    return offset;
+  case BLOCK_ALLOCATOR_LIST:
+    return list_allocate(table, block_size, alignment);
+  case BLOCK_ALLOCATOR_TLSF:
+    return tlsf_allocate(table->tlsf, block_size, alignment);
+  }
+  return -1;
 }
 
 void
 free_block(struct block_allocation_table *table, long offset)
 {
-  /* TODO Implement free list. */
+  switch (table->allocator) {
+  case BLOCK_ALLOCATOR_BUMP:
+    break;
+  case BLOCK_ALLOCATOR_LIST:
+    list_free(table, offset);
+    break;
+  case BLOCK_ALLOCATOR_TLSF:
+    tlsf_free(table->tlsf, offset);
+    break;
+  }
+}
+
+void
+get_block_allocation_stats(const struct block_allocation_table *table,
+    struct block_allocation_stats *stats)
+{
+  int i;
+
+  memset(stats, 0, sizeof(*stats));
+  switch (table->allocator) {
+  case BLOCK_ALLOCATOR_BUMP:
+    stats->live_size = table->bump;
+    count_block(stats, table->size - table->bump, 1);
+    break;
+  case BLOCK_ALLOCATOR_LIST:
+    for (i = 0; i < table->block_count; i++)
+      count_block(stats, table->blocks[i].size, table->blocks[i].free);
+    break;
+  case BLOCK_ALLOCATOR_TLSF:
+    for (i = table->tlsf->first_block; i >= 0; i = table->tlsf->blocks[i].next_phys)
+      count_block(stats, table->tlsf->blocks[i].size, table->tlsf->blocks[i].free);
+    break;
+  }
+  stats->fragmentation = stats->free_size > 0
+    ? 1.0f - (float)stats->largest_free_block / stats->free_size : 0.0f;
 }
 
 void
 destroy_block_allocation_table(struct block_allocation_table *table)
 {
+  free(table->blocks);
+  if (table->tlsf)
+    tlsf_destroy(table->tlsf);
 }
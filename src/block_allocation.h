@@ -1,9 +1,48 @@
+enum block_allocator {
+  /* Never reuses freed space, only useful for comparison. */
+  BLOCK_ALLOCATOR_BUMP,
+  /* Best fit over a list of blocks sorted by offset. */
+  BLOCK_ALLOCATOR_LIST,
+  /* Two-level segregated fit, constant time allocate and free. */
+  BLOCK_ALLOCATOR_TLSF,
+};
+
+/* A range of the table, blocks are kept sorted by offset and cover it all. */
+struct allocation_block {
+  long offset, size;
+  int free;
+};
+
+struct tlsf;
+
 struct block_allocation_table {
+  enum block_allocator allocator;
   long size;
-  long free;
+  /* BLOCK_ALLOCATOR_BUMP */
+  long bump;
+  /* BLOCK_ALLOCATOR_LIST */
+  int block_count, block_capacity;
+  struct allocation_block *blocks;
+  /* BLOCK_ALLOCATOR_TLSF */
+  struct tlsf *tlsf;
+};
+
+/*
+ * fragmentation is 1 - largest_free_block / free_size, 0 when all free space
+ * is one block.
+ */
+struct block_allocation_stats {
+  long live_size, free_size, largest_free_block;
+  int live_block_count, free_block_count;
+  float fragmentation;
 };
 
-void init_block_allocation_table(struct block_allocation_table *table, long size);
+void init_block_allocation_table(struct block_allocation_table *table, long size,
+    enum block_allocator allocator);
 long allocate_block(struct block_allocation_table *table, long block_size);
+long allocate_aligned_block(struct block_allocation_table *table, long block_size,
+    long alignment);
 void free_block(struct block_allocation_table *table, long offset);
+void get_block_allocation_stats(const struct block_allocation_table *table,
+    struct block_allocation_stats *stats);
 void destroy_block_allocation_table(struct block_allocation_table *table);
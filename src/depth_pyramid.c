@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <vulkan/vulkan.h>
+#include <GLFW/glfw3.h>
+#include "matrix.h"
+#include "obj_types.h"
+#include "block_allocation.h"
+#include "lime.h"
+
+/*
+ * Each level holds the farthest depth of the texels it covers in the level
+ * below, starting from the depth image. Level 0 is the largest power of two
+ * no bigger than the depth image so every further level halves exactly.
+ */
+
+/* Must match local_size_x and local_size_y in depth_pyramid.comp. */
+#define DEPTH_PYRAMID_WORKGROUP_SIZE 8
+
+static void create_depth_pyramid_image(void);
+static void create_depth_pyramid_sampler(void);
+static void create_depth_pyramid_descriptor_pool(void);
+static void allocate_depth_pyramid_descriptor_sets(void);
+static void write_depth_pyramid_descriptor_sets(void);
+static uint32_t previous_power_of_two(uint32_t x);
+
+static VkImage pyramid_image;
+static struct lime_allocation pyramid_image_allocation;
+static VkImageView pyramid_view;
+static VkImageView level_views[MAX_DEPTH_PYRAMID_LEVELS];
+static VkSampler pyramid_sampler;
+static VkDescriptorPool descriptor_pool;
+static VkDescriptorSet level_descriptor_sets[MAX_DEPTH_PYRAMID_LEVELS];
+
+struct lime_depth_pyramid lime_depth_pyramid;
+
+static uint32_t
+previous_power_of_two(uint32_t x)
+{
+  uint32_t p;
+  for (p = 1; p * 2 <= x; p *= 2);
+  return p;
+}
+
+static void
+create_depth_pyramid_image(void)
+{
+  VkImageCreateInfo create_info;
+  VkImageViewCreateInfo view_create_info;
+  uint32_t size;
+  int i;
+  VkResult err;
+
+  lime_depth_pyramid.width = previous_power_of_two(lime_resources.swapchain_extent.width);
+  lime_depth_pyramid.height = previous_power_of_two(lime_resources.swapchain_extent.height);
+  size = lime_depth_pyramid.width > lime_depth_pyramid.height
+    ? lime_depth_pyramid.width : lime_depth_pyramid.height;
+  for (lime_depth_pyramid.level_count = 1; size > 1; size /= 2)
+    lime_depth_pyramid.level_count++;
+  assert(lime_depth_pyramid.level_count <= MAX_DEPTH_PYRAMID_LEVELS);
+
+  create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  create_info.pNext = NULL;
+  create_info.flags = 0;
+  create_info.imageType = VK_IMAGE_TYPE_2D;
+  create_info.format = VK_FORMAT_R32_SFLOAT;
+  create_info.extent.width = lime_depth_pyramid.width;
+  create_info.extent.height = lime_depth_pyramid.height;
+  create_info.extent.depth = 1;
+  create_info.mipLevels = lime_depth_pyramid.level_count;
+  create_info.arrayLayers = 1;
+  create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  create_info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.queueFamilyIndexCount = 0;
+  create_info.pQueueFamilyIndices = NULL;
+  create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  assert(pyramid_image == VK_NULL_HANDLE);
+  err = vkCreateImage(lime_device.device, &create_info, NULL, &pyramid_image);
+  ASSERT_VK_RESULT(err, "creating depth pyramid image");
+  lime_allocate_image_memory(pyramid_image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+      &pyramid_image_allocation);
+
+  view_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_create_info.pNext = NULL;
+  view_create_info.flags = 0;
+  view_create_info.image = pyramid_image;
+  view_create_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_create_info.format = VK_FORMAT_R32_SFLOAT;
+  view_create_info.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+  view_create_info.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+  view_create_info.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+  view_create_info.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+  view_create_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  view_create_info.subresourceRange.baseMipLevel = 0;
+  view_create_info.subresourceRange.levelCount = lime_depth_pyramid.level_count;
+  view_create_info.subresourceRange.baseArrayLayer = 0;
+  view_create_info.subresourceRange.layerCount = 1;
+  assert(pyramid_view == VK_NULL_HANDLE);
+  err = vkCreateImageView(lime_device.device, &view_create_info, NULL, &pyramid_view);
+  ASSERT_VK_RESULT(err, "creating depth pyramid image view");
+  view_create_info.subresourceRange.levelCount = 1;
+  for (i = 0; i < lime_depth_pyramid.level_count; i++) {
+    view_create_info.subresourceRange.baseMipLevel = i;
+    assert(level_views[i] == VK_NULL_HANDLE);
+    err = vkCreateImageView(lime_device.device, &view_create_info, NULL, &level_views[i]);
+    ASSERT_VK_RESULT(err, "creating depth pyramid level view");
+  }
+}
+
+static void
+create_depth_pyramid_sampler(void)
+{
+  VkSamplerCreateInfo create_info;
+  VkResult err;
+
+  create_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  create_info.pNext = NULL;
+  create_info.flags = 0;
+  create_info.magFilter = VK_FILTER_NEAREST;
+  create_info.minFilter = VK_FILTER_NEAREST;
+  create_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  create_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  create_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  create_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  create_info.mipLodBias = 0.0f;
+  create_info.anisotropyEnable = VK_FALSE;
+  create_info.maxAnisotropy = 1.0f;
+  create_info.compareEnable = VK_FALSE;
+  create_info.compareOp = VK_COMPARE_OP_ALWAYS;
+  create_info.minLod = 0.0f;
+  create_info.maxLod = lime_depth_pyramid.level_count;
+  create_info.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+  create_info.unnormalizedCoordinates = VK_FALSE;
+  assert(pyramid_sampler == VK_NULL_HANDLE);
+  err = vkCreateSampler(lime_device.device, &create_info, NULL, &pyramid_sampler);
+  ASSERT_VK_RESULT(err, "creating depth pyramid sampler");
+}
+
+static void
+create_depth_pyramid_descriptor_pool(void)
+{
+  VkDescriptorPoolSize pool_sizes[2];
+  VkDescriptorPoolCreateInfo create_info;
+  VkResult err;
+
+  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  pool_sizes[0].descriptorCount = MAX_DEPTH_PYRAMID_LEVELS + 1;
+  pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  pool_sizes[1].descriptorCount = MAX_DEPTH_PYRAMID_LEVELS;
+  create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  create_info.pNext = NULL;
+  create_info.flags = 0;
+  create_info.maxSets = MAX_DEPTH_PYRAMID_LEVELS + 1;
+  create_info.poolSizeCount = sizeof(pool_sizes) / sizeof(pool_sizes[0]);
+  create_info.pPoolSizes = pool_sizes;
+  assert(descriptor_pool == VK_NULL_HANDLE);
+  err = vkCreateDescriptorPool(lime_device.device, &create_info, NULL, &descriptor_pool);
+  ASSERT_VK_RESULT(err, "creating depth pyramid descriptor pool");
+}
+
+static void
+allocate_depth_pyramid_descriptor_sets(void)
+{
+  VkDescriptorSetLayout layout_copies[MAX_DEPTH_PYRAMID_LEVELS];
+  VkDescriptorSetAllocateInfo allocate_info;
+  int i;
+  VkResult err;
+
+  for (i = 0; i < lime_depth_pyramid.level_count; i++)
+    layout_copies[i] = lime_pipelines.depth_pyramid_descriptor_set_layout;
+  allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocate_info.pNext = NULL;
+  allocate_info.descriptorPool = descriptor_pool;
+  allocate_info.descriptorSetCount = lime_depth_pyramid.level_count;
+  allocate_info.pSetLayouts = layout_copies;
+  err = vkAllocateDescriptorSets(lime_device.device, &allocate_info, level_descriptor_sets);
+  ASSERT_VK_RESULT(err, "allocating depth pyramid descriptor sets");
+  allocate_info.descriptorSetCount = 1;
+  allocate_info.pSetLayouts = &lime_pipelines.occlusion_descriptor_set_layout;
+  assert(lime_depth_pyramid.occlusion_descriptor_set == VK_NULL_HANDLE);
+  err = vkAllocateDescriptorSets(lime_device.device, &allocate_info,
+      &lime_depth_pyramid.occlusion_descriptor_set);
+  ASSERT_VK_RESULT(err, "allocating occlusion descriptor set");
+}
+
+/* Level i reads level i - 1, or the depth image for level 0. */
+static void
+write_depth_pyramid_descriptor_sets(void)
+{
+  VkDescriptorImageInfo image_infos[2];
+  VkWriteDescriptorSet writes[2];
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].pNext = NULL;
+    writes[i].dstBinding = i;
+    writes[i].dstArrayElement = 0;
+    writes[i].descriptorCount = 1;
+    writes[i].pImageInfo = &image_infos[i];
+    writes[i].pBufferInfo = NULL;
+    writes[i].pTexelBufferView = NULL;
+  }
+  writes[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  image_infos[0].sampler = pyramid_sampler;
+  image_infos[1].sampler = VK_NULL_HANDLE;
+  image_infos[1].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+  for (i = 0; i < lime_depth_pyramid.level_count; i++) {
+    if (i == 0) {
+      image_infos[0].imageView = lime_resources.depth_image_view;
+      image_infos[0].imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    } else {
+      image_infos[0].imageView = level_views[i - 1];
+      image_infos[0].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    }
+    image_infos[1].imageView = level_views[i];
+    writes[0].dstSet = writes[1].dstSet = level_descriptor_sets[i];
+    vkUpdateDescriptorSets(lime_device.device, 2, writes, 0, NULL);
+  }
+
+  image_infos[0].imageView = pyramid_view;
+  image_infos[0].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+  writes[0].dstSet = lime_depth_pyramid.occlusion_descriptor_set;
+  vkUpdateDescriptorSets(lime_device.device, 1, writes, 0, NULL);
+}
+
+void
+lime_init_depth_pyramid(void)
+{
+  create_depth_pyramid_image();
+  create_depth_pyramid_sampler();
+  create_depth_pyramid_descriptor_pool();
+  allocate_depth_pyramid_descriptor_sets();
+  write_depth_pyramid_descriptor_sets();
+}
+
+/*
+ * Records the pyramid build from the depth image as left by a render pass.
+ * The depth image is back in attachment layout afterwards and the pyramid
+ * is ready for compute shader reads.
+ */
+void
+lime_record_depth_pyramid(VkCommandBuffer command_buffer)
+{
+  VkImageMemoryBarrier barriers[2];
+  uint32_t width, height;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    barriers[i].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barriers[i].pNext = NULL;
+    barriers[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[i].subresourceRange.baseMipLevel = 0;
+    barriers[i].subresourceRange.levelCount = 1;
+    barriers[i].subresourceRange.baseArrayLayer = 0;
+    barriers[i].subresourceRange.layerCount = 1;
+  }
+  barriers[0].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  barriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barriers[0].oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  barriers[0].newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+  barriers[0].image = lime_resources.depth_image;
+  barriers[0].subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+  /* The last frame's culling has read the whole pyramid, which is rebuilt. */
+  barriers[1].srcAccessMask = 0;
+  barriers[1].dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barriers[1].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barriers[1].image = pyramid_image;
+  barriers[1].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barriers[1].subresourceRange.levelCount = lime_depth_pyramid.level_count;
+  vkCmdPipelineBarrier(command_buffer,
+      VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 0, NULL, 2, barriers);
+
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      lime_pipelines.depth_pyramid_pipeline);
+  barriers[1].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barriers[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barriers[1].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barriers[1].subresourceRange.levelCount = 1;
+  for (i = 0; i < lime_depth_pyramid.level_count; i++) {
+    width = lime_depth_pyramid.width >> i ? lime_depth_pyramid.width >> i : 1;
+    height = lime_depth_pyramid.height >> i ? lime_depth_pyramid.height >> i : 1;
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+        lime_pipelines.depth_pyramid_pipeline_layout, 0, 1,
+        &level_descriptor_sets[i], 0, NULL);
+    vkCmdDispatch(command_buffer,
+        (width + DEPTH_PYRAMID_WORKGROUP_SIZE - 1) / DEPTH_PYRAMID_WORKGROUP_SIZE,
+        (height + DEPTH_PYRAMID_WORKGROUP_SIZE - 1) / DEPTH_PYRAMID_WORKGROUP_SIZE, 1);
+    barriers[1].subresourceRange.baseMipLevel = i;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 0, NULL, 1, &barriers[1]);
+  }
+
+  barriers[0].srcAccessMask = 0;
+  barriers[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+    | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  barriers[0].oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+  barriers[0].newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+      0, 0, NULL, 0, NULL, 1, &barriers[0]);
+}
+
+void
+lime_destroy_depth_pyramid(void)
+{
+  int i;
+  vkDestroyDescriptorPool(lime_device.device, descriptor_pool, NULL);
+  vkDestroySampler(lime_device.device, pyramid_sampler, NULL);
+  for (i = 0; i < lime_depth_pyramid.level_count; i++)
+    vkDestroyImageView(lime_device.device, level_views[i], NULL);
+  vkDestroyImageView(lime_device.device, pyramid_view, NULL);
+  vkDestroyImage(lime_device.device, pyramid_image, NULL);
+  lime_free_memory(&pyramid_image_allocation);
+}
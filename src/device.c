@@ -32,7 +32,6 @@ static const char * const EXTENSIONS[] = {
 static VkInstance instance;
 static VkDebugUtilsMessengerEXT debug_messenger;
 static VkPhysicalDevice physical_device;
-static VkPhysicalDeviceMemoryProperties memory_properties;
 
 struct lime_device lime_device;
 
@@ -92,7 +91,7 @@ create_instance(int validation_layers_enabled)
   app_info.applicationVersion = VK_MAKE_VERSION(0, 0, 1);
   app_info.pEngineName = "lime";
   app_info.engineVersion = VK_MAKE_VERSION(0, 0, 1);
-  app_info.apiVersion = VK_API_VERSION_1_0;
+  app_info.apiVersion = VK_API_VERSION_1_2;
 
   create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
   create_info.pNext = NULL;
@@ -193,6 +192,8 @@ select_physical_device(void)
 {
   uint32_t count;
   VkPhysicalDevice *physical_devices;
+  VkPhysicalDeviceFeatures2 features;
+  VkPhysicalDeviceVulkan12Features vulkan12_features;
   VkResult err;
   err = vkEnumeratePhysicalDevices(instance, &count, NULL);
   ASSERT_VK_RESULT(err, "enumerating physical devices");
@@ -206,7 +207,23 @@ select_physical_device(void)
   assert(physical_device == VK_NULL_HANDLE);
   physical_device = physical_devices[0];
   vkGetPhysicalDeviceProperties(physical_device, &lime_device.properties);
-  vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &lime_device.memory_properties);
+  if (lime_device.properties.apiVersion < VK_API_VERSION_1_2) {
+    fprintf(stderr, "Physical device does not support vulkan 1.2.\n");
+    exit(1);
+  }
+  memset(&vulkan12_features, 0, sizeof(vulkan12_features));
+  vulkan12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_12_FEATURES;
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features.pNext = &vulkan12_features;
+  vkGetPhysicalDeviceFeatures2(physical_device, &features);
+  /* Draws find their object data through firstInstance. */
+  if (!features.features.drawIndirectFirstInstance) {
+    fprintf(stderr, "Physical device does not support indirect first instance.\n");
+    exit(1);
+  }
+  lime_device.multi_draw_indirect = features.features.multiDrawIndirect;
+  lime_device.draw_indirect_count = vulkan12_features.drawIndirectCount;
   if (!check_physical_device_extension_support(physical_device)) {
     fprintf(stderr, "Physical device does not support required extensions.\n");
     exit(1);
@@ -237,24 +254,48 @@ select_queue_family(void)
       break;
     }
   }
-  free(properties);
   if (lime_device.graphics_family_index == count) {
     fprintf(stderr, "No graphics queue family found.\n");
     exit(1);
   }
+
+  /* Transfer only families are usually backed by a dedicated DMA engine. */
+  lime_device.transfer_family_index = lime_device.graphics_family_index;
+  for (i = 0; i < count; i++) {
+    if (properties[i].queueFlags & VK_QUEUE_TRANSFER_BIT
+        && !(properties[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+      lime_device.transfer_family_index = i;
+      break;
+    }
+  }
+  lime_device.transfer_granularity
+    = properties[lime_device.transfer_family_index].minImageTransferGranularity;
+  free(properties);
 }
 
 static void
 create_device(void)
 {
   VkDeviceCreateInfo create_info;
-  VkDeviceQueueCreateInfo queue_create_infos[1];
+  VkDeviceQueueCreateInfo queue_create_infos[2];
+  VkPhysicalDeviceVulkan12Features vulkan12_features;
+  VkPhysicalDeviceFeatures features;
   VkResult err;
 
+  memset(&vulkan12_features, 0, sizeof(vulkan12_features));
+  vulkan12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_12_FEATURES;
+  vulkan12_features.pNext = NULL;
+  vulkan12_features.timelineSemaphore = VK_TRUE;
+  vulkan12_features.drawIndirectCount = lime_device.draw_indirect_count;
+  memset(&features, 0, sizeof(features));
+  features.multiDrawIndirect = lime_device.multi_draw_indirect;
+  features.drawIndirectFirstInstance = VK_TRUE;
+
   create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-  create_info.pNext = NULL;
+  create_info.pNext = &vulkan12_features;
   create_info.flags = 0;
-  create_info.queueCreateInfoCount = sizeof(queue_create_infos) / sizeof(queue_create_infos[0]);
+  create_info.queueCreateInfoCount
+    = lime_device.transfer_family_index == lime_device.graphics_family_index ? 1 : 2;
 
   queue_create_infos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
   queue_create_infos[0].pNext = NULL;
@@ -262,6 +303,8 @@ create_device(void)
   queue_create_infos[0].queueFamilyIndex = lime_device.graphics_family_index;
   queue_create_infos[0].queueCount = 1;
   queue_create_infos[0].pQueuePriorities = &(float){1.0f};
+  queue_create_infos[1] = queue_create_infos[0];
+  queue_create_infos[1].queueFamilyIndex = lime_device.transfer_family_index;
 
   create_info.pQueueCreateInfos = queue_create_infos;
   /* TODO: Enable device layers (depricated) for compatibility. */
@@ -269,7 +312,7 @@ create_device(void)
   create_info.ppEnabledLayerNames = NULL;
   create_info.enabledExtensionCount = sizeof(EXTENSIONS) / sizeof(EXTENSIONS[0]);
   create_info.ppEnabledExtensionNames = EXTENSIONS;
-  create_info.pEnabledFeatures = NULL;
+  create_info.pEnabledFeatures = &features;
 
   assert(lime_device.device == VK_NULL_HANDLE);
   err = vkCreateDevice(physical_device, &create_info, NULL, &lime_device.device);
@@ -278,6 +321,9 @@ create_device(void)
   assert(lime_device.graphics_queue == VK_NULL_HANDLE);
   vkGetDeviceQueue(lime_device.device, lime_device.graphics_family_index, 0,
       &lime_device.graphics_queue);
+  assert(lime_device.transfer_queue == VK_NULL_HANDLE);
+  vkGetDeviceQueue(lime_device.device, lime_device.transfer_family_index, 0,
+      &lime_device.transfer_queue);
 }
 
 void
@@ -317,14 +363,37 @@ uint32_t
 lime_device_find_memory_type(uint32_t memory_type_bits, VkMemoryPropertyFlags properties)
 {
   int i;
-  for (i = 0; i < memory_properties.memoryTypeCount; i++)
+  for (i = 0; i < lime_device.memory_properties.memoryTypeCount; i++)
     if (memory_type_bits & (1 << i)
-        && (memory_properties.memoryTypes[i].propertyFlags & properties) == properties)
+        && (lime_device.memory_properties.memoryTypes[i].propertyFlags & properties)
+          == properties)
       return i;
   fprintf(stderr, "Failed to find suitable memory type.\n");
   exit(1);
 }
 
+/*
+ * Resources written by uploads are shared between the graphics and transfer
+ * families instead of having their ownership transferred after each upload.
+ */
+void
+lime_device_upload_sharing(VkSharingMode *sharing_mode, uint32_t *family_count,
+    const uint32_t **families)
+{
+  static uint32_t upload_families[2];
+  if (lime_device.transfer_family_index == lime_device.graphics_family_index) {
+    *sharing_mode = VK_SHARING_MODE_EXCLUSIVE;
+    *family_count = 0;
+    *families = NULL;
+  } else {
+    upload_families[0] = lime_device.graphics_family_index;
+    upload_families[1] = lime_device.transfer_family_index;
+    *sharing_mode = VK_SHARING_MODE_CONCURRENT;
+    *family_count = 2;
+    *families = upload_families;
+  }
+}
+
 void
 lime_destroy_device(void)
 {
@@ -20,6 +20,10 @@
 }
 
 #define MAX_SWAPCHAIN_IMAGES 8
+/* Frames the CPU may record ahead of the GPU, at most MAX_SWAPCHAIN_IMAGES. */
+#define FRAMES_IN_FLIGHT 2
+/* Enough for a 32768 texel wide depth image. */
+#define MAX_DEPTH_PYRAMID_LEVELS 16
 
 struct camera_uniform_data {
   mat4 model;
@@ -28,40 +32,183 @@ struct camera_uniform_data {
   int color;
 };
 
+/*
+ * One instance of a draw, read by the vertex shader from the object buffer
+ * through the instance buffer at gl_InstanceIndex. The position offset and
+ * scale are only read for packed vertices.
+ */
+struct object_data {
+  mat4 model;
+  float position_offset[3];
+  /* Draw this object is an instance of. */
+  uint32_t draw;
+  float position_scale[4];
+};
+
+/*
+ * A draw before culling, whose command covers all its instances from
+ * firstInstance in the object buffer. run_first is the first draw of the
+ * indirect call this draw belongs to, whose count slot and command range it
+ * is compacted into.
+ */
+struct cull_draw {
+  VkDrawIndexedIndirectCommand command;
+  uint32_t run_first;
+};
+
+/*
+ * The early phase culls objects visible in the last frame against the view
+ * frustum, the late phase culls every object against the depth pyramid.
+ * Each phase first culls instances into their draw's instance list, then
+ * writes the commands of draws with any instances left. Compact is cleared
+ * when draw counts cannot come from a buffer.
+ */
+enum cull_phase {
+  CULL_PHASE_EARLY,
+  CULL_PHASE_LATE,
+};
+
+enum cull_step {
+  CULL_STEP_INSTANCES,
+  CULL_STEP_DRAWS,
+};
+
+struct cull_push_constants {
+  mat4 voxel_block_model;
+  uint32_t draw_count, object_count, last_object_count;
+  uint32_t compact, phase, step;
+  /* Offsets of the late phase commands, counts and instances. */
+  uint32_t late_draw_offset, late_object_offset;
+};
+
+/*
+ * One mesh in the scene draw list passed to lime_draw_frame, drawn once for
+ * each of its instance_count model matrices.
+ */
+struct lime_draw {
+  const struct graphics_vertex_obj *gvo;
+  const mat4 *models;
+  int instance_count;
+};
+
 struct voxel_block_uniform_data {
   mat4 model;
   int scale;
+  /* Nonzero to leap by the distance field instead of the occupancy pyramid. */
+  int distance_field;
+  /* Nonzero for the pyramid to walk 4x4x4 cells through their brick masks. */
+  int packed_occupancy;
+};
+
+/*
+ * Per frame ray setup of the voxel block fragment shader: the camera
+ * position in block space and the camera's forward vector.
+ */
+struct voxel_block_push_constants {
+  float camera_position[4];
+  float camera_forward[4];
+};
+
+/* Maps between clip space and voxel block space for the compute tracer. */
+struct voxel_trace_push_constants {
+  mat4 clip_to_block;
+  mat4 block_to_clip;
 };
 
 struct lime_device {
   VkSurfaceKHR surface;
   VkPhysicalDeviceProperties properties;
+  VkPhysicalDeviceMemoryProperties memory_properties;
   uint32_t graphics_family_index;
+  /* Same as graphics_family_index if there is no transfer only family. */
+  uint32_t transfer_family_index;
+  /* Offset and size steps of image copies on the transfer queue. */
+  VkExtent3D transfer_granularity;
   VkDevice device;
   VkQueue graphics_queue;
+  VkQueue transfer_queue;
   VkSurfaceFormatKHR surface_format;
   VkFormat depth_format;
   VkPresentModeKHR present_mode;
+  /* Whether one indirect draw call may contain more than one draw. */
+  int multi_draw_indirect;
+  /* Whether the draw count of an indirect draw may come from a buffer. */
+  int draw_indirect_count;
+};
+
+/* A range of a pooled device memory block, see memory.c. */
+struct lime_allocation {
+  VkDeviceMemory memory;
+  VkDeviceSize offset, size;
+  /* Points at offset when the memory is host coherent, NULL otherwise. */
+  void *mapped;
+  int pool, block;
 };
 
+/*
+ * Render pass clears the attachments for the early phase, late render pass
+ * loads them for the late phase and the voxel block. They are compatible,
+ * so both begin on the swapchain framebuffers.
+ */
 struct lime_pipelines {
-  VkRenderPass render_pass, voxel_block_render_pass;
+  VkRenderPass render_pass, late_render_pass;
   VkDescriptorSetLayout camera_descriptor_set_layout, texture_descriptor_set_layout;
-  VkDescriptorSetLayout voxel_block_descriptor_set_layout;
-  VkPipelineLayout pipeline_layout, voxel_block_pipeline_layout;
-  VkPipeline pipeline, voxel_block_pipeline;
+  VkDescriptorSetLayout voxel_block_descriptor_set_layout, cull_descriptor_set_layout;
+  VkDescriptorSetLayout depth_pyramid_descriptor_set_layout, occlusion_descriptor_set_layout;
+  VkDescriptorSetLayout voxel_trace_descriptor_set_layout;
+  VkPipelineLayout pipeline_layout, voxel_block_pipeline_layout, cull_pipeline_layout;
+  VkPipelineLayout depth_pyramid_pipeline_layout, voxel_trace_pipeline_layout;
+  VkPipelineLayout voxel_composite_pipeline_layout;
+  VkPipeline pipeline, packed_pipeline, voxel_block_pipeline, cull_pipeline;
+  VkPipeline depth_pyramid_pipeline, voxel_trace_pipeline, voxel_composite_pipeline;
+};
+
+/*
+ * One frame's draws, objects, draw counts and instance counts written by the
+ * host, and what the cull shader writes from them: early and late phase
+ * indirect commands and instance lists, each object's visibility read by
+ * the next frame and the voxel block's indirect command. Commands and both
+ * counts hold the late phase at draw_capacity, instances at object_capacity.
+ */
+struct lime_draw_buffers {
+  VkBuffer draw_buffer, object_buffer, count_buffer, indirect_buffer;
+  VkBuffer instance_count_buffer, instance_buffer;
+  VkBuffer visibility_buffer, voxel_block_indirect_buffer;
+  struct lime_allocation draw_allocation, object_allocation;
+  struct lime_allocation count_allocation, indirect_allocation;
+  struct lime_allocation instance_count_allocation, instance_allocation;
+  struct lime_allocation visibility_allocation, voxel_block_indirect_allocation;
+  struct cull_draw *draws;
+  struct object_data *objects;
+  uint32_t *counts, *instance_counts;
+  VkDescriptorSet cull_descriptor_set;
+  int draw_capacity, object_capacity;
 };
 
 struct lime_resources {
   VkSwapchainKHR swapchain;
   uint32_t swapchain_image_count;
   VkExtent2D swapchain_extent;
+  VkImage depth_image;
+  VkImageView depth_image_view;
   VkFramebuffer swapchain_framebuffers[MAX_SWAPCHAIN_IMAGES];
-  VkFramebuffer voxel_block_framebuffers[MAX_SWAPCHAIN_IMAGES];
   VkDescriptorSet camera_descriptor_sets[MAX_SWAPCHAIN_IMAGES];
+  struct lime_draw_buffers draw_buffers[FRAMES_IN_FLIGHT];
+};
+
+/* Upload tickets are values of the timeline semaphore. */
+struct lime_uploads {
+  VkSemaphore semaphore;
+  uint64_t submitted_ticket;
+};
+
+enum vertex_buffer_placement {
+  VERTEX_BUFFERS_HOST_VISIBLE,
+  VERTEX_BUFFERS_DEVICE_LOCAL,
 };
 
 struct lime_vertex_buffers {
+  enum vertex_buffer_placement placement;
   struct block_allocation_table vertex_table;
   struct block_allocation_table index_table;
   VkBuffer vertex_buffer;
@@ -74,36 +221,87 @@ struct lime_textures {
 
 struct lime_voxel_blocks {
   VkDescriptorSet descriptor_set;
+  /* Places the block's unit cube, for culling. */
+  mat4 model;
+};
+
+struct lime_depth_pyramid {
+  uint32_t width, height;
+  int level_count;
+  /* The whole pyramid, sampled by the cull shader. */
+  VkDescriptorSet occlusion_descriptor_set;
+};
+
+/*
+ * When enabled the voxel block is traced by a compute shader into color and
+ * depth images the size of the swapchain, composited in the late pass,
+ * instead of ray marched over its rasterized cube.
+ */
+struct lime_voxel_trace {
+  int enabled;
+  /* The color and depth images, written by the tracer and read back. */
+  VkDescriptorSet descriptor_set;
 };
 
 extern struct lime_device lime_device;
 extern struct lime_pipelines lime_pipelines;
 extern struct lime_resources lime_resources;
+extern struct lime_uploads lime_uploads;
 extern struct lime_vertex_buffers lime_vertex_buffers;
 extern struct lime_textures lime_textures;
 extern struct lime_voxel_blocks lime_voxel_blocks;
+extern struct lime_depth_pyramid lime_depth_pyramid;
+extern struct lime_voxel_trace lime_voxel_trace;
 
 /* device.c */
 void lime_init_device(GLFWwindow *window);
 VkSurfaceCapabilitiesKHR lime_get_current_surface_capabilities(void);
 uint32_t lime_device_find_memory_type(uint32_t memory_type_bits,
     VkMemoryPropertyFlags properties);
+void lime_device_upload_sharing(VkSharingMode *sharing_mode, uint32_t *family_count,
+    const uint32_t **families);
 void lime_destroy_device(void);
 
+/* memory.c */
+void lime_init_memory(void);
+void lime_allocate_buffer_memory(VkBuffer buffer, VkMemoryPropertyFlags properties,
+    struct lime_allocation *allocation);
+void lime_allocate_image_memory(VkImage image, VkMemoryPropertyFlags properties,
+    struct lime_allocation *allocation);
+void lime_free_memory(struct lime_allocation *allocation);
+void lime_print_memory_stats(FILE *file);
+void lime_destroy_memory(void);
+
 /* pipelines.c */
 void lime_init_pipelines(void);
 void lime_destroy_pipelines(void);
 
 /* resources.c */
 void lime_init_resources(void);
-void set_camera_uniform_data(int swap_index, struct camera_uniform_data data);
+void set_camera_uniform_data(int frame, struct camera_uniform_data data);
+void lime_reserve_draw_buffers(int frame, int draw_count, int object_count);
 void lime_destroy_resources(void);
 
+/* upload.c */
+void lime_init_uploads(void);
+uint64_t lime_upload_buffer(VkBuffer buffer, VkDeviceSize offset, const void *data,
+    VkDeviceSize size);
+uint64_t lime_upload_image(VkImage image, VkExtent3D extent, VkImageLayout layout,
+    const void *data, VkDeviceSize size);
+uint64_t lime_upload_image_region(VkImage image, VkOffset3D offset, VkExtent3D extent,
+    VkImageLayout layout, const void *data, VkDeviceSize size);
+void lime_align_image_box(VkExtent3D extent, int low[3], int high[3]);
+void lime_flush_uploads(void);
+void lime_wait_for_upload(uint64_t ticket);
+void lime_destroy_uploads(void);
+
 /* vertex_buffers.c */
-void lime_init_vertex_buffers(long vertex_memory, long index_memory);
+void lime_init_vertex_buffers(long vertex_memory, long index_memory,
+    enum vertex_buffer_placement placement);
 void lime_create_graphics_vertex_obj(struct graphics_vertex_obj *gvo,
-    const struct indexed_vertex_obj *ivo);
+    const struct indexed_vertex_obj *ivo, enum vertex_format format);
 void lime_free_graphics_vertex_obj(struct graphics_vertex_obj *gvo);
+void lime_defragment_vertex_buffers(long byte_budget);
 void lime_destroy_vertex_buffers(void);
 
 /* textures.c */
@@ -113,11 +311,27 @@ void lime_destroy_textures(void);
 /* voxel_blocks.c */
 void lime_init_voxel_blocks(struct voxel_block_uniform_data uniform_data, int size,
     const char *voxels);
+void lime_update_voxel_blocks(const char *voxels, const int low[3], const int high[3]);
 void lime_destroy_voxel_blocks(void);
 
+/* depth_pyramid.c */
+void lime_init_depth_pyramid(void);
+void lime_record_depth_pyramid(VkCommandBuffer command_buffer);
+void lime_destroy_depth_pyramid(void);
+
+/* voxel_trace.c */
+void lime_init_voxel_trace(void);
+void lime_record_voxel_trace(VkCommandBuffer command_buffer,
+    const struct camera_uniform_data *camera);
+void lime_destroy_voxel_trace(void);
+
 /* renderer.c */
-void lime_init_renderer(const struct graphics_vertex_obj *gvo);
-void lime_draw_frame(struct camera_uniform_data camera);
+void lime_init_renderer(void);
+void lime_draw_frame(struct camera_uniform_data camera, const struct lime_draw *draws,
+    int draw_count);
+double lime_get_scene_pass_time(void);
+long lime_get_drawn_triangles(void);
+double lime_get_voxel_trace_time(void);
 void lime_destroy_renderer(void);
 
 /* lime_utils.c */
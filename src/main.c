@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <stdint.h>
 #include <vulkan/vulkan.h>
 #include <GLFW/glfw3.h>
@@ -13,9 +14,16 @@
 #include "obj.h"
 
 static void glfw_error_callback(int _, const char* errorString);
+static void usage(const char *program);
+static void edit_voxel_block(char *voxels, int size);
 
 static const uint32_t WIDTH = 800;
 static const uint32_t HEIGHT = 800;
+static const int OBJ_LOAD_THREADS = 8;
+/* Distance between instances of the mesh in the grid. */
+static const float COPY_SPACING = 2.5f;
+/* Voxels a side of the box the edit key flips. */
+static const int EDIT_SIZE = 4;
 
 static void
 glfw_error_callback(int _, const char* str)
@@ -24,46 +32,149 @@ glfw_error_callback(int _, const char* str)
   exit(1);
 }
 
+static void
+usage(const char *program)
+{
+  fprintf(stderr, "usage: %s [--host-visible] [--frames count] [--copies count]"
+      " [--draws count] [--block-size voxels] [--trace-voxels] [--distance-field]"
+      " [--packed-occupancy] [mesh.obj]\n", program);
+  exit(1);
+}
+
+/* Flips the voxels of a box at the centre of the block. */
+static void
+edit_voxel_block(char *voxels, int size)
+{
+  int low[3], high[3], x, y, z, i;
+  for (i = 0; i < 3; i++) {
+    low[i] = size / 2 - EDIT_SIZE / 2 > 0 ? size / 2 - EDIT_SIZE / 2 : 0;
+    high[i] = low[i] + EDIT_SIZE < size ? low[i] + EDIT_SIZE : size;
+  }
+  for (z = low[2]; z < high[2]; z++)
+    for (y = low[1]; y < high[1]; y++)
+      for (x = low[0]; x < high[0]; x++)
+        voxels[(z * size + y) * size + x] = !voxels[(z * size + y) * size + x];
+  lime_update_voxel_blocks(voxels, low, high);
+}
+
+/*
+ * With --frames the demo exits after that many frames and prints the average
+ * GPU time of the render passes and the triangles they drew after culling,
+ * run it with and without --host-visible to compare vertex buffer placements.
+ * --copies draws that many instances of the mesh in a square grid, split
+ * evenly across --draws draws; enough draws record the scene on several
+ * threads. --trace-voxels traces the voxel block once per pixel in a compute
+ * pass instead of rasterizing its cube, and also prints the trace time and
+ * rays per second. --distance-field leaps through empty voxels by their
+ * distance field rather than the occupancy pyramid. --packed-occupancy has
+ * the pyramid walk its 4x4x4 cells through bit-packed brick masks, reading
+ * the material byte only of voxels they mark solid. --block-size sets the
+ * voxels a side of the demo block. Pressing E flips the voxels of a box in
+ * the block.
+ */
 int
 main(int argc, char **argv)
 {
   GLFWwindow *window;
-  struct wavefront_obj wavefront;
   struct indexed_vertex_obj ivo;
   struct graphics_vertex_obj gvo;
+  struct lime_draw *draws;
+  mat4 *models;
   struct camera camera;
   struct camera_uniform_data camera_uniform_data;
   struct voxel_block_uniform_data block_uniform_data;
-  int block_size, i;
+  enum vertex_buffer_placement placement;
+  const char *mesh_fname;
+  int bench_frames, frame, timed_frames, copies, draw_count, grid_size;
+  int trace_voxels, distance_field, packed_occupancy;
+  double scene_pass_time, total_scene_pass_time, total_voxel_trace_time;
+  double total_drawn_triangles;
+  int block_size, edit_key, edit_key_held, i;
   char *voxels;
 
+  placement = VERTEX_BUFFERS_DEVICE_LOCAL;
+  mesh_fname = "viking_room.obj";
+  bench_frames = 0;
+  copies = 1;
+  draw_count = 1;
+  block_size = 16;
+  trace_voxels = 0;
+  distance_field = 0;
+  packed_occupancy = 0;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--host-visible") == 0)
+      placement = VERTEX_BUFFERS_HOST_VISIBLE;
+    else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+      bench_frames = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--copies") == 0 && i + 1 < argc)
+      copies = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--draws") == 0 && i + 1 < argc)
+      draw_count = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--block-size") == 0 && i + 1 < argc)
+      block_size = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--trace-voxels") == 0)
+      trace_voxels = 1;
+    else if (strcmp(argv[i], "--distance-field") == 0)
+      distance_field = 1;
+    else if (strcmp(argv[i], "--packed-occupancy") == 0)
+      packed_occupancy = 1;
+    else if (argv[i][0] != '-')
+      mesh_fname = argv[i];
+    else
+      usage(argv[0]);
+  }
+  if (copies < 1 || draw_count < 1 || draw_count > copies || block_size < 1)
+    usage(argv[0]);
+
   glfwSetErrorCallback(glfw_error_callback);
   glfwInit();
   glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
   glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
   window = glfwCreateWindow(WIDTH, HEIGHT, "lime demo", NULL, NULL);
 
-  load_wavefront_obj(&wavefront, "viking_room.obj");
-  wavefront_to_indexed_vertex_obj(&ivo, &wavefront);
-  block_size = 16;
+  load_indexed_vertex_obj(&ivo, mesh_fname, OBJ_LOAD_THREADS, 1);
   voxels = xmalloc(block_size * block_size * block_size);
   for (i = 0; i < block_size * block_size * block_size; i++)
     voxels[i] = (i % 10 == 0) ? 1 : 0;
   mat4_view(block_uniform_data.model, 0.0f, 0.0f, -0.4f, 0.0f, -0.55f);
-  block_uniform_data.scale = 16;
+  block_uniform_data.scale = block_size;
+  block_uniform_data.distance_field = distance_field;
+  block_uniform_data.packed_occupancy = packed_occupancy;
 
   lime_init_device(window);
+  lime_init_memory();
+  lime_init_uploads();
   lime_init_pipelines();
   lime_init_resources();
-  lime_init_vertex_buffers(32000, 32000);
-  lime_create_graphics_vertex_obj(&gvo, &ivo);
+  lime_init_depth_pyramid();
+  lime_init_vertex_buffers(ivo.vertex_count * sizeof(struct vertex),
+      ivo.index_count * sizeof(uint32_t), placement);
+  lime_create_graphics_vertex_obj(&gvo, &ivo, VERTEX_FORMAT_PACKED);
   lime_init_textures("viking_room.png");
   lime_init_voxel_blocks(block_uniform_data, block_size, voxels);
-  lime_init_renderer(&gvo);
+  if (trace_voxels)
+    lime_init_voxel_trace();
+  lime_init_renderer();
+#ifdef DEBUG
+  lime_print_memory_stats(stdout);
+#endif
 
-  destroy_wavefront_obj(&wavefront);
   destroy_indexed_vertex_obj(&ivo);
-  free(voxels);
+
+  grid_size = ceil(sqrt(copies));
+  models = xmalloc(copies * sizeof(mat4));
+  for (i = 0; i < copies; i++) {
+    mat4_identity(models[i]);
+    models[i][12] = (i % grid_size - (grid_size - 1) / 2.0f) * COPY_SPACING;
+    models[i][13] = (i / grid_size - (grid_size - 1) / 2.0f) * COPY_SPACING;
+  }
+  draws = xmalloc(draw_count * sizeof(struct lime_draw));
+  for (i = 0; i < draw_count; i++) {
+    draws[i].gvo = &gvo;
+    draws[i].models = (const mat4 *)models + (long)copies * i / draw_count;
+    draws[i].instance_count = (long)copies * (i + 1) / draw_count
+      - (long)copies * i / draw_count;
+  }
 
   camera.x = camera.y = camera.z = 0.0f;
   camera.yaw = camera.pitch = 0.0f;
@@ -71,20 +182,58 @@ main(int argc, char **argv)
   mat4_view(camera_uniform_data.model, 3.141592f * 1.5f, 0.0f, 0.0f, 0.0f, 0.0f);
   camera_uniform_data.color = 0;
 
-  while (!glfwWindowShouldClose(window)) {
+  timed_frames = 0;
+  total_scene_pass_time = 0.0;
+  total_voxel_trace_time = 0.0;
+  total_drawn_triangles = 0.0;
+  edit_key_held = 0;
+  for (frame = 0; !glfwWindowShouldClose(window)
+      && (bench_frames == 0 || frame < bench_frames); frame++) {
     glfwPollEvents();
     process_camera_input(&camera, window);
+    edit_key = glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS;
+    if (edit_key && !edit_key_held)
+      edit_voxel_block(voxels, block_size);
+    edit_key_held = edit_key;
     mat4_view(camera_uniform_data.view, camera.pitch, camera.yaw, camera.x, camera.y, camera.z);
-    lime_draw_frame(camera_uniform_data);
+    lime_draw_frame(camera_uniform_data, draws, draw_count);
     camera_uniform_data.color = (camera_uniform_data.color + 1) % 256;
+    scene_pass_time = lime_get_scene_pass_time();
+    if (scene_pass_time >= 0.0) {
+      total_scene_pass_time += scene_pass_time;
+      total_voxel_trace_time += lime_get_voxel_trace_time();
+      total_drawn_triangles += lime_get_drawn_triangles();
+      timed_frames++;
+    }
   }
+  if (bench_frames > 0 && timed_frames > 0)
+    printf("%s, %s vertex buffers: %d triangles, %.0f drawn after culling,"
+        " render passes %.3f ms, %.1f M triangles/s.\n", mesh_fname,
+        placement == VERTEX_BUFFERS_DEVICE_LOCAL ? "device local" : "host visible",
+        gvo.index_count / 3 * copies, total_drawn_triangles / timed_frames,
+        total_scene_pass_time / timed_frames,
+        total_drawn_triangles / total_scene_pass_time * 1e-3);
+  if (bench_frames > 0 && timed_frames > 0 && trace_voxels)
+    printf("voxel trace %.3f ms, %.1f M rays/s.\n",
+        total_voxel_trace_time / timed_frames,
+        (double)lime_resources.swapchain_extent.width
+        * lime_resources.swapchain_extent.height
+        / (total_voxel_trace_time / timed_frames) * 1e-3);
   vkDeviceWaitIdle(lime_device.device);
   lime_destroy_renderer();
+  free(draws);
+  free(models);
+  free(voxels);
+  if (trace_voxels)
+    lime_destroy_voxel_trace();
   lime_destroy_voxel_blocks();
   lime_destroy_textures();
   lime_destroy_vertex_buffers();
+  lime_destroy_depth_pyramid();
   lime_destroy_resources();
   lime_destroy_pipelines();
+  lime_destroy_uploads();
+  lime_destroy_memory();
   lime_destroy_device();
   return 0;
 }
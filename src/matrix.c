@@ -81,3 +81,68 @@ mat4_view(mat4 m, float pitch, float yaw, float x, float y, float z)
   m[14] = -x * m[2] - y * m[6] - z * m[10];
   m[15] = 1.0f;
 }
+
+/* m = a * b, m must not alias a or b. */
+void
+mat4_multiply(mat4 m, const mat4 a, const mat4 b)
+{
+  int row, col, i;
+  for (col = 0; col < 4; col++) {
+    for (row = 0; row < 4; row++) {
+      m[col * 4 + row] = 0.0f;
+      for (i = 0; i < 4; i++)
+        m[col * 4 + row] += a[i * 4 + row] * b[col * 4 + i];
+    }
+  }
+}
+
+/*
+ * Inverts a by its adjugate over its determinant. Returns 0 and leaves m
+ * untouched if a is singular, m must not alias a.
+ */
+int
+mat4_inverse(mat4 m, const mat4 a)
+{
+  float s[6], c[6], det;
+  int i;
+
+  s[0] = a[0] * a[5] - a[4] * a[1];
+  s[1] = a[0] * a[6] - a[4] * a[2];
+  s[2] = a[0] * a[7] - a[4] * a[3];
+  s[3] = a[1] * a[6] - a[5] * a[2];
+  s[4] = a[1] * a[7] - a[5] * a[3];
+  s[5] = a[2] * a[7] - a[6] * a[3];
+  c[0] = a[8] * a[13] - a[12] * a[9];
+  c[1] = a[8] * a[14] - a[12] * a[10];
+  c[2] = a[8] * a[15] - a[12] * a[11];
+  c[3] = a[9] * a[14] - a[13] * a[10];
+  c[4] = a[9] * a[15] - a[13] * a[11];
+  c[5] = a[10] * a[15] - a[14] * a[11];
+  det = s[0] * c[5] - s[1] * c[4] + s[2] * c[3] + s[3] * c[2] - s[4] * c[1] + s[5] * c[0];
+  if (det == 0.0f)
+    return 0;
+
+  m[ 0] = a[5] * c[5] - a[6] * c[4] + a[7] * c[3];
+  m[ 1] = -a[1] * c[5] + a[2] * c[4] - a[3] * c[3];
+  m[ 2] = a[13] * s[5] - a[14] * s[4] + a[15] * s[3];
+  m[ 3] = -a[9] * s[5] + a[10] * s[4] - a[11] * s[3];
+
+  m[ 4] = -a[4] * c[5] + a[6] * c[2] - a[7] * c[1];
+  m[ 5] = a[0] * c[5] - a[2] * c[2] + a[3] * c[1];
+  m[ 6] = -a[12] * s[5] + a[14] * s[2] - a[15] * s[1];
+  m[ 7] = a[8] * s[5] - a[10] * s[2] + a[11] * s[1];
+
+  m[ 8] = a[4] * c[4] - a[5] * c[2] + a[7] * c[0];
+  m[ 9] = -a[0] * c[4] + a[1] * c[2] - a[3] * c[0];
+  m[10] = a[12] * s[4] - a[13] * s[2] + a[15] * s[0];
+  m[11] = -a[8] * s[4] + a[9] * s[2] - a[11] * s[0];
+
+  m[12] = -a[4] * c[3] + a[5] * c[1] - a[6] * c[0];
+  m[13] = a[0] * c[3] - a[1] * c[1] + a[2] * c[0];
+  m[14] = -a[12] * s[3] + a[13] * s[1] - a[14] * s[0];
+  m[15] = a[8] * s[3] - a[9] * s[1] + a[10] * s[0];
+
+  for (i = 0; i < 16; i++)
+    m[i] /= det;
+  return 1;
+}
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <vulkan/vulkan.h>
+#include <GLFW/glfw3.h>
+#include "matrix.h"
+#include "obj_types.h"
+#include "block_allocation.h"
+#include "lime.h"
+#include "utils.h"
+
+#define MEMORY_BLOCK_SIZE (64l << 20)
+#define POOL_COUNT (VK_MAX_MEMORY_TYPES * 2)
+
+/*
+ * One vkAllocateMemory. Host coherent blocks stay mapped for their whole life
+ * so suballocations never map (which would map the same memory twice).
+ * Non-coherent memory is left unmapped, writes through it would need flushes.
+ */
+struct memory_block {
+  VkDeviceMemory memory;
+  VkDeviceSize size;
+  char *mapped;
+  int allocation_count;
+  struct block_allocation_table table;
+};
+
+/*
+ * Linear resources (buffers) and optimal tiling images get separate pools so
+ * they never share a bufferImageGranularity page.
+ */
+struct memory_pool {
+  uint32_t memory_type;
+  int linear;
+  int block_count, block_capacity;
+  struct memory_block *blocks;
+};
+
+static VkDeviceSize pool_block_size(const struct memory_pool *pool);
+static int create_memory_block(struct memory_pool *pool, VkDeviceSize size);
+static void destroy_memory_block(struct memory_block *block);
+static void allocate_memory(const VkMemoryRequirements *requirements,
+    VkMemoryPropertyFlags properties, int linear, struct lime_allocation *allocation);
+
+static struct memory_pool pools[POOL_COUNT];
+
+static VkDeviceSize
+pool_block_size(const struct memory_pool *pool)
+{
+  VkDeviceSize heap_size;
+  heap_size = lime_device.memory_properties.memoryHeaps[
+    lime_device.memory_properties.memoryTypes[pool->memory_type].heapIndex].size;
+  return heap_size / 8 < MEMORY_BLOCK_SIZE ? heap_size / 8 : MEMORY_BLOCK_SIZE;
+}
+
+/* Returns the index of the new block, reusing a destroyed block's slot. */
+static int
+create_memory_block(struct memory_pool *pool, VkDeviceSize size)
+{
+  VkMemoryAllocateInfo allocate_info;
+  struct memory_block *block;
+  int i;
+  VkResult err;
+
+  for (i = 0; i < pool->block_count; i++)
+    if (pool->blocks[i].memory == VK_NULL_HANDLE)
+      break;
+  if (i == pool->block_count) {
+    if (pool->block_count == pool->block_capacity) {
+      pool->block_capacity = pool->block_capacity ? pool->block_capacity * 2 : 4;
+      pool->blocks = xrealloc(pool->blocks,
+          pool->block_capacity * sizeof(struct memory_block));
+    }
+    pool->block_count++;
+  }
+  block = &pool->blocks[i];
+  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocate_info.pNext = NULL;
+  allocate_info.allocationSize = size;
+  allocate_info.memoryTypeIndex = pool->memory_type;
+  err = vkAllocateMemory(lime_device.device, &allocate_info, NULL, &block->memory);
+  ASSERT_VK_RESULT(err, "allocating device memory block");
+  block->size = size;
+  block->mapped = NULL;
+  if (lime_device.memory_properties.memoryTypes[pool->memory_type].propertyFlags
+      & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) {
+    err = vkMapMemory(lime_device.device, block->memory, 0, VK_WHOLE_SIZE, 0,
+        (void **)&block->mapped);
+    ASSERT_VK_RESULT(err, "mapping device memory block");
+  }
+  block->allocation_count = 0;
+  init_block_allocation_table(&block->table, size, BLOCK_ALLOCATOR_TLSF);
+  return i;
+}
+
+static void
+destroy_memory_block(struct memory_block *block)
+{
+  destroy_block_allocation_table(&block->table);
+  vkFreeMemory(lime_device.device, block->memory, NULL);
+  block->memory = VK_NULL_HANDLE;
+}
+
+/*
+ * First fit over the pool's blocks. Requests larger than a block get a
+ * dedicated block of their own size.
+ */
+static void
+allocate_memory(const VkMemoryRequirements *requirements,
+    VkMemoryPropertyFlags properties, int linear, struct lime_allocation *allocation)
+{
+  struct memory_pool *pool;
+  struct memory_block *block;
+  VkDeviceSize block_size;
+  long offset;
+  int i;
+
+  allocation->pool = lime_device_find_memory_type(requirements->memoryTypeBits,
+      properties) * 2 + linear;
+  pool = &pools[allocation->pool];
+  offset = -1;
+  for (i = 0; i < pool->block_count && offset < 0; i++)
+    if (pool->blocks[i].memory != VK_NULL_HANDLE)
+      offset = allocate_aligned_block(&pool->blocks[i].table, requirements->size,
+          requirements->alignment);
+  if (offset >= 0) {
+    i--;
+  } else {
+    block_size = pool_block_size(pool);
+    i = create_memory_block(pool,
+        requirements->size > block_size ? requirements->size : block_size);
+    offset = allocate_aligned_block(&pool->blocks[i].table, requirements->size,
+        requirements->alignment);
+    assert(offset == 0);
+  }
+  block = &pool->blocks[i];
+  block->allocation_count++;
+  allocation->block = i;
+  allocation->memory = block->memory;
+  allocation->offset = offset;
+  allocation->size = requirements->size;
+  allocation->mapped = block->mapped ? block->mapped + offset : NULL;
+}
+
+void
+lime_init_memory(void)
+{
+  int i;
+  for (i = 0; i < POOL_COUNT; i++) {
+    pools[i].memory_type = i / 2;
+    pools[i].linear = i % 2;
+    pools[i].block_count = pools[i].block_capacity = 0;
+    pools[i].blocks = NULL;
+  }
+}
+
+void
+lime_allocate_buffer_memory(VkBuffer buffer, VkMemoryPropertyFlags properties,
+    struct lime_allocation *allocation)
+{
+  VkMemoryRequirements requirements;
+  VkResult err;
+  vkGetBufferMemoryRequirements(lime_device.device, buffer, &requirements);
+  allocate_memory(&requirements, properties, 1, allocation);
+  err = vkBindBufferMemory(lime_device.device, buffer, allocation->memory,
+      allocation->offset);
+  ASSERT_VK_RESULT(err, "binding buffer memory");
+}
+
+/* Images are assumed to use optimal tiling. */
+void
+lime_allocate_image_memory(VkImage image, VkMemoryPropertyFlags properties,
+    struct lime_allocation *allocation)
+{
+  VkMemoryRequirements requirements;
+  VkResult err;
+  vkGetImageMemoryRequirements(lime_device.device, image, &requirements);
+  allocate_memory(&requirements, properties, 0, allocation);
+  err = vkBindImageMemory(lime_device.device, image, allocation->memory,
+      allocation->offset);
+  ASSERT_VK_RESULT(err, "binding image memory");
+}
+
+/* Empty blocks are released, except the last one left in a pool. */
+void
+lime_free_memory(struct lime_allocation *allocation)
+{
+  struct memory_pool *pool;
+  struct memory_block *block;
+  int i, live_blocks;
+
+  pool = &pools[allocation->pool];
+  block = &pool->blocks[allocation->block];
+  free_block(&block->table, allocation->offset);
+  allocation->memory = VK_NULL_HANDLE;
+  if (--block->allocation_count > 0)
+    return;
+  live_blocks = 0;
+  for (i = 0; i < pool->block_count; i++)
+    if (pool->blocks[i].memory != VK_NULL_HANDLE)
+      live_blocks++;
+  if (live_blocks > 1 || block->size > pool_block_size(pool))
+    destroy_memory_block(block);
+}
+
+/*
+ * Wasted bytes are free bytes outside each block's largest free range, which
+ * a request as large as that range could not use.
+ */
+void
+lime_print_memory_stats(FILE *file)
+{
+  struct block_allocation_stats stats;
+  struct memory_pool *pool;
+  int i, j, block_count, allocation_count;
+  VkDeviceSize total, used, wasted;
+
+  block_count = allocation_count = 0;
+  total = used = wasted = 0;
+  for (i = 0; i < POOL_COUNT; i++) {
+    pool = &pools[i];
+    for (j = 0; j < pool->block_count; j++) {
+      if (pool->blocks[j].memory == VK_NULL_HANDLE)
+        continue;
+      get_block_allocation_stats(&pool->blocks[j].table, &stats);
+      fprintf(file, "  memory type %2u %-7s block %d: %8.2f MiB, %8.2f MiB used by %d"
+          " allocations, largest free %8.2f MiB, %8.2f MiB wasted\n",
+          pool->memory_type, pool->linear ? "linear" : "optimal", j,
+          pool->blocks[j].size / 1048576.0, stats.live_size / 1048576.0,
+          stats.live_block_count, stats.largest_free_block / 1048576.0,
+          (stats.free_size - stats.largest_free_block) / 1048576.0);
+      block_count++;
+      allocation_count += stats.live_block_count;
+      total += pool->blocks[j].size;
+      used += stats.live_size;
+      wasted += stats.free_size - stats.largest_free_block;
+    }
+  }
+  fprintf(file, "Device memory: %d blocks, %.2f MiB allocated, %.2f MiB used by %d"
+      " allocations, %.2f MiB wasted.\n", block_count, total / 1048576.0,
+      used / 1048576.0, allocation_count, wasted / 1048576.0);
+}
+
+void
+lime_destroy_memory(void)
+{
+  int i, j;
+  for (i = 0; i < POOL_COUNT; i++) {
+    for (j = 0; j < pools[i].block_count; j++) {
+      if (pools[i].blocks[j].memory == VK_NULL_HANDLE)
+        continue;
+      if (pools[i].blocks[j].allocation_count > 0)
+        fprintf(stderr, "Leaked %d allocations of memory type %u.\n",
+            pools[i].blocks[j].allocation_count, pools[i].memory_type);
+      destroy_memory_block(&pools[i].blocks[j]);
+    }
+    free(pools[i].blocks);
+    pools[i].blocks = NULL;
+    pools[i].block_count = pools[i].block_capacity = 0;
+  }
+}
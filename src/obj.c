@@ -3,135 +3,568 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "obj_types.h"
 #include "obj.h"
 #include "utils.h"
 
-char line_buffer[256];
+#define MAX_OBJ_THREADS 64
+#define MIN_OBJ_CHUNK_SIZE (1 << 20)
+#define LMESH_MAGIC 0x48534d4c
+#define LMESH_VERSION 1
+#define LMESH_HASH_SPAN (64 * 1024)
+/* Mantissas below this stay exact in a double after another digit. */
+#define EXACT_MANTISSA_LIMIT ((1ull << 53) / 10)
+#define LMESH_PATH_MAX 4096
+#define LMESH_OPTIMIZED 1
+#define VERTEX_CACHE_SIZE 16
 
-void
-load_wavefront_obj(struct wavefront_obj *obj, const char *fname)
+enum obj_line_type {
+  LINE_OTHER,
+  LINE_POSITION,
+  LINE_UV,
+  LINE_NORMAL,
+  LINE_FACE,
+};
+
+/*
+ * Header of a .lmesh cache file. It is followed by vertex_count vertices and
+ * index_count indices in native byte order. The source_* fields identify the
+ * obj file the cache was built from, flags record how it was processed.
+ */
+struct lmesh_header {
+  uint32_t magic, version, vertex_size, vertex_count, index_count, flags;
+  uint64_t source_size, source_hash;
+  int64_t source_mtime_sec, source_mtime_nsec;
+  float min[3], max[3];
+};
+
+/*
+ * A newline aligned slice of the mapped file. The *_base fields are the
+ * number of elements in all preceding chunks, so a pre-counted chunk writes
+ * straight into its final place in the shared arrays.
+ */
+struct obj_chunk {
+  const char *fname, *data, *begin, *end;
+  int position_base, uv_base, normal_base, face_base;
+  int position_count, uv_count, normal_count, face_count;
+  int position_capacity, uv_capacity, normal_capacity, face_capacity;
+  float *positions, *uvs, *normals;
+  int *position_faces, *uv_faces, *normal_faces;
+  int missing_uv, missing_normal;
+};
+
+/* A run of triangles that tipsify emitted without a cache flush. */
+struct triangle_cluster {
+  int first, count;
+  float centroid[3], normal[3], sort_key;
+};
+
+static void *grow_array(void *array, int *capacity, int required, size_t element_size);
+static const char *skip_spaces(const char *p, const char *end);
+static const char *skip_line(const char *p, const char *end);
+static const char *scan_int(const char *p, const char *end, int *out);
+static const char *scan_float(const char *p, const char *end, float *out);
+static const char *scan_floats(const char *p, const char *end, float *out, int count);
+static const char *scan_face_vertex(const char *p, const char *end, int *pos,
+    int *uv, int *normal);
+static int resolve_index(int index, int count);
+static void parse_error(const char *fname, const char *data, const char *p,
+    const char *what);
+static const char *map_obj_file(const char *fname, size_t *size);
+static enum obj_line_type classify_line(const char *p, const char *end);
+static void *count_chunk(void *arg);
+static void *parse_chunk(void *arg);
+static void run_chunks(struct obj_chunk *chunks, int chunk_count,
+    void *(*func)(void *));
+static uint32_t hash_vertex_key(int pos, int uv, int normal);
+static int same_corner(const struct wavefront_obj *wavefront, int a, int b);
+static void measure_vertex_cache(const struct indexed_vertex_obj *ivo,
+    float *acmr, float *atvr);
+static int skip_dead_end(const int *live, const uint32_t *dead_ends,
+    int *dead_end_count, int *cursor, int vertex_count);
+static int tipsify(const uint32_t *indices, int triangle_count,
+    int vertex_count, uint32_t *out, int *cluster_starts);
+static int compare_clusters(const void *a, const void *b);
+static void sort_clusters_for_overdraw(const struct indexed_vertex_obj *ivo,
+    const uint32_t *in, uint32_t *out, const int *cluster_starts,
+    int cluster_count);
+static void optimize_vertex_fetch(struct indexed_vertex_obj *ivo);
+static uint16_t float_to_half(float f);
+static int16_t float_to_snorm16(float f);
+static void lmesh_path(char *path, size_t size, const char *fname);
+static int stamp_source(struct lmesh_header *stamp, const char *fname);
+static int map_lmesh(struct indexed_vertex_obj *ivo, const char *path,
+    const struct lmesh_header *stamp);
+static void write_lmesh(const struct indexed_vertex_obj *ivo, const char *path,
+    const struct lmesh_header *stamp);
+
+static const double POWERS_OF_TEN[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static void *
+grow_array(void *array, int *capacity, int required, size_t element_size)
 {
-  FILE *file;
-  int pos_index, uv_index, normal_index, face_index;
-  file = fopen(fname, "r");
-  if (file == NULL) {
+  if (required <= *capacity)
+    return array;
+  while (*capacity < required)
+    *capacity = *capacity ? *capacity * 2 : 1024;
+  return xrealloc(array, *capacity * element_size);
+}
+
+static const char *
+skip_spaces(const char *p, const char *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  return p;
+}
+
+static const char *
+skip_line(const char *p, const char *end)
+{
+  p = memchr(p, '\n', end - p);
+  return p ? p + 1 : end;
+}
+
+/* Fails on values that do not fit in an int. */
+static const char *
+scan_int(const char *p, const char *end, int *out)
+{
+  int negative, value;
+  const char *digits;
+  negative = 0;
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+  digits = p;
+  value = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    if (value > (INT_MAX - (*p - '0')) / 10)
+      return NULL;
+    value = value * 10 + (*p - '0');
+  }
+  if (p == digits)
+    return NULL;
+  *out = negative ? -value : value;
+  return p;
+}
+
+/*
+ * Only plain decimal notation is accepted. Up to 15 significant digits are
+ * kept exactly in a double and scaled once by a power of ten. Rounding to
+ * double and then to float can land one ulp away from strtof in rare
+ * halfway cases, so the result is close to strtof rather than identical.
+ */
+static const char *
+scan_float(const char *p, const char *end, float *out)
+{
+  int negative, exponent, exponent_value, digit_count;
+  uint64_t mantissa;
+  double value;
+
+  negative = 0;
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+  mantissa = 0;
+  exponent = digit_count = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++, digit_count++) {
+    if (mantissa < EXACT_MANTISSA_LIMIT)
+      mantissa = mantissa * 10 + (*p - '0');
+    else
+      exponent++;
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, digit_count++) {
+      if (mantissa < EXACT_MANTISSA_LIMIT) {
+        mantissa = mantissa * 10 + (*p - '0');
+        exponent--;
+      }
+    }
+  }
+  if (digit_count == 0)
+    return NULL;
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    if ( (p = scan_int(p + 1, end, &exponent_value)) == NULL)
+      return NULL;
+    /* Far beyond float range either way, and keeps the sum from overflowing. */
+    if (exponent_value > 1000)
+      exponent_value = 1000;
+    else if (exponent_value < -1000)
+      exponent_value = -1000;
+    exponent += exponent_value;
+  }
+  value = (double)mantissa;
+  if (exponent < 0 && -exponent < sizeof(POWERS_OF_TEN) / sizeof(POWERS_OF_TEN[0]))
+    value /= POWERS_OF_TEN[-exponent];
+  else if (exponent > 0 && exponent < sizeof(POWERS_OF_TEN) / sizeof(POWERS_OF_TEN[0]))
+    value *= POWERS_OF_TEN[exponent];
+  else if (exponent != 0)
+    value *= pow(10.0, exponent);
+  *out = negative ? -(float)value : (float)value;
+  return p;
+}
+
+static const char *
+scan_floats(const char *p, const char *end, float *out, int count)
+{
+  int i;
+  for (i = 0; i < count && p; i++)
+    p = scan_float(skip_spaces(p, end), end, &out[i]);
+  return p;
+}
+
+/*
+ * Parses one 'v', 'v/t', 'v//n' or 'v/t/n' face vertex. Missing uv or normal
+ * references are returned as 0, which is never a valid obj index.
+ */
+static const char *
+scan_face_vertex(const char *p, const char *end, int *pos, int *uv, int *normal)
+{
+  *uv = *normal = 0;
+  if ( (p = scan_int(p, end, pos)) == NULL)
+    return NULL;
+  if (p == end || *p != '/')
+    return p;
+  p++;
+  if (p < end && *p != '/')
+    if ( (p = scan_int(p, end, uv)) == NULL)
+      return NULL;
+  if (p == end || *p != '/')
+    return p;
+  return scan_int(p + 1, end, normal);
+}
+
+/* Converts a one based (or negative, relative) obj index to zero based. */
+static int
+resolve_index(int index, int count)
+{
+  if (index > 0)
+    return index <= count ? index - 1 : -1;
+  if (index < 0)
+    return count + index;
+  return -1;
+}
+
+static void
+parse_error(const char *fname, const char *data, const char *p, const char *what)
+{
+  int line;
+  const char *c;
+  line = 1;
+  for (c = data; c < p; c++)
+    if (*c == '\n')
+      line++;
+  fprintf(stderr, "Error parsing obj file '%s' line %d: %s.\n", fname, line, what);
+  exit(1);
+}
+
+static const char *
+map_obj_file(const char *fname, size_t *size)
+{
+  int fd;
+  struct stat st;
+  const char *data;
+
+  if ( (fd = open(fname, O_RDONLY)) < 0) {
     fprintf(stderr, "Failed to open obj file '%s'.\n", fname);
     exit(1);
   }
-  obj->position_count = obj->uv_count = obj->normal_count = 0;
-  obj->face_count = 0;
-  while (fgets(line_buffer, sizeof(line_buffer), file)) {
-    if (line_buffer[0] == 'v' && line_buffer[1] == ' ')
-      obj->position_count++;
-    if (line_buffer[0] == 'v' && line_buffer[1] == 't' && line_buffer[2] == ' ')
-      obj->uv_count++;
-    if (line_buffer[0] == 'v' && line_buffer[1] == 'n' && line_buffer[2] == ' ')
-      obj->normal_count++;
-    if (line_buffer[0] == 'f' && line_buffer[1] == ' ')
-      obj->face_count++;
-  }
-  if (fseek(file, 0, SEEK_SET)) {
-    perror("Failed to seek in obj file");
+  if (fstat(fd, &st)) {
+    perror("Failed to stat obj file");
     exit(1);
   }
-  assert(obj->position_count);
-  obj->positions = xmalloc(obj->position_count * 3 * sizeof(float));
-  obj->position_faces = xmalloc(obj->face_count * 3 * sizeof(int));
-  if (obj->uv_count) {
-    obj->uvs = xmalloc(obj->uv_count * 2 * sizeof(float));
-    obj->uv_faces = xmalloc(obj->face_count * 3 * sizeof(int));
-  } else {
-    obj->uvs = NULL;
-    obj->uv_faces = NULL;
+  if (st.st_size == 0) {
+    fprintf(stderr, "Obj file '%s' is empty.\n", fname);
+    exit(1);
   }
-  if (obj->normal_count) {
-    obj->normals = xmalloc(obj->normal_count * 3 * sizeof(float));
-    obj->normal_faces = xmalloc(obj->face_count * 3 * sizeof(int));
-  } else {
-    obj->normals = NULL;
-    obj->normal_faces = NULL;
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    perror("Failed to map obj file");
+    exit(1);
   }
-  pos_index = uv_index = normal_index = face_index = 0;
-  while (fgets(line_buffer, sizeof(line_buffer), file)) {
-    if (line_buffer[0] == 'v' && line_buffer[1] == ' ') {
-      assert(pos_index < obj->position_count);
-      if (sscanf(line_buffer, "v %f %f %f\n",
-            &obj->positions[pos_index * 3],
-            &obj->positions[pos_index * 3 + 1],
-            &obj->positions[pos_index * 3 + 2]) != 3) {
-        fprintf(stderr, "Error parsing obj file '%s' '%s'.\n", fname, line_buffer);
-        exit(1);
-      }
-      pos_index++;
-    } else if (line_buffer[0] == 'v' && line_buffer[1] == 't' && line_buffer[2] == ' ') {
-      assert(uv_index < obj->uv_count);
-      if (sscanf(line_buffer, "vt %f %f\n",
-            &obj->uvs[uv_index * 2],
-            &obj->uvs[uv_index * 2 + 1]) != 2) {
-        fprintf(stderr, "Error parsing obj file '%s' '%s'.\n", fname, line_buffer);
-        exit(1);
-      }
-      uv_index++;
-    } else if (line_buffer[0] == 'v' && line_buffer[1] == 'n' && line_buffer[2] == ' ') {
-      assert(normal_index < obj->normal_count);
-      if (sscanf(line_buffer, "vn %f %f %f\n",
-            &obj->normals[normal_index * 3],
-            &obj->normals[normal_index * 3 + 1],
-            &obj->normals[normal_index * 3 + 2]) != 3) {
-        fprintf(stderr, "Error parsing obj file '%s' '%s'.\n", fname, line_buffer);
-        exit(1);
-      }
-      normal_index++;
-    } else if (line_buffer[0] == 'f' && line_buffer[1] == ' ') {
-      assert(face_index < obj->face_count);
-      if (sscanf(line_buffer, "f %d/%d/%d %d/%d/%d %d/%d/%d\n",
-            &obj->position_faces[face_index * 3],
-            &obj->uv_faces[face_index * 3],
-            &obj->normal_faces[face_index * 3],
-            &obj->position_faces[face_index * 3 + 1],
-            &obj->uv_faces[face_index * 3 + 1],
-            &obj->normal_faces[face_index * 3 + 1],
-            &obj->position_faces[face_index * 3 + 2],
-            &obj->uv_faces[face_index * 3 + 2],
-            &obj->normal_faces[face_index * 3 + 2]) != 9) {
-        fprintf(stderr, "Error parsing obj file '%s' '%s'.\n", fname, line_buffer);
-        exit(1);
-      }
-      obj->position_faces[face_index * 3]--;
-      obj->position_faces[face_index * 3 + 1]--;
-      obj->position_faces[face_index * 3 + 2]--;
-      obj->uv_faces[face_index * 3]--;
-      obj->uv_faces[face_index * 3 + 1]--;
-      obj->uv_faces[face_index * 3 + 2]--;
-      obj->normal_faces[face_index * 3]--;
-      obj->normal_faces[face_index * 3 + 1]--;
-      obj->normal_faces[face_index * 3 + 2]--;
-      assert(obj->position_faces[face_index * 3] >= 0 && obj->position_faces[face_index * 3] < obj->position_count);
-      assert(obj->position_faces[face_index * 3 + 1] >= 0 && obj->position_faces[face_index * 3 + 1] < obj->position_count);
-      assert(obj->position_faces[face_index * 3 + 1] >= 0 && obj->position_faces[face_index * 3 + 1] < obj->position_count);
-      if (obj->uv_faces) {
-        assert(obj->uv_faces[face_index * 3] >= 0 && obj->uv_faces[face_index * 3] < obj->uv_count);
-        assert(obj->uv_faces[face_index * 3 + 1] >= 0 && obj->uv_faces[face_index * 3 + 1] < obj->uv_count);
-        assert(obj->uv_faces[face_index * 3 + 2] >= 0 && obj->uv_faces[face_index * 3 + 2] < obj->uv_count);
-      }
-      if (obj->normal_faces) {
-        assert(obj->normal_faces[face_index * 3] >= 0 && obj->normal_faces[face_index * 3] < obj->normal_count);
-        assert(obj->normal_faces[face_index * 3 + 1] >= 0 && obj->normal_faces[face_index * 3 + 1] < obj->normal_count);
-        assert(obj->normal_faces[face_index * 3 + 2] >= 0 && obj->normal_faces[face_index * 3 + 2] < obj->normal_count);
+  close(fd);
+  madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+  *size = st.st_size;
+  return data;
+}
+
+static enum obj_line_type
+classify_line(const char *p, const char *end)
+{
+  if (p + 1 >= end)
+    return LINE_OTHER;
+  if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+    return LINE_POSITION;
+  if (p[0] == 'v' && p[1] == 't' && p + 2 < end && (p[2] == ' ' || p[2] == '\t'))
+    return LINE_UV;
+  if (p[0] == 'v' && p[1] == 'n' && p + 2 < end && (p[2] == ' ' || p[2] == '\t'))
+    return LINE_NORMAL;
+  if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+    return LINE_FACE;
+  return LINE_OTHER;
+}
+
+/* Counts what parse_chunk will write without converting any numbers. */
+static void *
+count_chunk(void *arg)
+{
+  struct obj_chunk *chunk;
+  const char *p, *end;
+  int vert_count;
+
+  chunk = arg;
+  end = chunk->end;
+  for (p = chunk->begin; p < end; p = skip_line(p, end)) {
+    switch (classify_line(p, end)) {
+    case LINE_POSITION:
+      chunk->position_count++;
+      break;
+    case LINE_UV:
+      chunk->uv_count++;
+      break;
+    case LINE_NORMAL:
+      chunk->normal_count++;
+      break;
+    case LINE_FACE:
+      for (vert_count = 0, p = skip_spaces(p + 1, end);
+          p < end && *p != '\n' && *p != '\r' && *p != '#';
+          vert_count++, p = skip_spaces(p, end))
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+          p++;
+      if (vert_count > 2)
+        chunk->face_count += vert_count - 2;
+      break;
+    case LINE_OTHER:
+      break;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Parses every line of a chunk. The arrays only grow when the chunk was not
+ * counted up front, which is what makes the single threaded path one pass.
+ */
+static void *
+parse_chunk(void *arg)
+{
+  struct obj_chunk *chunk;
+  int i, vert_count, position_count, uv_count, normal_count, face;
+  int pos[3], uv[3], normal[3];
+  const char *p, *end, *line;
+
+  chunk = arg;
+  end = chunk->end;
+  for (p = chunk->begin; p < end; p = skip_line(p, end)) {
+    line = p;
+    position_count = chunk->position_base + chunk->position_count;
+    uv_count = chunk->uv_base + chunk->uv_count;
+    normal_count = chunk->normal_base + chunk->normal_count;
+    switch (classify_line(p, end)) {
+    case LINE_POSITION:
+      chunk->positions = grow_array(chunk->positions, &chunk->position_capacity,
+          position_count + 1, 3 * sizeof(float));
+      if (scan_floats(p + 1, end, &chunk->positions[position_count * 3], 3) == NULL)
+        parse_error(chunk->fname, chunk->data, line, "expected 3 position components");
+      chunk->position_count++;
+      break;
+    case LINE_UV:
+      chunk->uvs = grow_array(chunk->uvs, &chunk->uv_capacity, uv_count + 1,
+          2 * sizeof(float));
+      if (scan_floats(p + 2, end, &chunk->uvs[uv_count * 2], 2) == NULL)
+        parse_error(chunk->fname, chunk->data, line, "expected 2 texture coordinates");
+      chunk->uv_count++;
+      break;
+    case LINE_NORMAL:
+      chunk->normals = grow_array(chunk->normals, &chunk->normal_capacity,
+          normal_count + 1, 3 * sizeof(float));
+      if (scan_floats(p + 2, end, &chunk->normals[normal_count * 3], 3) == NULL)
+        parse_error(chunk->fname, chunk->data, line, "expected 3 normal components");
+      chunk->normal_count++;
+      break;
+    case LINE_FACE:
+      /* Polygons are triangulated as a fan around their first vertex. */
+      for (vert_count = 0, p = skip_spaces(p + 1, end);
+          p < end && *p != '\n' && *p != '\r' && *p != '#';
+          vert_count++, p = skip_spaces(p, end)) {
+        i = vert_count < 2 ? vert_count : 2;
+        if ( (p = scan_face_vertex(p, end, &pos[i], &uv[i], &normal[i])) == NULL)
+          parse_error(chunk->fname, chunk->data, line, "malformed face vertex");
+        if ( (pos[i] = resolve_index(pos[i], position_count)) < 0)
+          parse_error(chunk->fname, chunk->data, line, "position index out of range");
+        if (uv[i] == 0)
+          chunk->missing_uv = 1;
+        else if ( (uv[i] = resolve_index(uv[i], uv_count)) < 0)
+          parse_error(chunk->fname, chunk->data, line,
+              "texture coordinate index out of range");
+        if (normal[i] == 0)
+          chunk->missing_normal = 1;
+        else if ( (normal[i] = resolve_index(normal[i], normal_count)) < 0)
+          parse_error(chunk->fname, chunk->data, line, "normal index out of range");
+        if (i < 2)
+          continue;
+        face = chunk->face_base + chunk->face_count;
+        if (face == chunk->face_capacity) {
+          chunk->face_capacity = chunk->face_capacity ? chunk->face_capacity * 2 : 1024;
+          chunk->position_faces = xrealloc(chunk->position_faces,
+              chunk->face_capacity * 3 * sizeof(int));
+          chunk->uv_faces = xrealloc(chunk->uv_faces,
+              chunk->face_capacity * 3 * sizeof(int));
+          chunk->normal_faces = xrealloc(chunk->normal_faces,
+              chunk->face_capacity * 3 * sizeof(int));
+        }
+        memcpy(&chunk->position_faces[face * 3], pos, sizeof(pos));
+        memcpy(&chunk->uv_faces[face * 3], uv, sizeof(uv));
+        memcpy(&chunk->normal_faces[face * 3], normal, sizeof(normal));
+        chunk->face_count++;
+        pos[1] = pos[2];
+        uv[1] = uv[2];
+        normal[1] = normal[2];
       }
-      face_index++;
+      if (vert_count < 3)
+        parse_error(chunk->fname, chunk->data, line, "face has fewer than 3 vertices");
+      break;
+    case LINE_OTHER:
+      break;
+    }
+  }
+  return NULL;
+}
+
+/* Runs func on every chunk, using the calling thread for the first one. */
+static void
+run_chunks(struct obj_chunk *chunks, int chunk_count, void *(*func)(void *))
+{
+  pthread_t threads[MAX_OBJ_THREADS];
+  int i;
+  for (i = 1; i < chunk_count; i++) {
+    if (pthread_create(&threads[i], NULL, func, &chunks[i])) {
+      fprintf(stderr, "Failed to create obj loader thread.\n");
+      exit(1);
     }
   }
-  assert(pos_index == obj->position_count);
-  assert(uv_index == obj->uv_count);
-  assert(normal_index == obj->normal_count);
-  assert(face_index == obj->face_count);
-  if (ferror(file)) {
-    fprintf(stderr, "Error while reading obj file '%s'.\n", fname);
+  func(&chunks[0]);
+  for (i = 1; i < chunk_count; i++)
+    pthread_join(threads[i], NULL);
+}
+
+void
+load_wavefront_obj(struct wavefront_obj *obj, const char *fname, int thread_count)
+{
+  struct obj_chunk chunks[MAX_OBJ_THREADS], *last;
+  const char *data;
+  size_t size;
+  int i, missing_uv, missing_normal;
+
+  data = map_obj_file(fname, &size);
+  if (thread_count > MAX_OBJ_THREADS)
+    thread_count = MAX_OBJ_THREADS;
+  if (thread_count > size / MIN_OBJ_CHUNK_SIZE)
+    thread_count = size / MIN_OBJ_CHUNK_SIZE;
+  if (thread_count < 1)
+    thread_count = 1;
+
+  memset(chunks, 0, thread_count * sizeof(struct obj_chunk));
+  for (i = 0; i < thread_count; i++) {
+    chunks[i].fname = fname;
+    chunks[i].data = data;
+    chunks[i].begin = i ? chunks[i - 1].end : data;
+    chunks[i].end = data + size;
+    if (i < thread_count - 1)
+      chunks[i].end = skip_line(data + size / thread_count * (i + 1), data + size);
+    if (chunks[i].end < chunks[i].begin)
+      chunks[i].end = chunks[i].begin;
+  }
+
+  memset(obj, 0, sizeof(*obj));
+  if (thread_count > 1) {
+    run_chunks(chunks, thread_count, count_chunk);
+    for (i = 0; i < thread_count; i++) {
+      chunks[i].position_base = obj->position_count;
+      chunks[i].uv_base = obj->uv_count;
+      chunks[i].normal_base = obj->normal_count;
+      chunks[i].face_base = obj->face_count;
+      obj->position_count += chunks[i].position_count;
+      obj->uv_count += chunks[i].uv_count;
+      obj->normal_count += chunks[i].normal_count;
+      obj->face_count += chunks[i].face_count;
+    }
+    if (obj->position_count)
+      obj->positions = xmalloc(obj->position_count * 3 * sizeof(float));
+    if (obj->uv_count)
+      obj->uvs = xmalloc(obj->uv_count * 2 * sizeof(float));
+    if (obj->normal_count)
+      obj->normals = xmalloc(obj->normal_count * 3 * sizeof(float));
+    if (obj->face_count) {
+      obj->position_faces = xmalloc(obj->face_count * 3 * sizeof(int));
+      obj->uv_faces = xmalloc(obj->face_count * 3 * sizeof(int));
+      obj->normal_faces = xmalloc(obj->face_count * 3 * sizeof(int));
+    }
+    for (i = 0; i < thread_count; i++) {
+      chunks[i].position_count = chunks[i].uv_count = 0;
+      chunks[i].normal_count = chunks[i].face_count = 0;
+      chunks[i].position_capacity = obj->position_count;
+      chunks[i].uv_capacity = obj->uv_count;
+      chunks[i].normal_capacity = obj->normal_count;
+      chunks[i].face_capacity = obj->face_count;
+      chunks[i].positions = obj->positions;
+      chunks[i].uvs = obj->uvs;
+      chunks[i].normals = obj->normals;
+      chunks[i].position_faces = obj->position_faces;
+      chunks[i].uv_faces = obj->uv_faces;
+      chunks[i].normal_faces = obj->normal_faces;
+    }
+  }
+  run_chunks(chunks, thread_count, parse_chunk);
+  munmap((void *)data, size);
+
+  last = &chunks[thread_count - 1];
+  /* Pre-counted chunks must have written exactly what was counted. */
+  assert(thread_count == 1
+      || last->position_base + last->position_count == obj->position_count);
+  assert(thread_count == 1 || last->face_base + last->face_count == obj->face_count);
+  obj->position_count = last->position_base + last->position_count;
+  obj->uv_count = last->uv_base + last->uv_count;
+  obj->normal_count = last->normal_base + last->normal_count;
+  obj->face_count = last->face_base + last->face_count;
+  obj->positions = chunks[0].positions;
+  obj->uvs = chunks[0].uvs;
+  obj->normals = chunks[0].normals;
+  obj->position_faces = chunks[0].position_faces;
+  obj->uv_faces = chunks[0].uv_faces;
+  obj->normal_faces = chunks[0].normal_faces;
+  missing_uv = missing_normal = 0;
+  for (i = 0; i < thread_count; i++) {
+    missing_uv |= chunks[i].missing_uv;
+    missing_normal |= chunks[i].missing_normal;
+  }
+
+  if (obj->position_count == 0) {
+    fprintf(stderr, "Obj file '%s' has no vertex positions.\n", fname);
+    exit(1);
+  }
+  if (obj->uv_count == 0) {
+    free(obj->uv_faces);
+    obj->uv_faces = NULL;
+  } else if (missing_uv) {
+    fprintf(stderr, "Obj file '%s' has faces without texture coordinates.\n", fname);
+    exit(1);
+  }
+  if (obj->normal_count == 0) {
+    free(obj->normal_faces);
+    obj->normal_faces = NULL;
+  } else if (missing_normal) {
+    fprintf(stderr, "Obj file '%s' has faces without normals.\n", fname);
     exit(1);
   }
-  fclose(file);
 }
 
 void
@@ -145,44 +578,630 @@ destroy_wavefront_obj(struct wavefront_obj *obj)
   free(obj->normal_faces);
 }
 
+static uint32_t
+hash_vertex_key(int pos, int uv, int normal)
+{
+  uint32_t h;
+  h = (uint32_t)pos * 0x9e3779b1u;
+  h ^= (uint32_t)uv * 0x85ebca77u + (h << 6) + (h >> 2);
+  h ^= (uint32_t)normal * 0xc2b2ae3du + (h << 6) + (h >> 2);
+  return h ^ (h >> 15);
+}
+
+static int
+same_corner(const struct wavefront_obj *wavefront, int a, int b)
+{
+  return wavefront->position_faces[a] == wavefront->position_faces[b]
+    && (wavefront->uv_faces == NULL || wavefront->uv_faces[a] == wavefront->uv_faces[b])
+    && (wavefront->normal_faces == NULL
+        || wavefront->normal_faces[a] == wavefront->normal_faces[b]);
+}
+
+/*
+ * Corners with the same (position, uv, normal) reference share one vertex.
+ * They are found with an open addressing hash table whose slots hold the
+ * first corner that produced each vertex.
+ */
 void
 wavefront_to_indexed_vertex_obj(struct indexed_vertex_obj *ivo,
     const struct wavefront_obj *wavefront)
 {
-  int vert, next_index;
-  ivo->vertices = xmalloc(wavefront->face_count * 3 * sizeof(struct vertex));
-  ivo->indices = xmalloc(wavefront->face_count * 3 * sizeof(int));
-  vert = next_index = 0;
-  /* TODO: Reuse index for identical vertices. */
-  for (vert = 0; vert < wavefront->face_count * 3; vert++) {
-    memcpy(&ivo->vertices[next_index].pos,
-        &wavefront->positions[wavefront->position_faces[vert] * 3],
+  int vert, corner_count, next_index, i;
+  uint32_t table_size, slot;
+  int *table;
+  struct vertex *v;
+
+  corner_count = wavefront->face_count * 3;
+  for (table_size = 64; table_size < corner_count * 2; table_size *= 2)
+    ;
+  table = xmalloc(table_size * sizeof(int));
+  memset(table, 0xff, table_size * sizeof(int));
+  ivo->vertices = xmalloc(corner_count * sizeof(struct vertex));
+  ivo->indices = xmalloc(corner_count * sizeof(uint32_t));
+  next_index = 0;
+  for (vert = 0; vert < corner_count; vert++) {
+    slot = hash_vertex_key(wavefront->position_faces[vert],
+        wavefront->uv_faces ? wavefront->uv_faces[vert] : 0,
+        wavefront->normal_faces ? wavefront->normal_faces[vert] : 0);
+    for (slot &= table_size - 1; table[slot] >= 0; slot = (slot + 1) & (table_size - 1))
+      if (same_corner(wavefront, table[slot], vert))
+        break;
+    if (table[slot] >= 0) {
+      ivo->indices[vert] = ivo->indices[table[slot]];
+      continue;
+    }
+    table[slot] = vert;
+    v = &ivo->vertices[next_index];
+    memcpy(v->pos, &wavefront->positions[wavefront->position_faces[vert] * 3],
         3 * sizeof(float));
     if (wavefront->uv_faces) {
-      ivo->vertices[next_index].uv[0] = wavefront->uvs[wavefront->uv_faces[vert] * 2];
-      ivo->vertices[next_index].uv[1] = 1.0f - wavefront->uvs[wavefront->uv_faces[vert] * 2 + 1];
+      v->uv[0] = wavefront->uvs[wavefront->uv_faces[vert] * 2];
+      v->uv[1] = 1.0f - wavefront->uvs[wavefront->uv_faces[vert] * 2 + 1];
     } else {
-      ivo->vertices[next_index].uv[0] = 0.0f;
-      ivo->vertices[next_index].uv[1] = 0.0f;
+      v->uv[0] = 0.0f;
+      v->uv[1] = 0.0f;
     }
     if (wavefront->normal_faces) {
-      memcpy(&ivo->vertices[next_index].normal,
-          &wavefront->normals[wavefront->normal_faces[vert] * 3],
+      memcpy(v->normal, &wavefront->normals[wavefront->normal_faces[vert] * 3],
           3 * sizeof(float));
     } else {
-      ivo->vertices[next_index].normal[0] = 0.0f;
-      ivo->vertices[next_index].normal[1] = 0.0f;
-      ivo->vertices[next_index].normal[2] = 0.0f;
+      v->normal[0] = 0.0f;
+      v->normal[1] = 0.0f;
+      v->normal[2] = 0.0f;
     }
     ivo->indices[vert] = next_index++;
   }
+  free(table);
+  if (next_index > 0)
+    ivo->vertices = xrealloc(ivo->vertices, next_index * sizeof(struct vertex));
   ivo->vertex_count = next_index;
-  ivo->index_count = wavefront->face_count * 3;
+  ivo->index_count = corner_count;
+  ivo->mapping = NULL;
+  ivo->mapping_size = 0;
+  for (i = 0; i < 3; i++)
+    ivo->min[i] = ivo->max[i] = next_index ? ivo->vertices[0].pos[i] : 0.0f;
+  for (vert = 1; vert < next_index; vert++) {
+    for (i = 0; i < 3; i++) {
+      if (ivo->vertices[vert].pos[i] < ivo->min[i])
+        ivo->min[i] = ivo->vertices[vert].pos[i];
+      if (ivo->vertices[vert].pos[i] > ivo->max[i])
+        ivo->max[i] = ivo->vertices[vert].pos[i];
+    }
+  }
+}
+
+/*
+ * Replays the index buffer through a FIFO post-transform cache. ACMR is
+ * misses per triangle and ATVR misses per vertex, 1.0 being optimal.
+ */
+static void
+measure_vertex_cache(const struct indexed_vertex_obj *ivo, float *acmr,
+    float *atvr)
+{
+  int *cache_time;
+  int i, misses;
+  uint32_t v;
+
+  cache_time = xmalloc((ivo->vertex_count + 1) * sizeof(int));
+  for (i = 0; i < ivo->vertex_count; i++)
+    cache_time[i] = -VERTEX_CACHE_SIZE - 1;
+  misses = 0;
+  for (i = 0; i < ivo->index_count; i++) {
+    v = ivo->indices[i];
+    if (misses - cache_time[v] > VERTEX_CACHE_SIZE)
+      cache_time[v] = misses++;
+  }
+  free(cache_time);
+  *acmr = ivo->index_count ? misses / (ivo->index_count / 3.0f) : 0.0f;
+  *atvr = ivo->vertex_count ? misses / (float)ivo->vertex_count : 0.0f;
+}
+
+static int
+skip_dead_end(const int *live, const uint32_t *dead_ends, int *dead_end_count,
+    int *cursor, int vertex_count)
+{
+  uint32_t v;
+  while (*dead_end_count > 0) {
+    v = dead_ends[--*dead_end_count];
+    if (live[v] > 0)
+      return v;
+  }
+  for (; *cursor < vertex_count; (*cursor)++)
+    if (live[*cursor] > 0)
+      return *cursor;
+  return -1;
+}
+
+/*
+ * Tipsify (Sander, Nehab and Barczak, 2007). Triangles are emitted as fans
+ * around a vertex that is still in the cache, preferring the oldest vertex
+ * whose remaining fan fits before it is evicted. A fan that has to restart
+ * from the dead end stack or the cursor starts a new cluster; the starts are
+ * written to cluster_starts (in triangles) and their count is returned.
+ */
+static int
+tipsify(const uint32_t *indices, int triangle_count, int vertex_count,
+    uint32_t *out, int *cluster_starts)
+{
+  int *live, *offsets, *adjacency, *cache_time;
+  uint32_t *dead_ends, *candidates;
+  char *emitted;
+  int i, j, t, fan, best, priority, best_priority, stamp, cursor;
+  int dead_end_count, candidate_count, cluster_count, out_count;
+  uint32_t v;
+
+  live = xmalloc((vertex_count + 1) * sizeof(int));
+  offsets = xmalloc((vertex_count + 1) * sizeof(int));
+  cache_time = xmalloc((vertex_count + 1) * sizeof(int));
+  adjacency = xmalloc((triangle_count * 3 + 1) * sizeof(int));
+  dead_ends = xmalloc((triangle_count * 3 + 1) * sizeof(uint32_t));
+  candidates = xmalloc((triangle_count * 3 + 1) * sizeof(uint32_t));
+  emitted = xmalloc(triangle_count + 1);
+
+  memset(live, 0, vertex_count * sizeof(int));
+  for (i = 0; i < triangle_count * 3; i++)
+    live[indices[i]]++;
+  offsets[0] = 0;
+  for (i = 0; i < vertex_count; i++) {
+    offsets[i + 1] = offsets[i] + live[i];
+    cache_time[i] = offsets[i];
+  }
+  for (i = 0; i < triangle_count * 3; i++)
+    adjacency[cache_time[indices[i]]++] = i / 3;
+  memset(cache_time, 0, vertex_count * sizeof(int));
+  memset(emitted, 0, triangle_count);
+
+  stamp = VERTEX_CACHE_SIZE + 1;
+  cursor = dead_end_count = cluster_count = out_count = 0;
+  fan = skip_dead_end(live, dead_ends, &dead_end_count, &cursor, vertex_count);
+  if (fan >= 0)
+    cluster_starts[cluster_count++] = 0;
+  while (fan >= 0) {
+    candidate_count = 0;
+    for (i = offsets[fan]; i < offsets[fan + 1]; i++) {
+      t = adjacency[i];
+      if (emitted[t])
+        continue;
+      emitted[t] = 1;
+      for (j = 0; j < 3; j++) {
+        v = indices[t * 3 + j];
+        out[out_count++] = v;
+        dead_ends[dead_end_count++] = v;
+        candidates[candidate_count++] = v;
+        live[v]--;
+        if (stamp - cache_time[v] > VERTEX_CACHE_SIZE)
+          cache_time[v] = stamp++;
+      }
+    }
+    best = -1;
+    best_priority = -1;
+    for (i = 0; i < candidate_count; i++) {
+      v = candidates[i];
+      if (live[v] <= 0)
+        continue;
+      priority = 0;
+      if (stamp - cache_time[v] + 2 * live[v] <= VERTEX_CACHE_SIZE)
+        priority = stamp - cache_time[v];
+      if (priority > best_priority) {
+        best_priority = priority;
+        best = v;
+      }
+    }
+    if (best < 0) {
+      fan = skip_dead_end(live, dead_ends, &dead_end_count, &cursor,
+          vertex_count);
+      if (fan >= 0)
+        cluster_starts[cluster_count++] = out_count / 3;
+    } else {
+      fan = best;
+    }
+  }
+
+  free(live);
+  free(offsets);
+  free(cache_time);
+  free(adjacency);
+  free(dead_ends);
+  free(candidates);
+  free(emitted);
+  return cluster_count;
+}
+
+static int
+compare_clusters(const void *a, const void *b)
+{
+  const struct triangle_cluster *x = a, *y = b;
+  if (x->sort_key != y->sort_key)
+    return x->sort_key < y->sort_key ? 1 : -1;
+  return x->first - y->first;
+}
+
+/*
+ * View independent overdraw ordering: clusters that face away from the mesh
+ * centroid are likely to occlude the rest, so they are drawn first. Each
+ * cluster is kept intact so the vertex cache order inside it survives.
+ */
+static void
+sort_clusters_for_overdraw(const struct indexed_vertex_obj *ivo,
+    const uint32_t *in, uint32_t *out, const int *cluster_starts,
+    int cluster_count)
+{
+  struct triangle_cluster *clusters;
+  const float *a, *b, *c;
+  float e0[3], e1[3], n[3], area, center[3], mesh_center[3], mesh_area;
+  float normal[3], centroid[3], cluster_area, len;
+  int triangle_count, cluster, t, i, out_count;
+
+  triangle_count = ivo->index_count / 3;
+  clusters = xmalloc(cluster_count * sizeof(struct triangle_cluster));
+  for (i = 0; i < 3; i++)
+    mesh_center[i] = 0.0f;
+  mesh_area = 0.0f;
+  for (cluster = 0; cluster < cluster_count; cluster++) {
+    clusters[cluster].first = cluster_starts[cluster];
+    clusters[cluster].count = (cluster + 1 < cluster_count
+        ? cluster_starts[cluster + 1] : triangle_count) - cluster_starts[cluster];
+    for (i = 0; i < 3; i++)
+      normal[i] = centroid[i] = 0.0f;
+    cluster_area = 0.0f;
+    for (t = clusters[cluster].first;
+        t < clusters[cluster].first + clusters[cluster].count; t++) {
+      a = ivo->vertices[in[t * 3]].pos;
+      b = ivo->vertices[in[t * 3 + 1]].pos;
+      c = ivo->vertices[in[t * 3 + 2]].pos;
+      for (i = 0; i < 3; i++) {
+        e0[i] = b[i] - a[i];
+        e1[i] = c[i] - a[i];
+      }
+      n[0] = e0[1] * e1[2] - e0[2] * e1[1];
+      n[1] = e0[2] * e1[0] - e0[0] * e1[2];
+      n[2] = e0[0] * e1[1] - e0[1] * e1[0];
+      area = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+      for (i = 0; i < 3; i++) {
+        center[i] = (a[i] + b[i] + c[i]) / 3.0f;
+        normal[i] += n[i];
+        centroid[i] += center[i] * area;
+      }
+      cluster_area += area;
+    }
+    for (i = 0; i < 3; i++)
+      mesh_center[i] += centroid[i];
+    mesh_area += cluster_area;
+    len = sqrtf(normal[0] * normal[0] + normal[1] * normal[1]
+        + normal[2] * normal[2]);
+    for (i = 0; i < 3; i++) {
+      clusters[cluster].centroid[i] = cluster_area > 0.0f
+        ? centroid[i] / cluster_area : ivo->vertices[in[clusters[cluster].first * 3]].pos[i];
+      clusters[cluster].normal[i] = len > 0.0f ? normal[i] / len : 0.0f;
+    }
+  }
+  for (i = 0; i < 3; i++)
+    mesh_center[i] = mesh_area > 0.0f ? mesh_center[i] / mesh_area : 0.0f;
+  for (cluster = 0; cluster < cluster_count; cluster++) {
+    clusters[cluster].sort_key = 0.0f;
+    for (i = 0; i < 3; i++)
+      clusters[cluster].sort_key += (clusters[cluster].centroid[i]
+          - mesh_center[i]) * clusters[cluster].normal[i];
+  }
+  qsort(clusters, cluster_count, sizeof(struct triangle_cluster),
+      compare_clusters);
+  out_count = 0;
+  for (cluster = 0; cluster < cluster_count; cluster++) {
+    memcpy(out + out_count, in + clusters[cluster].first * 3,
+        clusters[cluster].count * 3 * sizeof(uint32_t));
+    out_count += clusters[cluster].count * 3;
+  }
+  free(clusters);
+}
+
+/*
+ * Renumbers vertices in order of first use so the vertex fetch walks the
+ * vertex buffer mostly forwards. Unreferenced vertices move to the end.
+ */
+static void
+optimize_vertex_fetch(struct indexed_vertex_obj *ivo)
+{
+  int *remap;
+  struct vertex *vertices;
+  int i, next;
+
+  remap = xmalloc((ivo->vertex_count + 1) * sizeof(int));
+  vertices = xmalloc((ivo->vertex_count + 1) * sizeof(struct vertex));
+  memset(remap, 0xff, ivo->vertex_count * sizeof(int));
+  next = 0;
+  for (i = 0; i < ivo->index_count; i++)
+    if (remap[ivo->indices[i]] < 0)
+      remap[ivo->indices[i]] = next++;
+  for (i = 0; i < ivo->vertex_count; i++)
+    if (remap[i] < 0)
+      remap[i] = next++;
+  for (i = 0; i < ivo->vertex_count; i++)
+    vertices[remap[i]] = ivo->vertices[i];
+  memcpy(ivo->vertices, vertices, ivo->vertex_count * sizeof(struct vertex));
+  for (i = 0; i < ivo->index_count; i++)
+    ivo->indices[i] = remap[ivo->indices[i]];
+  free(remap);
+  free(vertices);
+}
+
+/*
+ * Reorders triangles for the post-transform vertex cache and overdraw, then
+ * vertices for fetch locality. The mesh is rendered identically, only the
+ * order of its triangles and vertices changes.
+ */
+void
+optimize_indexed_vertex_obj(struct indexed_vertex_obj *ivo)
+{
+  uint32_t *tipsified;
+  int *cluster_starts;
+  int triangle_count, cluster_count;
+  float acmr_before, atvr_before, acmr_after, atvr_after;
+
+  triangle_count = ivo->index_count / 3;
+  if (triangle_count == 0)
+    return;
+  measure_vertex_cache(ivo, &acmr_before, &atvr_before);
+  tipsified = xmalloc(ivo->index_count * sizeof(uint32_t));
+  cluster_starts = xmalloc(triangle_count * sizeof(int));
+  cluster_count = tipsify(ivo->indices, triangle_count, ivo->vertex_count,
+      tipsified, cluster_starts);
+  sort_clusters_for_overdraw(ivo, tipsified, ivo->indices, cluster_starts,
+      cluster_count);
+  free(tipsified);
+  free(cluster_starts);
+  optimize_vertex_fetch(ivo);
+  measure_vertex_cache(ivo, &acmr_after, &atvr_after);
+  printf("Optimised mesh (%d clusters): ACMR %.3f -> %.3f, ATVR %.3f -> %.3f.\n",
+      cluster_count, acmr_before, acmr_after, atvr_before, atvr_after);
+}
+
+static uint16_t
+float_to_half(float f)
+{
+  uint32_t bits, sign, mantissa;
+  int exponent, shift;
+  uint16_t half;
+
+  memcpy(&bits, &f, sizeof(bits));
+  sign = (bits >> 16) & 0x8000;
+  mantissa = bits & 0x7fffff;
+  if (((bits >> 23) & 0xff) == 0xff)
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+  if (exponent >= 31)
+    return sign | 0x7c00;
+  if (exponent <= 0) {
+    /* Denormal, or zero when too small for one. */
+    if (exponent < -10)
+      return sign;
+    mantissa |= 0x800000;
+    shift = 14 - exponent;
+    half = mantissa >> shift;
+    if ((mantissa >> (shift - 1)) & 1)
+      half++;
+    return sign | half;
+  }
+  half = sign | (exponent << 10) | (mantissa >> 13);
+  /* A carry out of the mantissa correctly bumps the exponent. */
+  if (mantissa & 0x1000)
+    half++;
+  return half;
+}
+
+static int16_t
+float_to_snorm16(float f)
+{
+  if (f > 1.0f)
+    f = 1.0f;
+  if (f < -1.0f)
+    f = -1.0f;
+  return (int16_t)lroundf(f * 32767.0f);
+}
+
+/*
+ * Writes ivo->vertex_count packed vertices. Normals are projected onto the
+ * octahedron |x| + |y| + |z| = 1 and its lower half is folded over the upper.
+ */
+void
+pack_vertices(struct packed_vertex *packed, const struct indexed_vertex_obj *ivo)
+{
+  const struct vertex *v;
+  float extent, l1, x, y, folded_x;
+  int vert, i;
+
+  for (vert = 0; vert < ivo->vertex_count; vert++) {
+    v = &ivo->vertices[vert];
+    for (i = 0; i < 3; i++) {
+      extent = ivo->max[i] - ivo->min[i];
+      packed[vert].pos[i] = extent > 0.0f
+        ? (uint16_t)lroundf((v->pos[i] - ivo->min[i]) / extent * 65535.0f) : 0;
+    }
+    packed[vert].pos[3] = 0;
+    packed[vert].uv[0] = float_to_half(v->uv[0]);
+    packed[vert].uv[1] = float_to_half(v->uv[1]);
+    l1 = fabsf(v->normal[0]) + fabsf(v->normal[1]) + fabsf(v->normal[2]);
+    x = l1 > 0.0f ? v->normal[0] / l1 : 0.0f;
+    y = l1 > 0.0f ? v->normal[1] / l1 : 0.0f;
+    if (v->normal[2] < 0.0f) {
+      folded_x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+      y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+      x = folded_x;
+    }
+    packed[vert].normal[0] = float_to_snorm16(x);
+    packed[vert].normal[1] = float_to_snorm16(y);
+  }
+}
+
+static void
+lmesh_path(char *path, size_t size, const char *fname)
+{
+  size_t len;
+  len = strlen(fname);
+  if (len > 4 && strcmp(fname + len - 4, ".obj") == 0)
+    len -= 4;
+  snprintf(path, size, "%.*s.lmesh", (int)len, fname);
+}
+
+/*
+ * Fills the source_* fields of a header. Besides size and modification time
+ * the head and tail of the file are hashed (FNV-1a), which catches files that
+ * were replaced without their mtime changing, at a fixed cost.
+ */
+static int
+stamp_source(struct lmesh_header *stamp, const char *fname)
+{
+  int fd, i, span;
+  struct stat st;
+  unsigned char buffer[LMESH_HASH_SPAN];
+  off_t offsets[2];
+  uint64_t hash;
+  ssize_t len, j;
+
+  if ( (fd = open(fname, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return 0;
+  }
+  span = st.st_size < LMESH_HASH_SPAN ? st.st_size : LMESH_HASH_SPAN;
+  offsets[0] = 0;
+  offsets[1] = st.st_size - span;
+  hash = 0xcbf29ce484222325ull;
+  for (i = 0; i < 2; i++) {
+    if ( (len = pread(fd, buffer, span, offsets[i])) != span) {
+      close(fd);
+      return 0;
+    }
+    for (j = 0; j < len; j++)
+      hash = (hash ^ buffer[j]) * 0x100000001b3ull;
+  }
+  close(fd);
+  stamp->source_size = st.st_size;
+  stamp->source_hash = hash;
+  stamp->source_mtime_sec = st.st_mtim.tv_sec;
+  stamp->source_mtime_nsec = st.st_mtim.tv_nsec;
+  return 1;
+}
+
+/*
+ * Maps a cache file copy-on-write and points ivo into it. Returns 0 if the
+ * file is missing, malformed or was built from a different source.
+ */
+static int
+map_lmesh(struct indexed_vertex_obj *ivo, const char *path,
+    const struct lmesh_header *stamp)
+{
+  int fd;
+  struct stat st;
+  char *data;
+  const struct lmesh_header *header;
+
+  if ( (fd = open(path, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) || st.st_size < sizeof(struct lmesh_header)) {
+    close(fd);
+    return 0;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return 0;
+  header = (const struct lmesh_header *)data;
+  if (header->magic != LMESH_MAGIC
+      || header->version != LMESH_VERSION
+      || header->vertex_size != sizeof(struct vertex)
+      || header->flags != stamp->flags
+      || header->source_size != stamp->source_size
+      || header->source_hash != stamp->source_hash
+      || header->source_mtime_sec != stamp->source_mtime_sec
+      || header->source_mtime_nsec != stamp->source_mtime_nsec
+      || st.st_size != sizeof(struct lmesh_header)
+        + (size_t)header->vertex_count * sizeof(struct vertex)
+        + (size_t)header->index_count * sizeof(uint32_t)) {
+    munmap(data, st.st_size);
+    return 0;
+  }
+  ivo->vertex_count = header->vertex_count;
+  ivo->index_count = header->index_count;
+  memcpy(ivo->min, header->min, sizeof(ivo->min));
+  memcpy(ivo->max, header->max, sizeof(ivo->max));
+  ivo->vertices = (struct vertex *)(data + sizeof(struct lmesh_header));
+  ivo->indices = (uint32_t *)(ivo->vertices + header->vertex_count);
+  ivo->mapping = data;
+  ivo->mapping_size = st.st_size;
+  return 1;
+}
+
+/* Failing to write the cache is not fatal, the next run just parses again. */
+static void
+write_lmesh(const struct indexed_vertex_obj *ivo, const char *path,
+    const struct lmesh_header *stamp)
+{
+  FILE *file;
+  char tmp_path[LMESH_PATH_MAX + 8];
+  struct lmesh_header header;
+
+  header = *stamp;
+  header.magic = LMESH_MAGIC;
+  header.version = LMESH_VERSION;
+  header.vertex_size = sizeof(struct vertex);
+  header.vertex_count = ivo->vertex_count;
+  header.index_count = ivo->index_count;
+  memcpy(header.min, ivo->min, sizeof(header.min));
+  memcpy(header.max, ivo->max, sizeof(header.max));
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  if ( (file = fopen(tmp_path, "wb")) == NULL) {
+    fprintf(stderr, "Failed to create mesh cache '%s'.\n", tmp_path);
+    return;
+  }
+  if (fwrite(&header, sizeof(header), 1, file) != 1
+      || fwrite(ivo->vertices, sizeof(struct vertex), ivo->vertex_count, file)
+        != ivo->vertex_count
+      || fwrite(ivo->indices, sizeof(uint32_t), ivo->index_count, file)
+        != ivo->index_count
+      || fclose(file)) {
+    fprintf(stderr, "Failed to write mesh cache '%s'.\n", tmp_path);
+    remove(tmp_path);
+    return;
+  }
+  if (rename(tmp_path, path)) {
+    perror("Failed to rename mesh cache");
+    remove(tmp_path);
+  }
+}
+
+void
+load_indexed_vertex_obj(struct indexed_vertex_obj *ivo, const char *fname,
+    int thread_count, int optimize)
+{
+  char path[LMESH_PATH_MAX];
+  struct lmesh_header stamp;
+  struct wavefront_obj wavefront;
+  int stamped;
+
+  lmesh_path(path, sizeof(path), fname);
+  memset(&stamp, 0, sizeof(stamp));
+  stamped = stamp_source(&stamp, fname);
+  stamp.flags = optimize ? LMESH_OPTIMIZED : 0;
+  if (stamped && map_lmesh(ivo, path, &stamp))
+    return;
+  load_wavefront_obj(&wavefront, fname, thread_count);
+  wavefront_to_indexed_vertex_obj(ivo, &wavefront);
+  destroy_wavefront_obj(&wavefront);
+  if (optimize)
+    optimize_indexed_vertex_obj(ivo);
+  if (stamped)
+    write_lmesh(ivo, path, &stamp);
 }
 
 void
 destroy_indexed_vertex_obj(struct indexed_vertex_obj *ivo)
 {
+  if (ivo->mapping) {
+    munmap(ivo->mapping, ivo->mapping_size);
+    return;
+  }
   free(ivo->vertices);
   free(ivo->indices);
 }
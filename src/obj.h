@@ -1,5 +1,9 @@
-void load_wavefront_obj(struct wavefront_obj *obj, const char *fname);
+void load_wavefront_obj(struct wavefront_obj *obj, const char *fname, int thread_count);
 void destroy_wavefront_obj(struct wavefront_obj *obj);
 void wavefront_to_indexed_vertex_obj(struct indexed_vertex_obj *ivo,
     const struct wavefront_obj *wavefront);
+void optimize_indexed_vertex_obj(struct indexed_vertex_obj *ivo);
+void pack_vertices(struct packed_vertex *packed, const struct indexed_vertex_obj *ivo);
+void load_indexed_vertex_obj(struct indexed_vertex_obj *ivo, const char *fname,
+    int thread_count, int optimize);
 void destroy_indexed_vertex_obj(struct indexed_vertex_obj *ivo);
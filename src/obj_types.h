@@ -10,13 +10,40 @@ struct vertex {
   float normal[3];
 };
 
+/*
+ * 16 byte vertex. Positions are unorm within the mesh bounds (pos[3] pads the
+ * attribute to a well supported format), uvs are half floats and normals are
+ * octahedral encoded snorm pairs.
+ */
+struct packed_vertex {
+  uint16_t pos[4];
+  uint16_t uv[2];
+  int16_t normal[2];
+};
+
+enum vertex_format {
+  VERTEX_FORMAT_FLOAT,
+  VERTEX_FORMAT_PACKED,
+};
+
 struct indexed_vertex_obj {
   int vertex_count, index_count;
+  float min[3], max[3];
   struct vertex *vertices;
   uint32_t *indices;
+  /* Set when vertices and indices point into a mapped mesh cache file. */
+  void *mapping;
+  size_t mapping_size;
 };
 
+/*
+ * Offsets are in bytes. Packed vertices are dequantised with
+ * pos = position_offset + unorm * position_scale.
+ */
 struct graphics_vertex_obj {
   int vertex_count, index_count;
   long vertex_offset, index_offset;
+  enum vertex_format format;
+  int index_size;
+  float position_offset[3], position_scale[3];
 };
@@ -44,9 +44,15 @@ static void init_default_pipeline_create_info(struct pipeline_create_info *info)
 static void create_pipelines(void);
 
 static VkShaderModule hello_vert_module;
+static VkShaderModule hello_packed_vert_module;
 static VkShaderModule hello_frag_module;
 static VkShaderModule voxel_block_vert_module;
 static VkShaderModule voxel_block_frag_module;
+static VkShaderModule cull_comp_module;
+static VkShaderModule depth_pyramid_comp_module;
+static VkShaderModule voxel_trace_comp_module;
+static VkShaderModule voxel_composite_vert_module;
+static VkShaderModule voxel_composite_frag_module;
 
 struct lime_pipelines lime_pipelines;
 
@@ -98,7 +104,8 @@ create_render_passes(void)
   info.attachments[1].format = lime_device.depth_format;
   info.attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
   info.attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  info.attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  /* The depth pyramid and late render pass read it afterwards. */
+  info.attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
   info.attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   info.attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
   info.attachments[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -159,9 +166,11 @@ create_render_passes(void)
     = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
     | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
     | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
-  info.subpass_dependencies[0].srcAccessMask = 0;
+  /* The color loaded here was stored by the early pass. */
+  info.subpass_dependencies[0].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
   info.subpass_dependencies[0].dstAccessMask
-    = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+    = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT
+    | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
     | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
     | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
   info.subpass.colorAttachmentCount = 1;
@@ -169,28 +178,40 @@ create_render_passes(void)
   info.subpass.pDepthStencilAttachment = &depth_attachment;
   info.create_info.attachmentCount = 2;
   info.create_info.dependencyCount = 1;
-  assert(lime_pipelines.voxel_block_render_pass == VK_NULL_HANDLE);
+  assert(lime_pipelines.late_render_pass == VK_NULL_HANDLE);
   err = vkCreateRenderPass(lime_device.device, &info.create_info, NULL,
-      &lime_pipelines.voxel_block_render_pass);
-  ASSERT_VK_RESULT(err, "creating voxel block render pass");
+      &lime_pipelines.late_render_pass);
+  ASSERT_VK_RESULT(err, "creating late render pass");
 }
 
 static void
 create_descriptor_set_layouts(void)
 {
-  VkDescriptorSetLayoutBinding bindings[2];
+  VkDescriptorSetLayoutBinding bindings[8];
   VkDescriptorSetLayoutCreateInfo create_info;
+  int i;
   VkResult err;
 
   bindings[0].binding = 0;
   bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
   bindings[0].descriptorCount = 1;
-  bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+  bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT
+    | VK_SHADER_STAGE_COMPUTE_BIT;
   bindings[0].pImmutableSamplers = NULL;
+  bindings[1].binding = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  bindings[1].descriptorCount = 1;
+  bindings[1].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[1].pImmutableSamplers = NULL;
+  bindings[2].binding = 2;
+  bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  bindings[2].descriptorCount = 1;
+  bindings[2].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  bindings[2].pImmutableSamplers = NULL;
   create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
   create_info.pNext = NULL;
   create_info.flags = 0;
-  create_info.bindingCount = 1;
+  create_info.bindingCount = 3;
   create_info.pBindings = bindings;
   assert(lime_pipelines.camera_descriptor_set_layout == VK_NULL_HANDLE);
   err = vkCreateDescriptorSetLayout(lime_device.device, &create_info, NULL,
@@ -211,30 +232,108 @@ create_descriptor_set_layouts(void)
       &lime_pipelines.texture_descriptor_set_layout);
   ASSERT_VK_RESULT(err, "creating texture descriptor set layout");
 
+  /* Also read by the compute tracer. */
   bindings[0].binding = 0;
   bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
   bindings[0].descriptorCount = 1;
-  bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+  bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT
+    | VK_SHADER_STAGE_COMPUTE_BIT;
   bindings[0].pImmutableSamplers = NULL;
   bindings[1].binding = 1;
   bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
   bindings[1].descriptorCount = 1;
-  bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
   bindings[1].pImmutableSamplers = NULL;
+  /* Occupancy pyramid for skipping empty cells. */
+  bindings[2].binding = 2;
+  bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  bindings[2].descriptorCount = 1;
+  bindings[2].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[2].pImmutableSamplers = NULL;
+  /* Distance field, the alternative to the pyramid. */
+  bindings[3].binding = 3;
+  bindings[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  bindings[3].descriptorCount = 1;
+  bindings[3].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[3].pImmutableSamplers = NULL;
+  /* One bit per voxel in 4x4x4 bricks. */
+  bindings[4].binding = 4;
+  bindings[4].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  bindings[4].descriptorCount = 1;
+  bindings[4].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[4].pImmutableSamplers = NULL;
   create_info.pNext = NULL;
   create_info.flags = 0;
-  create_info.bindingCount = 2;
+  create_info.bindingCount = 5;
   create_info.pBindings = bindings;
   assert(lime_pipelines.voxel_block_descriptor_set_layout == VK_NULL_HANDLE);
   err = vkCreateDescriptorSetLayout(lime_device.device, &create_info, NULL,
       &lime_pipelines.voxel_block_descriptor_set_layout);
   ASSERT_VK_RESULT(err, "creating voxel block descriptor set layout");
+
+  /*
+   * Draws in, culled indirect commands out, per run draw counts, this and
+   * the last frame's visibility, the voxel block indirect command, per draw
+   * instance counts and the culled instance lists.
+   */
+  for (i = 0; i < 8; i++) {
+    bindings[i].binding = i;
+    bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[i].descriptorCount = 1;
+    bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    bindings[i].pImmutableSamplers = NULL;
+  }
+  create_info.pNext = NULL;
+  create_info.flags = 0;
+  create_info.bindingCount = 8;
+  create_info.pBindings = bindings;
+  assert(lime_pipelines.cull_descriptor_set_layout == VK_NULL_HANDLE);
+  err = vkCreateDescriptorSetLayout(lime_device.device, &create_info, NULL,
+      &lime_pipelines.cull_descriptor_set_layout);
+  ASSERT_VK_RESULT(err, "creating cull descriptor set layout");
+
+  bindings[0].binding = 0;
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings[0].descriptorCount = 1;
+  bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[0].pImmutableSamplers = NULL;
+  create_info.bindingCount = 1;
+  assert(lime_pipelines.occlusion_descriptor_set_layout == VK_NULL_HANDLE);
+  err = vkCreateDescriptorSetLayout(lime_device.device, &create_info, NULL,
+      &lime_pipelines.occlusion_descriptor_set_layout);
+  ASSERT_VK_RESULT(err, "creating occlusion descriptor set layout");
+
+  bindings[1].binding = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  bindings[1].descriptorCount = 1;
+  bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[1].pImmutableSamplers = NULL;
+  create_info.bindingCount = 2;
+  assert(lime_pipelines.depth_pyramid_descriptor_set_layout == VK_NULL_HANDLE);
+  err = vkCreateDescriptorSetLayout(lime_device.device, &create_info, NULL,
+      &lime_pipelines.depth_pyramid_descriptor_set_layout);
+  ASSERT_VK_RESULT(err, "creating depth pyramid descriptor set layout");
+
+  /* Traced color and depth, written by compute and read by the composite. */
+  for (i = 0; i < 2; i++) {
+    bindings[i].binding = i;
+    bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    bindings[i].descriptorCount = 1;
+    bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    bindings[i].pImmutableSamplers = NULL;
+  }
+  create_info.bindingCount = 2;
+  assert(lime_pipelines.voxel_trace_descriptor_set_layout == VK_NULL_HANDLE);
+  err = vkCreateDescriptorSetLayout(lime_device.device, &create_info, NULL,
+      &lime_pipelines.voxel_trace_descriptor_set_layout);
+  ASSERT_VK_RESULT(err, "creating voxel trace descriptor set layout");
 }
 
 static void
 create_pipeline_layouts(void)
 {
-  VkDescriptorSetLayout set_layouts[2];
+  VkDescriptorSetLayout set_layouts[3];
+  VkPushConstantRange push_constant_range;
   VkPipelineLayoutCreateInfo create_info;
   VkResult err;
 
@@ -254,17 +353,70 @@ create_pipeline_layouts(void)
 
   set_layouts[0] = lime_pipelines.camera_descriptor_set_layout;
   set_layouts[1] = lime_pipelines.voxel_block_descriptor_set_layout;
+  push_constant_range.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  push_constant_range.offset = 0;
+  push_constant_range.size = sizeof(struct voxel_block_push_constants);
   create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
   create_info.pNext = NULL;
   create_info.flags = 0;
   create_info.setLayoutCount = 2;
   create_info.pSetLayouts = set_layouts;
-  create_info.pushConstantRangeCount = 0;
-  create_info.pPushConstantRanges = NULL;
+  create_info.pushConstantRangeCount = 1;
+  create_info.pPushConstantRanges = &push_constant_range;
   assert(lime_pipelines.voxel_block_pipeline_layout == VK_NULL_HANDLE);
   err = vkCreatePipelineLayout(lime_device.device, &create_info, NULL,
       &lime_pipelines.voxel_block_pipeline_layout);
   ASSERT_VK_RESULT(err, "creating voxel block pipeline layout");
+
+  set_layouts[0] = lime_pipelines.camera_descriptor_set_layout;
+  set_layouts[1] = lime_pipelines.cull_descriptor_set_layout;
+  set_layouts[2] = lime_pipelines.occlusion_descriptor_set_layout;
+  push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_constant_range.offset = 0;
+  push_constant_range.size = sizeof(struct cull_push_constants);
+  create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  create_info.pNext = NULL;
+  create_info.flags = 0;
+  create_info.setLayoutCount = 3;
+  create_info.pSetLayouts = set_layouts;
+  create_info.pushConstantRangeCount = 1;
+  create_info.pPushConstantRanges = &push_constant_range;
+  assert(lime_pipelines.cull_pipeline_layout == VK_NULL_HANDLE);
+  err = vkCreatePipelineLayout(lime_device.device, &create_info, NULL,
+      &lime_pipelines.cull_pipeline_layout);
+  ASSERT_VK_RESULT(err, "creating cull pipeline layout");
+
+  create_info.setLayoutCount = 1;
+  create_info.pSetLayouts = &lime_pipelines.depth_pyramid_descriptor_set_layout;
+  create_info.pushConstantRangeCount = 0;
+  create_info.pPushConstantRanges = NULL;
+  assert(lime_pipelines.depth_pyramid_pipeline_layout == VK_NULL_HANDLE);
+  err = vkCreatePipelineLayout(lime_device.device, &create_info, NULL,
+      &lime_pipelines.depth_pyramid_pipeline_layout);
+  ASSERT_VK_RESULT(err, "creating depth pyramid pipeline layout");
+
+  set_layouts[0] = lime_pipelines.voxel_block_descriptor_set_layout;
+  set_layouts[1] = lime_pipelines.voxel_trace_descriptor_set_layout;
+  push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_constant_range.offset = 0;
+  push_constant_range.size = sizeof(struct voxel_trace_push_constants);
+  create_info.setLayoutCount = 2;
+  create_info.pSetLayouts = set_layouts;
+  create_info.pushConstantRangeCount = 1;
+  create_info.pPushConstantRanges = &push_constant_range;
+  assert(lime_pipelines.voxel_trace_pipeline_layout == VK_NULL_HANDLE);
+  err = vkCreatePipelineLayout(lime_device.device, &create_info, NULL,
+      &lime_pipelines.voxel_trace_pipeline_layout);
+  ASSERT_VK_RESULT(err, "creating voxel trace pipeline layout");
+
+  create_info.setLayoutCount = 1;
+  create_info.pSetLayouts = &lime_pipelines.voxel_trace_descriptor_set_layout;
+  create_info.pushConstantRangeCount = 0;
+  create_info.pPushConstantRanges = NULL;
+  assert(lime_pipelines.voxel_composite_pipeline_layout == VK_NULL_HANDLE);
+  err = vkCreatePipelineLayout(lime_device.device, &create_info, NULL,
+      &lime_pipelines.voxel_composite_pipeline_layout);
+  ASSERT_VK_RESULT(err, "creating voxel composite pipeline layout");
 }
 
 static VkShaderModule
@@ -435,6 +587,7 @@ create_pipelines(void)
 {
   VkResult err;
   struct pipeline_create_info info;
+  VkComputePipelineCreateInfo compute_info;
 
   init_default_pipeline_create_info(&info);
   info.shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
@@ -466,6 +619,36 @@ create_pipelines(void)
       &info.create_info, NULL, &lime_pipelines.pipeline);
   ASSERT_VK_RESULT(err, "creating graphics pipeline");
 
+  init_default_pipeline_create_info(&info);
+  info.shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+  info.shader_stages[0].module = hello_packed_vert_module;
+  info.shader_stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  info.shader_stages[1].module = hello_frag_module;
+  info.vertex_input_bindings[0].binding = 0;
+  info.vertex_input_bindings[0].stride = sizeof(struct packed_vertex);
+  info.vertex_input_bindings[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+  info.vertex_input_attributes[0].location = 0;
+  info.vertex_input_attributes[0].binding = 0;
+  info.vertex_input_attributes[0].format = VK_FORMAT_R16G16B16A16_UNORM;
+  info.vertex_input_attributes[0].offset = offsetof(struct packed_vertex, pos);
+  info.vertex_input_attributes[1].location = 1;
+  info.vertex_input_attributes[1].binding = 0;
+  info.vertex_input_attributes[1].format = VK_FORMAT_R16G16_SFLOAT;
+  info.vertex_input_attributes[1].offset = offsetof(struct packed_vertex, uv);
+  info.vertex_input_attributes[2].location = 2;
+  info.vertex_input_attributes[2].binding = 0;
+  info.vertex_input_attributes[2].format = VK_FORMAT_R16G16_SNORM;
+  info.vertex_input_attributes[2].offset = offsetof(struct packed_vertex, normal);
+  info.vertex_input.vertexBindingDescriptionCount = 1;
+  info.vertex_input.vertexAttributeDescriptionCount = 3;
+  info.create_info.stageCount = 2;
+  info.create_info.layout = lime_pipelines.pipeline_layout;
+  info.create_info.renderPass = lime_pipelines.render_pass;
+  assert(lime_pipelines.packed_pipeline == VK_NULL_HANDLE);
+  err = vkCreateGraphicsPipelines(lime_device.device, VK_NULL_HANDLE, 1,
+      &info.create_info, NULL, &lime_pipelines.packed_pipeline);
+  ASSERT_VK_RESULT(err, "creating packed vertex pipeline");
+
   init_default_pipeline_create_info(&info);
   info.shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
   info.shader_stages[0].module = voxel_block_vert_module;
@@ -473,11 +656,53 @@ create_pipelines(void)
   info.shader_stages[1].module = voxel_block_frag_module;
   info.create_info.stageCount = 2;
   info.create_info.layout = lime_pipelines.voxel_block_pipeline_layout;
-  info.create_info.renderPass = lime_pipelines.voxel_block_render_pass;
+  info.create_info.renderPass = lime_pipelines.late_render_pass;
   assert(lime_pipelines.voxel_block_pipeline == VK_NULL_HANDLE);
   err = vkCreateGraphicsPipelines(lime_device.device, VK_NULL_HANDLE, 1,
       &info.create_info, NULL, &lime_pipelines.voxel_block_pipeline);
   ASSERT_VK_RESULT(err, "creating voxel block pipeline");
+
+  init_default_pipeline_create_info(&info);
+  info.shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+  info.shader_stages[0].module = voxel_composite_vert_module;
+  info.shader_stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  info.shader_stages[1].module = voxel_composite_frag_module;
+  info.rasterization.cullMode = VK_CULL_MODE_NONE;
+  info.create_info.stageCount = 2;
+  info.create_info.layout = lime_pipelines.voxel_composite_pipeline_layout;
+  info.create_info.renderPass = lime_pipelines.late_render_pass;
+  assert(lime_pipelines.voxel_composite_pipeline == VK_NULL_HANDLE);
+  err = vkCreateGraphicsPipelines(lime_device.device, VK_NULL_HANDLE, 1,
+      &info.create_info, NULL, &lime_pipelines.voxel_composite_pipeline);
+  ASSERT_VK_RESULT(err, "creating voxel composite pipeline");
+
+  compute_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  compute_info.pNext = NULL;
+  compute_info.flags = 0;
+  compute_info.stage = info.shader_stages[0];
+  compute_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  compute_info.stage.module = cull_comp_module;
+  compute_info.layout = lime_pipelines.cull_pipeline_layout;
+  compute_info.basePipelineHandle = VK_NULL_HANDLE;
+  compute_info.basePipelineIndex = -1;
+  assert(lime_pipelines.cull_pipeline == VK_NULL_HANDLE);
+  err = vkCreateComputePipelines(lime_device.device, VK_NULL_HANDLE, 1,
+      &compute_info, NULL, &lime_pipelines.cull_pipeline);
+  ASSERT_VK_RESULT(err, "creating cull pipeline");
+
+  compute_info.stage.module = depth_pyramid_comp_module;
+  compute_info.layout = lime_pipelines.depth_pyramid_pipeline_layout;
+  assert(lime_pipelines.depth_pyramid_pipeline == VK_NULL_HANDLE);
+  err = vkCreateComputePipelines(lime_device.device, VK_NULL_HANDLE, 1,
+      &compute_info, NULL, &lime_pipelines.depth_pyramid_pipeline);
+  ASSERT_VK_RESULT(err, "creating depth pyramid pipeline");
+
+  compute_info.stage.module = voxel_trace_comp_module;
+  compute_info.layout = lime_pipelines.voxel_trace_pipeline_layout;
+  assert(lime_pipelines.voxel_trace_pipeline == VK_NULL_HANDLE);
+  err = vkCreateComputePipelines(lime_device.device, VK_NULL_HANDLE, 1,
+      &compute_info, NULL, &lime_pipelines.voxel_trace_pipeline);
+  ASSERT_VK_RESULT(err, "creating voxel trace pipeline");
 }
 
 void
@@ -487,9 +712,15 @@ lime_init_pipelines(void)
   create_descriptor_set_layouts();
   create_pipeline_layouts();
   hello_vert_module = create_shader_module("hello.vert.spv");
+  hello_packed_vert_module = create_shader_module("hello_packed.vert.spv");
   hello_frag_module = create_shader_module("hello.frag.spv");
   voxel_block_vert_module = create_shader_module("voxel_block.vert.spv");
   voxel_block_frag_module = create_shader_module("voxel_block.frag.spv");
+  cull_comp_module = create_shader_module("cull.comp.spv");
+  depth_pyramid_comp_module = create_shader_module("depth_pyramid.comp.spv");
+  voxel_trace_comp_module = create_shader_module("voxel_trace.comp.spv");
+  voxel_composite_vert_module = create_shader_module("voxel_composite.vert.spv");
+  voxel_composite_frag_module = create_shader_module("voxel_composite.frag.spv");
   create_pipelines();
 }
 
@@ -497,19 +728,45 @@ void
 lime_destroy_pipelines(void)
 {
   vkDestroyPipeline(lime_device.device, lime_pipelines.pipeline, NULL);
+  vkDestroyPipeline(lime_device.device, lime_pipelines.packed_pipeline, NULL);
   vkDestroyPipeline(lime_device.device, lime_pipelines.voxel_block_pipeline, NULL);
+  vkDestroyPipeline(lime_device.device, lime_pipelines.cull_pipeline, NULL);
+  vkDestroyPipeline(lime_device.device, lime_pipelines.depth_pyramid_pipeline, NULL);
+  vkDestroyPipeline(lime_device.device, lime_pipelines.voxel_trace_pipeline, NULL);
+  vkDestroyPipeline(lime_device.device, lime_pipelines.voxel_composite_pipeline, NULL);
   vkDestroyShaderModule(lime_device.device, hello_vert_module, NULL);
+  vkDestroyShaderModule(lime_device.device, hello_packed_vert_module, NULL);
   vkDestroyShaderModule(lime_device.device, hello_frag_module, NULL);
   vkDestroyShaderModule(lime_device.device, voxel_block_vert_module, NULL);
   vkDestroyShaderModule(lime_device.device, voxel_block_frag_module, NULL);
+  vkDestroyShaderModule(lime_device.device, cull_comp_module, NULL);
+  vkDestroyShaderModule(lime_device.device, depth_pyramid_comp_module, NULL);
+  vkDestroyShaderModule(lime_device.device, voxel_trace_comp_module, NULL);
+  vkDestroyShaderModule(lime_device.device, voxel_composite_vert_module, NULL);
+  vkDestroyShaderModule(lime_device.device, voxel_composite_frag_module, NULL);
   vkDestroyPipelineLayout(lime_device.device, lime_pipelines.pipeline_layout, NULL);
   vkDestroyPipelineLayout(lime_device.device, lime_pipelines.voxel_block_pipeline_layout, NULL);
+  vkDestroyPipelineLayout(lime_device.device, lime_pipelines.cull_pipeline_layout, NULL);
+  vkDestroyPipelineLayout(lime_device.device, lime_pipelines.depth_pyramid_pipeline_layout,
+      NULL);
+  vkDestroyPipelineLayout(lime_device.device, lime_pipelines.voxel_trace_pipeline_layout,
+      NULL);
+  vkDestroyPipelineLayout(lime_device.device, lime_pipelines.voxel_composite_pipeline_layout,
+      NULL);
   vkDestroyDescriptorSetLayout(lime_device.device,
       lime_pipelines.camera_descriptor_set_layout, NULL);
   vkDestroyDescriptorSetLayout(lime_device.device,
       lime_pipelines.texture_descriptor_set_layout, NULL);
   vkDestroyDescriptorSetLayout(lime_device.device,
       lime_pipelines.voxel_block_descriptor_set_layout, NULL);
+  vkDestroyDescriptorSetLayout(lime_device.device,
+      lime_pipelines.cull_descriptor_set_layout, NULL);
+  vkDestroyDescriptorSetLayout(lime_device.device,
+      lime_pipelines.occlusion_descriptor_set_layout, NULL);
+  vkDestroyDescriptorSetLayout(lime_device.device,
+      lime_pipelines.depth_pyramid_descriptor_set_layout, NULL);
+  vkDestroyDescriptorSetLayout(lime_device.device,
+      lime_pipelines.voxel_trace_descriptor_set_layout, NULL);
   vkDestroyRenderPass(lime_device.device, lime_pipelines.render_pass, NULL);
-  vkDestroyRenderPass(lime_device.device, lime_pipelines.voxel_block_render_pass, NULL);
+  vkDestroyRenderPass(lime_device.device, lime_pipelines.late_render_pass, NULL);
 }
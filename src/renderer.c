@@ -5,6 +5,7 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <vulkan/vulkan.h>
 #include <GLFW/glfw3.h>
 #include "matrix.h"
@@ -13,23 +14,105 @@
 #include "lime.h"
 #include "utils.h"
 
+struct record_chunk;
+
 static void create_synchronization_objects(void);
 static void create_graphics_command_pool(void);
+static void create_record_command_pools(void);
 static void allocate_command_buffers(void);
-static void record_command_buffer(VkCommandBuffer command_buffer,
-    int swap_index, const struct graphics_vertex_obj *gvo);
-static void record_command_buffers(const struct graphics_vertex_obj *gvo);
+static void write_draw(struct lime_draw_buffers *buffers, int index, int first_object,
+    int run_first, const struct lime_draw *draw);
+static void draw_run(VkCommandBuffer command_buffer,
+    const struct lime_draw_buffers *buffers, int first, int count);
+static int cull_compacts(void);
+static void record_cull_pass(VkCommandBuffer command_buffer, int frame,
+    enum cull_phase phase, int draw_count, int object_count);
+static void begin_render_pass(VkCommandBuffer command_buffer, int swap_index,
+    enum cull_phase phase);
+static void record_phase(const struct record_chunk *c, enum cull_phase phase);
+static void *record_draws(void *chunk);
+static void *run_record_worker(void *index);
+static void start_record_workers(void);
+static void stop_record_workers(void);
+static void record_command_buffer(VkCommandBuffer command_buffer, int frame,
+    int swap_index, const struct camera_uniform_data *camera,
+    const struct lime_draw *draws, int draw_count, int object_count);
+static void set_voxel_block_constants(const struct camera_uniform_data *camera);
+static void create_timestamp_query_pool(void);
+static void read_pass_times(int frame);
+static void count_drawn_triangles(int frame);
+
+/* Vertex buffer bytes the defragmenter may move each frame. */
+#define DEFRAGMENT_BYTES_PER_FRAME (1 << 20)
+/* Threads recording the scene pass, including the calling thread. */
+#define RECORD_THREADS 4
+/* Fewer draws than this per thread are not worth a thread. */
+#define MIN_DRAWS_PER_THREAD 1024
+/* Must match local_size_x in cull.comp. */
+#define CULL_WORKGROUP_SIZE 64
+/* Around the early and late render passes, then around the voxel trace. */
+#define TIMESTAMPS_PER_FRAME 6
+
+/*
+ * A slice of the draw list recorded into one secondary command buffer for
+ * each cull phase.
+ */
+struct record_chunk {
+  VkCommandBuffer command_buffers[2];
+  int frame, swap_index;
+  const struct lime_draw *draws;
+  /* Index of draws[0] and its first instance in the frame's draw buffers. */
+  int first, first_object, draw_count;
+};
 
+/*
+ * Each frame in flight has its own command buffer, camera uniform slot,
+ * timestamp pair, acquire semaphore and fence. Present semaphores belong to
+ * swapchain images since presentation may hold them after the frame's fence
+ * has signalled.
+ */
 static VkCommandPool graphics_command_pool;
-static VkCommandBuffer command_buffers[MAX_SWAPCHAIN_IMAGES];
-static VkSemaphore image_available_semaphore, render_finished_semaphore;
-static VkFence frame_finished_fence;
+static VkCommandBuffer command_buffers[FRAMES_IN_FLIGHT];
+/*
+ * Command pools are not thread safe, so each recording thread gets its own
+ * pool per frame in flight, reset whole once the frame's fence signals.
+ */
+static VkCommandPool record_command_pools[FRAMES_IN_FLIGHT][RECORD_THREADS];
+static VkCommandBuffer secondary_command_buffers[FRAMES_IN_FLIGHT][RECORD_THREADS][2];
+static VkSemaphore image_available_semaphores[FRAMES_IN_FLIGHT];
+static VkSemaphore render_finished_semaphores[MAX_SWAPCHAIN_IMAGES];
+static VkFence frame_finished_fences[FRAMES_IN_FLIGHT];
+/* Fence of the frame last rendered to each swapchain image. */
+static VkFence image_fences[MAX_SWAPCHAIN_IMAGES];
+static int current_frame;
+/* Ray setup of the frame being recorded, pushed before drawing the voxel block. */
+static struct voxel_block_push_constants voxel_block_constants;
+/* Objects in the last frame submitted, whose visibility the cull pass reads. */
+static int last_object_count;
+static VkQueryPool timestamp_query_pool;
+static int timestamps_written[FRAMES_IN_FLIGHT];
+static double scene_pass_time = -1.0, voxel_trace_time = -1.0;
+/* Draws submitted in each frame slot, whose culled instances are counted. */
+static int frame_draw_counts[FRAMES_IN_FLIGHT];
+static long drawn_triangles = -1;
+/*
+ * Workers record chunks 1 and up, the calling thread chunk 0. Each frame
+ * bumps record_generation to wake them and waits for pending_chunks to
+ * drop to zero.
+ */
+static pthread_t record_workers[RECORD_THREADS];
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t record_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t record_done = PTHREAD_COND_INITIALIZER;
+static struct record_chunk record_chunks[RECORD_THREADS];
+static int record_chunk_count, record_generation, pending_chunks, stop_recording;
 
 static void
 create_synchronization_objects(void)
 {
   VkSemaphoreCreateInfo semaphore_create_info;
   VkFenceCreateInfo fence_create_info;
+  int i;
   VkResult err;
   semaphore_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
   semaphore_create_info.pNext = NULL;
@@ -37,17 +120,23 @@ create_synchronization_objects(void)
   fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
   fence_create_info.pNext = NULL;
   fence_create_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-  assert(image_available_semaphore == VK_NULL_HANDLE);
-  assert(render_finished_semaphore == VK_NULL_HANDLE);
-  assert(frame_finished_fence == VK_NULL_HANDLE);
-  err = vkCreateSemaphore(lime_device.device, &semaphore_create_info, NULL,
-      &image_available_semaphore);
-  ASSERT_VK_RESULT(err, "creating semaphore");
-  err = vkCreateSemaphore(lime_device.device, &semaphore_create_info, NULL,
-      &render_finished_semaphore);
-  ASSERT_VK_RESULT(err, "creating semaphore");
-  err = vkCreateFence(lime_device.device, &fence_create_info, NULL,
-      &frame_finished_fence);
+  for (i = 0; i < FRAMES_IN_FLIGHT; i++) {
+    assert(image_available_semaphores[i] == VK_NULL_HANDLE);
+    assert(frame_finished_fences[i] == VK_NULL_HANDLE);
+    err = vkCreateSemaphore(lime_device.device, &semaphore_create_info, NULL,
+        &image_available_semaphores[i]);
+    ASSERT_VK_RESULT(err, "creating semaphore");
+    err = vkCreateFence(lime_device.device, &fence_create_info, NULL,
+        &frame_finished_fences[i]);
+    ASSERT_VK_RESULT(err, "creating fence");
+  }
+  for (i = 0; i < lime_resources.swapchain_image_count; i++) {
+    assert(render_finished_semaphores[i] == VK_NULL_HANDLE);
+    err = vkCreateSemaphore(lime_device.device, &semaphore_create_info, NULL,
+        &render_finished_semaphores[i]);
+    ASSERT_VK_RESULT(err, "creating semaphore");
+    image_fences[i] = VK_NULL_HANDLE;
+  }
 }
 
 static void
@@ -64,39 +153,324 @@ create_graphics_command_pool(void)
   ASSERT_VK_RESULT(err, "creating graphics command pool");
 }
 
+static void
+create_record_command_pools(void)
+{
+  VkCommandPoolCreateInfo create_info;
+  int i, j;
+  VkResult err;
+  create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  create_info.pNext = NULL;
+  create_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  create_info.queueFamilyIndex = lime_device.graphics_family_index;
+  for (i = 0; i < FRAMES_IN_FLIGHT; i++) {
+    for (j = 0; j < RECORD_THREADS; j++) {
+      assert(record_command_pools[i][j] == VK_NULL_HANDLE);
+      err = vkCreateCommandPool(lime_device.device, &create_info, NULL,
+          &record_command_pools[i][j]);
+      ASSERT_VK_RESULT(err, "creating record command pool");
+    }
+  }
+}
+
+static void
+create_timestamp_query_pool(void)
+{
+  VkQueryPoolCreateInfo create_info;
+  VkResult err;
+  create_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  create_info.pNext = NULL;
+  create_info.flags = 0;
+  create_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  create_info.queryCount = TIMESTAMPS_PER_FRAME * FRAMES_IN_FLIGHT;
+  create_info.pipelineStatistics = 0;
+  assert(timestamp_query_pool == VK_NULL_HANDLE);
+  err = vkCreateQueryPool(lime_device.device, &create_info, NULL, &timestamp_query_pool);
+  ASSERT_VK_RESULT(err, "creating timestamp query pool");
+}
+
+/* Only valid once the submission that wrote the timestamps has finished. */
+static void
+read_pass_times(int frame)
+{
+  uint64_t timestamps[TIMESTAMPS_PER_FRAME];
+  int count;
+  VkResult err;
+  count = lime_voxel_trace.enabled ? 6 : 4;
+  err = vkGetQueryPoolResults(lime_device.device, timestamp_query_pool,
+      TIMESTAMPS_PER_FRAME * frame, count, count * sizeof(uint64_t), timestamps,
+      sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+  if (err != VK_SUCCESS)
+    return;
+  scene_pass_time = (timestamps[1] - timestamps[0] + timestamps[3] - timestamps[2])
+    * lime_device.properties.limits.timestampPeriod * 1e-6;
+  if (lime_voxel_trace.enabled)
+    voxel_trace_time = (timestamps[5] - timestamps[4])
+      * lime_device.properties.limits.timestampPeriod * 1e-6;
+}
+
+/*
+ * Sums the triangles of the instances both cull phases kept. Only valid once
+ * the submission has finished and before its draw buffers are written again.
+ */
+static void
+count_drawn_triangles(int frame)
+{
+  struct lime_draw_buffers *buffers;
+  long triangles;
+  int i, late;
+
+  buffers = &lime_resources.draw_buffers[frame];
+  late = buffers->draw_capacity;
+  triangles = 0;
+  for (i = 0; i < frame_draw_counts[frame]; i++)
+    triangles += (long)(buffers->instance_counts[i] + buffers->instance_counts[late + i])
+      * (buffers->draws[i].command.indexCount / 3);
+  drawn_triangles = triangles;
+}
+
 static void
 allocate_command_buffers(void)
 {
   VkCommandBufferAllocateInfo allocate_info;
+  int i, j;
   VkResult err;
   allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
   allocate_info.pNext = NULL;
   allocate_info.commandPool = graphics_command_pool;
   allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  allocate_info.commandBufferCount = lime_resources.swapchain_image_count;
+  allocate_info.commandBufferCount = FRAMES_IN_FLIGHT;
   assert(command_buffers[0] == VK_NULL_HANDLE);
   err = vkAllocateCommandBuffers(lime_device.device, &allocate_info, command_buffers);
   ASSERT_VK_RESULT(err, "allocating command buffers");
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+  allocate_info.commandBufferCount = 2;
+  for (i = 0; i < FRAMES_IN_FLIGHT; i++) {
+    for (j = 0; j < RECORD_THREADS; j++) {
+      allocate_info.commandPool = record_command_pools[i][j];
+      err = vkAllocateCommandBuffers(lime_device.device, &allocate_info,
+          secondary_command_buffers[i][j]);
+      ASSERT_VK_RESULT(err, "allocating secondary command buffers");
+    }
+  }
 }
 
+/* Fills in the draw before culling and the object data of its instances. */
 static void
-record_command_buffer(VkCommandBuffer command_buffer, int swap_index,
-    const struct graphics_vertex_obj *gvo)
+write_draw(struct lime_draw_buffers *buffers, int index, int first_object,
+    int run_first, const struct lime_draw *draw)
+{
+  const struct graphics_vertex_obj *gvo;
+  struct cull_draw *cull_draw;
+  struct object_data *object;
+  int i, j;
+
+  gvo = draw->gvo;
+  cull_draw = &buffers->draws[index];
+  cull_draw->command.indexCount = gvo->index_count;
+  cull_draw->command.instanceCount = draw->instance_count;
+  cull_draw->command.firstIndex = gvo->index_offset / gvo->index_size;
+  cull_draw->command.vertexOffset = gvo->vertex_offset / (gvo->format == VERTEX_FORMAT_PACKED
+      ? sizeof(struct packed_vertex) : sizeof(struct vertex));
+  cull_draw->command.firstInstance = first_object;
+  cull_draw->run_first = run_first;
+  for (i = 0; i < draw->instance_count; i++) {
+    object = &buffers->objects[first_object + i];
+    memcpy(object->model, draw->models[i], sizeof(mat4));
+    for (j = 0; j < 3; j++) {
+      object->position_offset[j] = gvo->position_offset[j];
+      object->position_scale[j] = gvo->position_scale[j];
+    }
+    object->position_scale[3] = 0.0f;
+    object->draw = index;
+  }
+}
+
+/* Compaction needs the draw count from a buffer and multi draw calls. */
+static int
+cull_compacts(void)
+{
+  return lime_device.draw_indirect_count && lime_device.multi_draw_indirect;
+}
+
+/*
+ * Draws the culled commands of the run starting at first. Compacted runs
+ * read their draw count from the count buffer, otherwise culled draws have
+ * no instances and each indirect call holds up to maxDrawIndirectCount draws.
+ */
+static void
+draw_run(VkCommandBuffer command_buffer, const struct lime_draw_buffers *buffers,
+    int first, int count)
+{
+  int max_count, n;
+  if (cull_compacts()) {
+    vkCmdDrawIndexedIndirectCount(command_buffer, buffers->indirect_buffer,
+        first * sizeof(VkDrawIndexedIndirectCommand), buffers->count_buffer,
+        first * sizeof(uint32_t), count, sizeof(VkDrawIndexedIndirectCommand));
+    return;
+  }
+  max_count = lime_device.multi_draw_indirect
+    ? lime_device.properties.limits.maxDrawIndirectCount : 1;
+  while (count > 0) {
+    n = count < max_count ? count : max_count;
+    vkCmdDrawIndexedIndirect(command_buffer, buffers->indirect_buffer,
+        first * sizeof(VkDrawIndexedIndirectCommand), n,
+        sizeof(VkDrawIndexedIndirectCommand));
+    first += n;
+    count -= n;
+  }
+}
+
+/*
+ * Culls the frame's instances for one phase, then writes the indirect
+ * commands that phase's scene pass draws from. The late phase always runs
+ * since it also culls the voxel block.
+ */
+static void
+record_cull_pass(VkCommandBuffer command_buffer, int frame, enum cull_phase phase,
+    int draw_count, int object_count)
+{
+  struct lime_draw_buffers *buffers;
+  struct cull_push_constants push_constants;
+  VkMemoryBarrier instance_barrier;
+  VkBufferMemoryBarrier barriers[4];
+  int i, group_count;
+
+  buffers = &lime_resources.draw_buffers[frame];
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      lime_pipelines.cull_pipeline);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      lime_pipelines.cull_pipeline_layout, 0, 1,
+      &lime_resources.camera_descriptor_sets[frame], 0, NULL);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      lime_pipelines.cull_pipeline_layout, 1, 1,
+      &buffers->cull_descriptor_set, 0, NULL);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      lime_pipelines.cull_pipeline_layout, 2, 1,
+      &lime_depth_pyramid.occlusion_descriptor_set, 0, NULL);
+  memcpy(push_constants.voxel_block_model, lime_voxel_blocks.model, sizeof(mat4));
+  push_constants.draw_count = draw_count;
+  push_constants.object_count = object_count;
+  push_constants.last_object_count = last_object_count;
+  push_constants.compact = cull_compacts();
+  push_constants.phase = phase;
+  push_constants.step = CULL_STEP_INSTANCES;
+  push_constants.late_draw_offset = buffers->draw_capacity;
+  push_constants.late_object_offset = buffers->object_capacity;
+  vkCmdPushConstants(command_buffer, lime_pipelines.cull_pipeline_layout,
+      VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants), &push_constants);
+  group_count = (object_count + CULL_WORKGROUP_SIZE - 1) / CULL_WORKGROUP_SIZE;
+  vkCmdDispatch(command_buffer, group_count > 0 ? group_count : 1, 1, 1);
+
+  /* Draws read the instance counts of every instance of theirs. */
+  instance_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  instance_barrier.pNext = NULL;
+  instance_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  instance_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &instance_barrier, 0, NULL, 0, NULL);
+  push_constants.step = CULL_STEP_DRAWS;
+  vkCmdPushConstants(command_buffer, lime_pipelines.cull_pipeline_layout,
+      VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants), &push_constants);
+  group_count = (draw_count + CULL_WORKGROUP_SIZE - 1) / CULL_WORKGROUP_SIZE;
+  if (group_count > 0)
+    vkCmdDispatch(command_buffer, group_count, 1, 1);
+
+  for (i = 0; i < 4; i++) {
+    barriers[i].sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barriers[i].pNext = NULL;
+    barriers[i].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barriers[i].dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    barriers[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[i].offset = 0;
+    barriers[i].size = VK_WHOLE_SIZE;
+  }
+  barriers[0].buffer = buffers->instance_buffer;
+  barriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barriers[1].buffer = buffers->indirect_buffer;
+  barriers[2].buffer = buffers->count_buffer;
+  barriers[3].buffer = buffers->voxel_block_indirect_buffer;
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0, 0, NULL,
+      phase == CULL_PHASE_LATE ? 4 : 3, barriers, 0, NULL);
+}
+
+/*
+ * The early pass clears the frame, the late pass loads it and leaves the
+ * color attachment ready to present.
+ */
+static void
+begin_render_pass(VkCommandBuffer command_buffer, int swap_index, enum cull_phase phase)
 {
-  VkCommandBufferBeginInfo begin_info;
   VkClearValue clear_values[2];
   VkRenderPassBeginInfo render_pass_info;
+
+  assert(lime_device.surface_format.format == VK_FORMAT_B8G8R8A8_SRGB);
+  clear_values[0].color.float32[0] = powf(128.0f / 255.0, 2.4f);
+  clear_values[0].color.float32[1] = powf(218.0f / 255.0, 2.4f);
+  clear_values[0].color.float32[2] = powf(251.0f / 255.0, 2.4f);
+  clear_values[0].color.float32[3] = 1.0f;
+  clear_values[1].depthStencil.depth = 1.0f;
+  clear_values[1].depthStencil.stencil = 0;
+  render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  render_pass_info.pNext = NULL;
+  render_pass_info.renderArea.offset.x = 0;
+  render_pass_info.renderArea.offset.y = 0;
+  render_pass_info.renderArea.extent = lime_resources.swapchain_extent;
+  render_pass_info.framebuffer = lime_resources.swapchain_framebuffers[swap_index];
+  if (phase == CULL_PHASE_EARLY) {
+    render_pass_info.renderPass = lime_pipelines.render_pass;
+    render_pass_info.clearValueCount = sizeof(clear_values) / sizeof(clear_values[0]);
+    render_pass_info.pClearValues = clear_values;
+  } else {
+    render_pass_info.renderPass = lime_pipelines.late_render_pass;
+    render_pass_info.clearValueCount = 0;
+    render_pass_info.pClearValues = NULL;
+  }
+  vkCmdBeginRenderPass(command_buffer, &render_pass_info,
+      VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+}
+
+/*
+ * Records the chunk's runs inside one phase's render pass. Consecutive draws
+ * sharing a pipeline and index type form a run, drawn by one indirect draw
+ * call from the commands that phase's cull pass writes. The first chunk's
+ * late pass also draws the voxel block if it survived culling.
+ */
+static void
+record_phase(const struct record_chunk *c, enum cull_phase phase)
+{
+  const struct graphics_vertex_obj *gvo;
+  const struct lime_draw_buffers *buffers;
+  VkCommandBuffer command_buffer;
+  VkCommandBufferInheritanceInfo inheritance_info;
+  VkCommandBufferBeginInfo begin_info;
   VkViewport viewport;
   VkRect2D scissor;
+  int i, run, offset, bound_format, bound_index_size;
   VkResult err;
 
+  buffers = &lime_resources.draw_buffers[c->frame];
+  command_buffer = c->command_buffers[phase];
+  inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+  inheritance_info.pNext = NULL;
+  inheritance_info.renderPass = phase == CULL_PHASE_EARLY
+    ? lime_pipelines.render_pass : lime_pipelines.late_render_pass;
+  inheritance_info.subpass = 0;
+  inheritance_info.framebuffer = lime_resources.swapchain_framebuffers[c->swap_index];
+  inheritance_info.occlusionQueryEnable = VK_FALSE;
+  inheritance_info.queryFlags = 0;
+  inheritance_info.pipelineStatistics = 0;
   begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
   begin_info.pNext = NULL;
-  begin_info.flags = 0;
-  begin_info.pInheritanceInfo = NULL;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+    | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+  begin_info.pInheritanceInfo = &inheritance_info;
   err = vkBeginCommandBuffer(command_buffer, &begin_info);
-  ASSERT_VK_RESULT(err, "begining command buffer");
+  ASSERT_VK_RESULT(err, "begining secondary command buffer");
 
+  /* Dynamic state is not inherited from the primary command buffer. */
   viewport.x = viewport.y = 0.0f;
   viewport.width = lime_resources.swapchain_extent.width;
   viewport.height = lime_resources.swapchain_extent.height;
@@ -104,118 +478,428 @@ record_command_buffer(VkCommandBuffer command_buffer, int swap_index,
   viewport.maxDepth = 1.0f;
   scissor.offset.x = scissor.offset.y = 0;
   scissor.extent = lime_resources.swapchain_extent;
-
   vkCmdSetViewport(command_buffer, 0, 1, &viewport);
   vkCmdSetScissor(command_buffer, 0, 1, &scissor);
-
-  assert(lime_device.surface_format.format == VK_FORMAT_B8G8R8A8_SRGB);
-  clear_values[0].color.float32[0] = powf(128.0f / 255.0, 2.4f);
-  clear_values[0].color.float32[1] = powf(218.0f / 255.0, 2.4f);
-  clear_values[0].color.float32[2] = powf(251.0f / 255.0, 2.4f);
-  clear_values[0].color.float32[3] = 1.0f;
-  clear_values[1].depthStencil.depth = 1.0f;
-  clear_values[1].depthStencil.stencil = 0;
-  render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-  render_pass_info.pNext = NULL;
-  render_pass_info.renderPass = lime_pipelines.render_pass;
-  render_pass_info.framebuffer = lime_resources.swapchain_framebuffers[swap_index];
-  render_pass_info.renderArea.offset.x = 0;
-  render_pass_info.renderArea.offset.y = 0;
-  render_pass_info.renderArea.extent = lime_resources.swapchain_extent;
-  render_pass_info.clearValueCount = sizeof(clear_values) / sizeof(clear_values[0]);
-  render_pass_info.pClearValues = clear_values;
-  vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
-  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, lime_pipelines.pipeline);
   vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
       lime_pipelines.pipeline_layout, 0, 1,
-      &lime_resources.camera_descriptor_sets[swap_index], 0, NULL);
+      &lime_resources.camera_descriptor_sets[c->frame], 0, NULL);
   vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
       lime_pipelines.pipeline_layout, 1, 1,
       &lime_textures.texture_descriptor_set, 0, NULL);
   vkCmdBindVertexBuffers(command_buffer, 0, 1, &lime_vertex_buffers.vertex_buffer,
       &(VkDeviceSize){0});
-  vkCmdBindIndexBuffer(command_buffer, lime_vertex_buffers.index_buffer, 0, VK_INDEX_TYPE_UINT32);
-  vkCmdDrawIndexed(command_buffer, gvo->index_count, 1, gvo->index_offset, gvo->vertex_offset, 0);
-  vkCmdEndRenderPass(command_buffer);
 
-  render_pass_info.renderPass = lime_pipelines.voxel_block_render_pass;
-  render_pass_info.framebuffer = lime_resources.voxel_block_framebuffers[swap_index];
-  render_pass_info.clearValueCount = 0;
-  render_pass_info.pClearValues = NULL;
-  vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
-  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, lime_pipelines.voxel_block_pipeline);
-  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-      lime_pipelines.voxel_block_pipeline_layout, 0, 1,
-      &lime_resources.camera_descriptor_sets[swap_index], 0, NULL);
-  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-      lime_pipelines.voxel_block_pipeline_layout, 1, 1,
-      &lime_voxel_blocks.descriptor_set, 0, NULL);
-  vkCmdDraw(command_buffer, 36, 1, 0, 0);
-  vkCmdEndRenderPass(command_buffer);
+  offset = phase == CULL_PHASE_LATE ? buffers->draw_capacity : 0;
+  bound_format = bound_index_size = -1;
+  for (i = 0; i < c->draw_count; i = run) {
+    gvo = c->draws[i].gvo;
+    if ((int)gvo->format != bound_format) {
+      vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+          gvo->format == VERTEX_FORMAT_PACKED
+          ? lime_pipelines.packed_pipeline : lime_pipelines.pipeline);
+      bound_format = gvo->format;
+    }
+    if (gvo->index_size != bound_index_size) {
+      vkCmdBindIndexBuffer(command_buffer, lime_vertex_buffers.index_buffer, 0,
+          gvo->index_size == sizeof(uint16_t) ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32);
+      bound_index_size = gvo->index_size;
+    }
+    for (run = i; run < c->draw_count && c->draws[run].gvo->format == gvo->format
+        && c->draws[run].gvo->index_size == gvo->index_size; run++);
+    draw_run(command_buffer, buffers, offset + c->first + i, run - i);
+  }
+
+  if (phase == CULL_PHASE_LATE && c->first == 0 && lime_voxel_trace.enabled) {
+    /* A fullscreen triangle depth tests the traced block against the scene. */
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+        lime_pipelines.voxel_composite_pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+        lime_pipelines.voxel_composite_pipeline_layout, 0, 1,
+        &lime_voxel_trace.descriptor_set, 0, NULL);
+    vkCmdDraw(command_buffer, 3, 1, 0, 0);
+  } else if (phase == CULL_PHASE_LATE && c->first == 0) {
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+        lime_pipelines.voxel_block_pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+        lime_pipelines.voxel_block_pipeline_layout, 0, 1,
+        &lime_resources.camera_descriptor_sets[c->frame], 0, NULL);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+        lime_pipelines.voxel_block_pipeline_layout, 1, 1,
+        &lime_voxel_blocks.descriptor_set, 0, NULL);
+    vkCmdPushConstants(command_buffer, lime_pipelines.voxel_block_pipeline_layout,
+        VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(voxel_block_constants),
+        &voxel_block_constants);
+    vkCmdDrawIndirect(command_buffer, buffers->voxel_block_indirect_buffer, 0, 1,
+        sizeof(VkDrawIndirectCommand));
+  }
 
   err = vkEndCommandBuffer(command_buffer);
-  ASSERT_VK_RESULT(err, "recording command buffer");
+  ASSERT_VK_RESULT(err, "recording secondary command buffer");
 }
 
+/*
+ * Finds the camera in voxel block space and its forward vector in world
+ * space once per frame, rather than inverting the view and model matrices
+ * for every fragment of the block.
+ */
 static void
-record_command_buffers(const struct graphics_vertex_obj *gvo)
+set_voxel_block_constants(const struct camera_uniform_data *camera)
 {
+  mat4 model_view, inverse;
+  float length;
   int i;
-  for (i = 0; i < lime_resources.swapchain_image_count; i++)
-    record_command_buffer(command_buffers[i], i, gvo);
+
+  mat4_multiply(model_view, camera->view, lime_voxel_blocks.model);
+  if (mat4_inverse(inverse, model_view))
+    for (i = 0; i < 4; i++)
+      voxel_block_constants.camera_position[i] = inverse[12 + i];
+  if (mat4_inverse(inverse, camera->view)) {
+    length = sqrtf(inverse[8] * inverse[8] + inverse[9] * inverse[9]
+        + inverse[10] * inverse[10]);
+    for (i = 0; i < 3; i++)
+      voxel_block_constants.camera_forward[i] = inverse[8 + i] / length;
+    voxel_block_constants.camera_forward[3] = 0.0f;
+  }
+}
+
+/*
+ * Writes a slice of the draw list to the frame's draw buffers, clears the
+ * draw and instance counts of its draws for both phases and records both
+ * phases.
+ */
+static void *
+record_draws(void *chunk)
+{
+  const struct record_chunk *c = chunk;
+  const struct graphics_vertex_obj *gvo;
+  struct lime_draw_buffers *buffers;
+  int i, run, first_object, late;
+
+  buffers = &lime_resources.draw_buffers[c->frame];
+  late = buffers->draw_capacity;
+  first_object = c->first_object;
+  for (i = 0; i < c->draw_count; i = run) {
+    gvo = c->draws[i].gvo;
+    buffers->counts[c->first + i] = 0;
+    buffers->counts[late + c->first + i] = 0;
+    for (run = i; run < c->draw_count && c->draws[run].gvo->format == gvo->format
+        && c->draws[run].gvo->index_size == gvo->index_size; run++) {
+      buffers->instance_counts[c->first + run] = 0;
+      buffers->instance_counts[late + c->first + run] = 0;
+      write_draw(buffers, c->first + run, first_object, c->first + i, &c->draws[run]);
+      first_object += c->draws[run].instance_count;
+    }
+  }
+  record_phase(c, CULL_PHASE_EARLY);
+  record_phase(c, CULL_PHASE_LATE);
+  return NULL;
+}
+
+static void *
+run_record_worker(void *index)
+{
+  int i, generation;
+
+  i = (int)(intptr_t)index;
+  generation = 0;
+  pthread_mutex_lock(&record_mutex);
+  for (;;) {
+    while (record_generation == generation && !stop_recording)
+      pthread_cond_wait(&record_start, &record_mutex);
+    if (stop_recording)
+      break;
+    generation = record_generation;
+    if (i >= record_chunk_count)
+      continue;
+    pthread_mutex_unlock(&record_mutex);
+    record_draws(&record_chunks[i]);
+    pthread_mutex_lock(&record_mutex);
+    if (--pending_chunks == 0)
+      pthread_cond_signal(&record_done);
+  }
+  pthread_mutex_unlock(&record_mutex);
+  return NULL;
+}
+
+static void
+start_record_workers(void)
+{
+  int i;
+  stop_recording = 0;
+  record_generation = 0;
+  for (i = 1; i < RECORD_THREADS; i++) {
+    if (pthread_create(&record_workers[i], NULL, run_record_worker, (void *)(intptr_t)i)) {
+      fprintf(stderr, "Failed to create command recording thread.\n");
+      exit(1);
+    }
+  }
+}
+
+static void
+stop_record_workers(void)
+{
+  int i;
+  pthread_mutex_lock(&record_mutex);
+  stop_recording = 1;
+  pthread_cond_broadcast(&record_start);
+  pthread_mutex_unlock(&record_mutex);
+  for (i = 1; i < RECORD_THREADS; i++)
+    pthread_join(record_workers[i], NULL);
+}
+
+/*
+ * Draws what was visible last frame, builds the depth pyramid from it, then
+ * draws what the early pass missed along with the voxel block.
+ */
+static void
+record_command_buffer(VkCommandBuffer command_buffer, int frame, int swap_index,
+    const struct camera_uniform_data *camera, const struct lime_draw *draws,
+    int draw_count, int object_count)
+{
+  VkCommandBufferBeginInfo begin_info;
+  VkMemoryBarrier visibility_barrier;
+  struct record_chunk *chunks;
+  VkCommandBuffer early_secondaries[RECORD_THREADS], late_secondaries[RECORD_THREADS];
+  int i, j, chunk_count, start, first_object;
+  VkResult err;
+
+  chunk_count = draw_count / MIN_DRAWS_PER_THREAD;
+  if (chunk_count > RECORD_THREADS)
+    chunk_count = RECORD_THREADS;
+  if (chunk_count < 1)
+    chunk_count = 1;
+  chunks = record_chunks;
+  first_object = j = 0;
+  for (i = 0; i < chunk_count; i++) {
+    start = (long)draw_count * i / chunk_count;
+    for (; j < start; j++)
+      first_object += draws[j].instance_count;
+    chunks[i].command_buffers[CULL_PHASE_EARLY] =
+      secondary_command_buffers[frame][i][CULL_PHASE_EARLY];
+    chunks[i].command_buffers[CULL_PHASE_LATE] =
+      secondary_command_buffers[frame][i][CULL_PHASE_LATE];
+    chunks[i].frame = frame;
+    chunks[i].swap_index = swap_index;
+    chunks[i].draws = draws + start;
+    chunks[i].first = start;
+    chunks[i].first_object = first_object;
+    chunks[i].draw_count = (long)draw_count * (i + 1) / chunk_count - start;
+    early_secondaries[i] = chunks[i].command_buffers[CULL_PHASE_EARLY];
+    late_secondaries[i] = chunks[i].command_buffers[CULL_PHASE_LATE];
+  }
+  pthread_mutex_lock(&record_mutex);
+  record_chunk_count = chunk_count;
+  pending_chunks = chunk_count - 1;
+  record_generation++;
+  pthread_cond_broadcast(&record_start);
+  pthread_mutex_unlock(&record_mutex);
+  record_draws(&chunks[0]);
+  pthread_mutex_lock(&record_mutex);
+  while (pending_chunks > 0)
+    pthread_cond_wait(&record_done, &record_mutex);
+  pthread_mutex_unlock(&record_mutex);
+
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.pNext = NULL;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  begin_info.pInheritanceInfo = NULL;
+  err = vkBeginCommandBuffer(command_buffer, &begin_info);
+  ASSERT_VK_RESULT(err, "begining command buffer");
+
+  vkCmdResetQueryPool(command_buffer, timestamp_query_pool,
+      TIMESTAMPS_PER_FRAME * frame, TIMESTAMPS_PER_FRAME);
+  /*
+   * The last frame's late cull pass wrote the visibility this frame reads,
+   * and the frame before it last read the visibility this frame writes.
+   */
+  visibility_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  visibility_barrier.pNext = NULL;
+  visibility_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  visibility_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &visibility_barrier, 0, NULL, 0, NULL);
+  /* The recording threads have written this frame's draws by now. */
+  if (draw_count > 0)
+    record_cull_pass(command_buffer, frame, CULL_PHASE_EARLY, draw_count, object_count);
+  /* Bottom of pipe waits for the cull pass, so only the render pass is timed. */
+  vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+      timestamp_query_pool, TIMESTAMPS_PER_FRAME * frame);
+  begin_render_pass(command_buffer, swap_index, CULL_PHASE_EARLY);
+  vkCmdExecuteCommands(command_buffer, chunk_count, early_secondaries);
+  vkCmdEndRenderPass(command_buffer);
+  vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+      timestamp_query_pool, TIMESTAMPS_PER_FRAME * frame + 1);
+
+  lime_record_depth_pyramid(command_buffer);
+  record_cull_pass(command_buffer, frame, CULL_PHASE_LATE, draw_count, object_count);
+  if (lime_voxel_trace.enabled) {
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        timestamp_query_pool, TIMESTAMPS_PER_FRAME * frame + 4);
+    lime_record_voxel_trace(command_buffer, camera);
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        timestamp_query_pool, TIMESTAMPS_PER_FRAME * frame + 5);
+  }
+  vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+      timestamp_query_pool, TIMESTAMPS_PER_FRAME * frame + 2);
+  begin_render_pass(command_buffer, swap_index, CULL_PHASE_LATE);
+  vkCmdExecuteCommands(command_buffer, chunk_count, late_secondaries);
+  vkCmdEndRenderPass(command_buffer);
+  vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+      timestamp_query_pool, TIMESTAMPS_PER_FRAME * frame + 3);
+
+  err = vkEndCommandBuffer(command_buffer);
+  ASSERT_VK_RESULT(err, "recording command buffer");
 }
 
 void
-lime_init_renderer(const struct graphics_vertex_obj *gvo)
+lime_init_renderer(void)
 {
   create_graphics_command_pool();
+  create_record_command_pools();
   allocate_command_buffers();
-  record_command_buffers(gvo);
+  create_timestamp_query_pool();
   create_synchronization_objects();
+  start_record_workers();
+  current_frame = 0;
+  last_object_count = 0;
 }
 
+/*
+ * Waits only for the frame that last used this frame's resources, and for
+ * any earlier frame still rendering to the acquired image, so the CPU can
+ * record up to FRAMES_IN_FLIGHT frames ahead of the GPU.
+ */
 void
-lime_draw_frame(struct camera_uniform_data camera)
+lime_draw_frame(struct camera_uniform_data camera, const struct lime_draw *draws,
+    int draw_count)
 {
   uint32_t swapchain_index;
+  VkSemaphore wait_semaphores[2];
+  VkPipelineStageFlags wait_stages[2];
+  uint64_t wait_values[2];
+  VkTimelineSemaphoreSubmitInfo timeline_info;
   VkSubmitInfo submit_info;
   VkPresentInfoKHR present_info;
+  int i, object_count;
   VkResult err;
 
-  vkWaitForFences(lime_device.device, 1, &frame_finished_fence, VK_TRUE, UINT64_MAX);
-  vkResetFences(lime_device.device, 1, &frame_finished_fence);
+  vkWaitForFences(lime_device.device, 1, &frame_finished_fences[current_frame],
+      VK_TRUE, UINT64_MAX);
+  if (timestamps_written[current_frame]) {
+    read_pass_times(current_frame);
+    count_drawn_triangles(current_frame);
+  }
+  for (i = 0; i < RECORD_THREADS; i++) {
+    err = vkResetCommandPool(lime_device.device, record_command_pools[current_frame][i], 0);
+    ASSERT_VK_RESULT(err, "resetting record command pool");
+  }
+  lime_defragment_vertex_buffers(DEFRAGMENT_BYTES_PER_FRAME);
   err = vkAcquireNextImageKHR(lime_device.device, lime_resources.swapchain,
-      UINT64_MAX, image_available_semaphore, VK_NULL_HANDLE, &swapchain_index);
+      UINT64_MAX, image_available_semaphores[current_frame], VK_NULL_HANDLE,
+      &swapchain_index);
   ASSERT_VK_RESULT(err, "acquiring next swapchain image");
-  set_camera_uniform_data(swapchain_index, camera);
+  if (image_fences[swapchain_index] != VK_NULL_HANDLE)
+    vkWaitForFences(lime_device.device, 1, &image_fences[swapchain_index],
+        VK_TRUE, UINT64_MAX);
+  image_fences[swapchain_index] = frame_finished_fences[current_frame];
+  vkResetFences(lime_device.device, 1, &frame_finished_fences[current_frame]);
+
+  set_camera_uniform_data(current_frame, camera);
+  set_voxel_block_constants(&camera);
+  for (i = object_count = 0; i < draw_count; i++)
+    object_count += draws[i].instance_count;
+  lime_reserve_draw_buffers(current_frame, draw_count, object_count);
+  record_command_buffer(command_buffers[current_frame], current_frame,
+      swapchain_index, &camera, draws, draw_count, object_count);
+
+  /* The frame only waits for uploads submitted before it. */
+  lime_flush_uploads();
+  wait_semaphores[0] = image_available_semaphores[current_frame];
+  wait_stages[0] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  wait_values[0] = 0;
+  wait_semaphores[1] = lime_uploads.semaphore;
+  wait_stages[1] = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT
+    | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  wait_values[1] = lime_uploads.submitted_ticket;
+  timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timeline_info.pNext = NULL;
+  timeline_info.waitSemaphoreValueCount = 2;
+  timeline_info.pWaitSemaphoreValues = wait_values;
+  timeline_info.signalSemaphoreValueCount = 0;
+  timeline_info.pSignalSemaphoreValues = NULL;
   submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submit_info.pNext = NULL;
-  submit_info.waitSemaphoreCount = 1;
-  submit_info.pWaitSemaphores = &image_available_semaphore;
-  submit_info.pWaitDstStageMask = &(VkPipelineStageFlags){VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+  submit_info.pNext = &timeline_info;
+  submit_info.waitSemaphoreCount = 2;
+  submit_info.pWaitSemaphores = wait_semaphores;
+  submit_info.pWaitDstStageMask = wait_stages;
   submit_info.commandBufferCount = 1;
-  submit_info.pCommandBuffers = &command_buffers[swapchain_index];
+  submit_info.pCommandBuffers = &command_buffers[current_frame];
   submit_info.signalSemaphoreCount = 1;
-  submit_info.pSignalSemaphores = &render_finished_semaphore;
-  err = vkQueueSubmit(lime_device.graphics_queue, 1, &submit_info, frame_finished_fence);
+  submit_info.pSignalSemaphores = &render_finished_semaphores[swapchain_index];
+  err = vkQueueSubmit(lime_device.graphics_queue, 1, &submit_info,
+      frame_finished_fences[current_frame]);
   ASSERT_VK_RESULT(err, "submitting command buffer");
+  timestamps_written[current_frame] = 1;
+  frame_draw_counts[current_frame] = draw_count;
+  last_object_count = object_count;
   present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
   present_info.pNext = NULL;
   present_info.waitSemaphoreCount = 1;
-  present_info.pWaitSemaphores = &render_finished_semaphore;
+  present_info.pWaitSemaphores = &render_finished_semaphores[swapchain_index];
   present_info.swapchainCount = 1;
   present_info.pSwapchains = &lime_resources.swapchain;
   present_info.pImageIndices = &swapchain_index;
   present_info.pResults = NULL;
   err = vkQueuePresentKHR(lime_device.graphics_queue, &present_info);
   ASSERT_VK_RESULT(err, "submitting present request");
+  current_frame = (current_frame + 1) % FRAMES_IN_FLIGHT;
+}
+
+/*
+ * GPU time in milliseconds of the early and late render passes, which draw
+ * the triangles and the voxel block, in the last finished frame, or a
+ * negative value before any frame has finished.
+ */
+double
+lime_get_scene_pass_time(void)
+{
+  return scene_pass_time;
+}
+
+/*
+ * Triangles drawn after culling in the last finished frame, or a negative
+ * value before any frame has finished.
+ */
+long
+lime_get_drawn_triangles(void)
+{
+  return drawn_triangles;
+}
+
+/*
+ * GPU time in milliseconds of the compute voxel trace in the last finished
+ * frame, or a negative value if none has been timed.
+ */
+double
+lime_get_voxel_trace_time(void)
+{
+  return voxel_trace_time;
 }
 
 void
 lime_destroy_renderer(void)
 {
-  vkDestroySemaphore(lime_device.device, image_available_semaphore, NULL);
-  vkDestroySemaphore(lime_device.device, render_finished_semaphore, NULL);
-  vkDestroyFence(lime_device.device, frame_finished_fence, NULL);
+  int i, j;
+  stop_record_workers();
+  vkDestroyQueryPool(lime_device.device, timestamp_query_pool, NULL);
+  for (i = 0; i < FRAMES_IN_FLIGHT; i++) {
+    vkDestroySemaphore(lime_device.device, image_available_semaphores[i], NULL);
+    vkDestroyFence(lime_device.device, frame_finished_fences[i], NULL);
+  }
+  for (i = 0; i < lime_resources.swapchain_image_count; i++)
+    vkDestroySemaphore(lime_device.device, render_finished_semaphores[i], NULL);
+  for (i = 0; i < FRAMES_IN_FLIGHT; i++)
+    for (j = 0; j < RECORD_THREADS; j++)
+      vkDestroyCommandPool(lime_device.device, record_command_pools[i][j], NULL);
   vkDestroyCommandPool(lime_device.device, graphics_command_pool, NULL);
 }
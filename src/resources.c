@@ -18,15 +18,21 @@ static void allocate_buffers(void);
 static void create_descriptor_pool(void);
 static void allocate_descriptor_sets(void);
 static void bind_descriptor_sets(void);
+static void create_draw_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+    VkMemoryPropertyFlags properties, VkBuffer *buffer, struct lime_allocation *allocation);
+static void create_draw_buffers(int frame, int draw_capacity, int object_capacity);
+static void bind_draw_buffers(int frame);
+static void destroy_draw_buffers(int frame);
+
+#define INITIAL_DRAW_CAPACITY 64
+#define INITIAL_OBJECT_CAPACITY 64
 
 static VkImage swapchain_images[MAX_SWAPCHAIN_IMAGES];
 static VkImageView swapchain_image_views[MAX_SWAPCHAIN_IMAGES];
-static VkImage depth_image;
-static VkDeviceMemory depth_image_memory;
-static VkImageView depth_image_view;
+static struct lime_allocation depth_image_allocation;
 static int camera_uniform_buffer_step;
 static VkBuffer camera_uniform_buffer;
-static VkDeviceMemory camera_uniform_buffer_memory;
+static struct lime_allocation camera_uniform_buffer_allocation;
 static VkDescriptorPool descriptor_pool;
 
 struct lime_resources lime_resources;
@@ -106,8 +112,6 @@ static void
 create_depth_image(void)
 {
   VkImageCreateInfo create_info;
-  VkMemoryRequirements memory_requirements;
-  VkMemoryAllocateInfo allocate_info;
   VkImageViewCreateInfo view_create_info;
   VkResult err;
 
@@ -123,33 +127,24 @@ create_depth_image(void)
   create_info.arrayLayers = 1;
   create_info.samples = VK_SAMPLE_COUNT_1_BIT;
   create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
-  create_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+  /* Sampled to build the depth pyramid. */
+  create_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
   create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
   create_info.queueFamilyIndexCount = 0;
   create_info.pQueueFamilyIndices = NULL;
   create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 
-  assert(depth_image == VK_NULL_HANDLE);
-  err = vkCreateImage(lime_device.device, &create_info, NULL, &depth_image);
+  assert(lime_resources.depth_image == VK_NULL_HANDLE);
+  err = vkCreateImage(lime_device.device, &create_info, NULL, &lime_resources.depth_image);
   ASSERT_VK_RESULT(err, "creating depth image");
 
-  vkGetImageMemoryRequirements(lime_device.device, depth_image, &memory_requirements);
-  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocate_info.pNext = NULL;
-  allocate_info.allocationSize = memory_requirements.size;
-  allocate_info.memoryTypeIndex = lime_device_find_memory_type(
-      memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-  assert(depth_image_memory == VK_NULL_HANDLE);
-  err = vkAllocateMemory(lime_device.device, &allocate_info, NULL, &depth_image_memory);
-  ASSERT_VK_RESULT(err, "allocating depth image memory");
-  err = vkBindImageMemory(lime_device.device, depth_image, depth_image_memory, 0);
-  ASSERT_VK_RESULT(err, "binding depth image memory");
+  lime_allocate_image_memory(lime_resources.depth_image,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &depth_image_allocation);
 
   view_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
   view_create_info.pNext = NULL;
   view_create_info.flags = 0;
-  view_create_info.image = depth_image;
+  view_create_info.image = lime_resources.depth_image;
   view_create_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
   view_create_info.format = lime_device.depth_format;
   view_create_info.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
@@ -161,8 +156,9 @@ create_depth_image(void)
   view_create_info.subresourceRange.levelCount = 1;
   view_create_info.subresourceRange.baseArrayLayer = 0;
   view_create_info.subresourceRange.layerCount = 1;
-  assert(depth_image_view == VK_NULL_HANDLE);
-  err = vkCreateImageView(lime_device.device, &view_create_info, NULL, &depth_image_view);
+  assert(lime_resources.depth_image_view == VK_NULL_HANDLE);
+  err = vkCreateImageView(lime_device.device, &view_create_info, NULL,
+      &lime_resources.depth_image_view);
   ASSERT_VK_RESULT(err, "creating depth image view");
 }
 
@@ -174,7 +170,7 @@ create_framebuffers(void)
   int i;
   VkResult err;
 
-  attachments[1] = depth_image_view;
+  attachments[1] = lime_resources.depth_image_view;
 
   create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
   create_info.pNext = NULL;
@@ -184,18 +180,14 @@ create_framebuffers(void)
   create_info.width = lime_resources.swapchain_extent.width;
   create_info.height = lime_resources.swapchain_extent.height;
   create_info.layers = 1;
+  /* Also used with the late render pass, which is compatible. */
+  create_info.renderPass = lime_pipelines.render_pass;
   for (i = 0; i < lime_resources.swapchain_image_count; i++) {
     attachments[0] = swapchain_image_views[i];
-    create_info.renderPass = lime_pipelines.render_pass;
     assert(lime_resources.swapchain_framebuffers[i] == VK_NULL_HANDLE);
     err = vkCreateFramebuffer(lime_device.device, &create_info, NULL,
         &lime_resources.swapchain_framebuffers[i]);
     ASSERT_VK_RESULT(err, "creating swapchain framebuffer");
-    create_info.renderPass = lime_pipelines.voxel_block_render_pass;
-    assert(lime_resources.voxel_block_framebuffers[i] == VK_NULL_HANDLE);
-    err = vkCreateFramebuffer(lime_device.device, &create_info, NULL,
-        &lime_resources.voxel_block_framebuffers[i]);
-    ASSERT_VK_RESULT(err, "creating voxel block framebuffer");
   }
 }
 
@@ -203,8 +195,6 @@ static void
 allocate_buffers(void)
 {
   VkBufferCreateInfo create_info;
-  VkMemoryRequirements memory_requirements;
-  VkMemoryAllocateInfo allocate_info;
   VkResult err;
 
   camera_uniform_buffer_step
@@ -225,36 +215,26 @@ allocate_buffers(void)
   err = vkCreateBuffer(lime_device.device, &create_info, NULL, &camera_uniform_buffer);
   ASSERT_VK_RESULT(err, "creating camera uniform buffer");
 
-  vkGetBufferMemoryRequirements(lime_device.device, camera_uniform_buffer,
-      &memory_requirements);
-  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocate_info.pNext = NULL;
-  allocate_info.allocationSize = memory_requirements.size;
-  allocate_info.memoryTypeIndex = lime_device_find_memory_type(
-      memory_requirements.memoryTypeBits,
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-  assert(camera_uniform_buffer_memory == VK_NULL_HANDLE);
-  err = vkAllocateMemory(lime_device.device, &allocate_info, NULL,
-      &camera_uniform_buffer_memory);
-  ASSERT_VK_RESULT(err, "allocating camera uniform buffer memory");
-  err = vkBindBufferMemory(lime_device.device, camera_uniform_buffer,
-      camera_uniform_buffer_memory, 0);
-  ASSERT_VK_RESULT(err, "binding camera uniform buffer memory");
+  lime_allocate_buffer_memory(camera_uniform_buffer,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+      &camera_uniform_buffer_allocation);
 }
 
 static void
 create_descriptor_pool(void)
 {
-  VkDescriptorPoolSize pool_sizes[1];
+  VkDescriptorPoolSize pool_sizes[2];
   VkDescriptorPoolCreateInfo create_info;
   VkResult err;
 
   pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
   pool_sizes[0].descriptorCount = MAX_SWAPCHAIN_IMAGES;
+  pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  pool_sizes[1].descriptorCount = 2 * MAX_SWAPCHAIN_IMAGES + 8 * FRAMES_IN_FLIGHT;
   create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
   create_info.pNext = NULL;
   create_info.flags = 0;
-  create_info.maxSets = MAX_SWAPCHAIN_IMAGES;
+  create_info.maxSets = MAX_SWAPCHAIN_IMAGES + FRAMES_IN_FLIGHT;
   create_info.poolSizeCount = sizeof(pool_sizes) / sizeof(pool_sizes[0]);
   create_info.pPoolSizes = pool_sizes;
   err = vkCreateDescriptorPool(lime_device.device, &create_info, NULL, &descriptor_pool);
@@ -279,6 +259,13 @@ allocate_descriptor_sets(void)
   err = vkAllocateDescriptorSets(lime_device.device, &allocate_info,
       lime_resources.camera_descriptor_sets);
   ASSERT_VK_RESULT(err, "allocating descriptor sets");
+  allocate_info.descriptorSetCount = 1;
+  allocate_info.pSetLayouts = &lime_pipelines.cull_descriptor_set_layout;
+  for (i = 0; i < FRAMES_IN_FLIGHT; i++) {
+    err = vkAllocateDescriptorSets(lime_device.device, &allocate_info,
+        &lime_resources.draw_buffers[i].cull_descriptor_set);
+    ASSERT_VK_RESULT(err, "allocating cull descriptor set");
+  }
 }
 
 static void
@@ -303,48 +290,213 @@ bind_descriptor_sets(void)
     write.dstSet = lime_resources.camera_descriptor_sets[i];
     vkUpdateDescriptorSets(lime_device.device, 1, &write, 0, NULL);
   }
+  for (i = 0; i < FRAMES_IN_FLIGHT; i++)
+    bind_draw_buffers(i);
+}
+
+static void
+create_draw_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+    VkMemoryPropertyFlags properties, VkBuffer *buffer, struct lime_allocation *allocation)
+{
+  VkBufferCreateInfo create_info;
+  VkResult err;
+  create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  create_info.pNext = NULL;
+  create_info.flags = 0;
+  create_info.size = size;
+  create_info.usage = usage;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.queueFamilyIndexCount = 0;
+  create_info.pQueueFamilyIndices = NULL;
+  assert(*buffer == VK_NULL_HANDLE);
+  err = vkCreateBuffer(lime_device.device, &create_info, NULL, buffer);
+  ASSERT_VK_RESULT(err, "creating draw buffer");
+  lime_allocate_buffer_memory(*buffer, properties, allocation);
+}
+
+static void
+create_draw_buffers(int frame, int draw_capacity, int object_capacity)
+{
+  struct lime_draw_buffers *buffers;
+  VkMemoryPropertyFlags host_properties;
+
+  buffers = &lime_resources.draw_buffers[frame];
+  host_properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  create_draw_buffer(draw_capacity * sizeof(struct cull_draw),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, host_properties,
+      &buffers->draw_buffer, &buffers->draw_allocation);
+  create_draw_buffer(object_capacity * sizeof(struct object_data),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, host_properties,
+      &buffers->object_buffer, &buffers->object_allocation);
+  create_draw_buffer(2 * draw_capacity * sizeof(uint32_t),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+      host_properties, &buffers->count_buffer, &buffers->count_allocation);
+  create_draw_buffer(2 * draw_capacity * sizeof(VkDrawIndexedIndirectCommand),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+      &buffers->indirect_buffer, &buffers->indirect_allocation);
+  create_draw_buffer(2 * draw_capacity * sizeof(uint32_t),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, host_properties,
+      &buffers->instance_count_buffer, &buffers->instance_count_allocation);
+  create_draw_buffer(2 * object_capacity * sizeof(uint32_t),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+      &buffers->instance_buffer, &buffers->instance_allocation);
+  create_draw_buffer(object_capacity * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+      &buffers->visibility_buffer, &buffers->visibility_allocation);
+  create_draw_buffer(sizeof(VkDrawIndirectCommand),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &buffers->voxel_block_indirect_buffer,
+      &buffers->voxel_block_indirect_allocation);
+  buffers->draws = buffers->draw_allocation.mapped;
+  buffers->objects = buffers->object_allocation.mapped;
+  buffers->counts = buffers->count_allocation.mapped;
+  buffers->instance_counts = buffers->instance_count_allocation.mapped;
+  buffers->draw_capacity = draw_capacity;
+  buffers->object_capacity = object_capacity;
+}
+
+/* The cull shader reads the visibility written by the frame before. */
+static void
+bind_draw_buffers(int frame)
+{
+  struct lime_draw_buffers *buffers, *last_buffers;
+  VkDescriptorBufferInfo buffer_infos[10];
+  VkWriteDescriptorSet writes[2];
+  int i;
+
+  buffers = &lime_resources.draw_buffers[frame];
+  last_buffers = &lime_resources.draw_buffers[(frame + FRAMES_IN_FLIGHT - 1)
+    % FRAMES_IN_FLIGHT];
+  buffer_infos[0].buffer = buffers->object_buffer;
+  buffer_infos[1].buffer = buffers->instance_buffer;
+  buffer_infos[2].buffer = buffers->draw_buffer;
+  buffer_infos[3].buffer = buffers->indirect_buffer;
+  buffer_infos[4].buffer = buffers->count_buffer;
+  buffer_infos[5].buffer = buffers->visibility_buffer;
+  buffer_infos[6].buffer = last_buffers->visibility_buffer;
+  buffer_infos[7].buffer = buffers->voxel_block_indirect_buffer;
+  buffer_infos[8].buffer = buffers->instance_count_buffer;
+  buffer_infos[9].buffer = buffers->instance_buffer;
+  for (i = 0; i < 10; i++) {
+    buffer_infos[i].offset = 0;
+    buffer_infos[i].range = VK_WHOLE_SIZE;
+  }
+  for (i = 0; i < 2; i++) {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].pNext = NULL;
+    writes[i].dstArrayElement = 0;
+    writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[i].pImageInfo = NULL;
+    writes[i].pTexelBufferView = NULL;
+  }
+  writes[0].dstSet = lime_resources.camera_descriptor_sets[frame];
+  writes[0].dstBinding = 1;
+  writes[0].descriptorCount = 2;
+  writes[0].pBufferInfo = &buffer_infos[0];
+  writes[1].dstSet = buffers->cull_descriptor_set;
+  writes[1].dstBinding = 0;
+  writes[1].descriptorCount = 8;
+  writes[1].pBufferInfo = &buffer_infos[2];
+  vkUpdateDescriptorSets(lime_device.device, 2, writes, 0, NULL);
+}
+
+static void
+destroy_draw_buffers(int frame)
+{
+  struct lime_draw_buffers *buffers;
+  buffers = &lime_resources.draw_buffers[frame];
+  vkDestroyBuffer(lime_device.device, buffers->draw_buffer, NULL);
+  lime_free_memory(&buffers->draw_allocation);
+  vkDestroyBuffer(lime_device.device, buffers->object_buffer, NULL);
+  lime_free_memory(&buffers->object_allocation);
+  vkDestroyBuffer(lime_device.device, buffers->count_buffer, NULL);
+  lime_free_memory(&buffers->count_allocation);
+  vkDestroyBuffer(lime_device.device, buffers->indirect_buffer, NULL);
+  lime_free_memory(&buffers->indirect_allocation);
+  vkDestroyBuffer(lime_device.device, buffers->instance_count_buffer, NULL);
+  lime_free_memory(&buffers->instance_count_allocation);
+  vkDestroyBuffer(lime_device.device, buffers->instance_buffer, NULL);
+  lime_free_memory(&buffers->instance_allocation);
+  vkDestroyBuffer(lime_device.device, buffers->visibility_buffer, NULL);
+  lime_free_memory(&buffers->visibility_allocation);
+  vkDestroyBuffer(lime_device.device, buffers->voxel_block_indirect_buffer, NULL);
+  lime_free_memory(&buffers->voxel_block_indirect_allocation);
+  buffers->draw_buffer = buffers->object_buffer = VK_NULL_HANDLE;
+  buffers->count_buffer = buffers->indirect_buffer = VK_NULL_HANDLE;
+  buffers->instance_count_buffer = buffers->instance_buffer = VK_NULL_HANDLE;
+  buffers->visibility_buffer = buffers->voxel_block_indirect_buffer = VK_NULL_HANDLE;
 }
 
 void
 lime_init_resources(void)
 {
   VkSurfaceCapabilitiesKHR surface_capabilities;
+  int i;
   surface_capabilities = lime_get_current_surface_capabilities();
   create_swapchain(surface_capabilities);
   create_depth_image();
   create_framebuffers();
   allocate_buffers();
+  for (i = 0; i < FRAMES_IN_FLIGHT; i++)
+    create_draw_buffers(i, INITIAL_DRAW_CAPACITY, INITIAL_OBJECT_CAPACITY);
   create_descriptor_pool();
   allocate_descriptor_sets();
   bind_descriptor_sets();
 }
 
 void
-set_camera_uniform_data(int swap_index, struct camera_uniform_data data)
+set_camera_uniform_data(int frame, struct camera_uniform_data data)
 {
   struct camera_uniform_data *mapped;
-  VkResult err;
-  err = vkMapMemory(lime_device.device, camera_uniform_buffer_memory,
-      swap_index * camera_uniform_buffer_step, sizeof(struct camera_uniform_data),
-      0, (void **)&mapped);
-  ASSERT_VK_RESULT(err, "mapping camera uniform buffer data");
+  mapped = (struct camera_uniform_data *)((char *)camera_uniform_buffer_allocation.mapped
+      + frame * camera_uniform_buffer_step);
   *mapped = data;
-  vkUnmapMemory(lime_device.device, camera_uniform_buffer_memory);
+}
+
+/*
+ * Grows the frame's draw buffers to hold draw_count draws of object_count
+ * instances in total. The next frame in flight reads this frame's
+ * visibility, so growing waits for the queue to go idle before replacing
+ * them.
+ */
+void
+lime_reserve_draw_buffers(int frame, int draw_count, int object_count)
+{
+  struct lime_draw_buffers *buffers;
+  int draw_capacity, object_capacity, i;
+  VkResult err;
+  buffers = &lime_resources.draw_buffers[frame];
+  draw_capacity = buffers->draw_capacity;
+  object_capacity = buffers->object_capacity;
+  if (draw_count <= draw_capacity && object_count <= object_capacity)
+    return;
+  while (draw_capacity < draw_count)
+    draw_capacity *= 2;
+  while (object_capacity < object_count)
+    object_capacity *= 2;
+  err = vkQueueWaitIdle(lime_device.graphics_queue);
+  ASSERT_VK_RESULT(err, "waiting for graphics queue");
+  destroy_draw_buffers(frame);
+  create_draw_buffers(frame, draw_capacity, object_capacity);
+  for (i = 0; i < FRAMES_IN_FLIGHT; i++)
+    bind_draw_buffers(i);
 }
 
 void
 lime_destroy_resources(void)
 {
   int i;
+  for (i = 0; i < FRAMES_IN_FLIGHT; i++)
+    destroy_draw_buffers(i);
   vkDestroyDescriptorPool(lime_device.device, descriptor_pool, NULL);
   vkDestroyBuffer(lime_device.device, camera_uniform_buffer, NULL);
-  vkFreeMemory(lime_device.device, camera_uniform_buffer_memory, NULL);
-  vkDestroyImageView(lime_device.device, depth_image_view, NULL);
-  vkDestroyImage(lime_device.device, depth_image, NULL);
-  vkFreeMemory(lime_device.device, depth_image_memory, NULL);
+  lime_free_memory(&camera_uniform_buffer_allocation);
+  vkDestroyImageView(lime_device.device, lime_resources.depth_image_view, NULL);
+  vkDestroyImage(lime_device.device, lime_resources.depth_image, NULL);
+  lime_free_memory(&depth_image_allocation);
   for (i = 0; i < lime_resources.swapchain_image_count; i++) {
     vkDestroyFramebuffer(lime_device.device, lime_resources.swapchain_framebuffers[i], NULL);
-    vkDestroyFramebuffer(lime_device.device, lime_resources.voxel_block_framebuffers[i], NULL);
     vkDestroyImageView(lime_device.device, swapchain_image_views[i], NULL);
   }
   vkDestroySwapchainKHR(lime_device.device, lime_resources.swapchain, NULL);
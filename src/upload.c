@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <vulkan/vulkan.h>
+#include <GLFW/glfw3.h>
+#include "matrix.h"
+#include "obj_types.h"
+#include "block_allocation.h"
+#include "lime.h"
+
+#define MAX_UPLOAD_BATCHES 4
+#define STAGING_RING_SIZE (16l << 20)
+/* Half the ring, so one chunk can be filled while the last is copied. */
+#define MAX_UPLOAD_CHUNK (STAGING_RING_SIZE / 2)
+#define STAGING_ALIGNMENT 16
+
+/*
+ * Uploads are recorded into the current batch until it is flushed. Each
+ * batch signals its ticket on the timeline semaphore when its copies are
+ * done, which releases its part of the staging ring.
+ */
+struct upload_batch {
+  VkCommandBuffer command_buffer;
+  uint64_t ticket;
+  long ring_end;
+};
+
+static void create_upload_command_pool(void);
+static void create_upload_semaphore(void);
+static void create_staging_ring(void);
+static void retire_oldest_batch(void);
+static struct upload_batch *current_batch(void);
+static long reserve_staging(long size);
+static uint64_t upload_image(VkImage image, VkImageLayout old_layout, VkOffset3D offset,
+    VkExtent3D extent, VkImageLayout layout, const void *data, VkDeviceSize size);
+
+static VkCommandPool upload_command_pool;
+static VkBuffer staging_buffer;
+static struct lime_allocation staging_allocation;
+static long ring_head, ring_tail;
+/* Submitted batches in submission order, followed by the recording one. */
+static struct upload_batch batches[MAX_UPLOAD_BATCHES];
+static int oldest_batch, submitted_batch_count, recording;
+static uint64_t next_ticket;
+
+struct lime_uploads lime_uploads;
+
+static void
+create_upload_command_pool(void)
+{
+  VkCommandPoolCreateInfo create_info;
+  VkCommandBufferAllocateInfo allocate_info;
+  VkCommandBuffer command_buffers[MAX_UPLOAD_BATCHES];
+  int i;
+  VkResult err;
+
+  create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  create_info.pNext = NULL;
+  create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT
+    | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  create_info.queueFamilyIndex = lime_device.transfer_family_index;
+  assert(upload_command_pool == VK_NULL_HANDLE);
+  err = vkCreateCommandPool(lime_device.device, &create_info, NULL, &upload_command_pool);
+  ASSERT_VK_RESULT(err, "creating upload command pool");
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.pNext = NULL;
+  allocate_info.commandPool = upload_command_pool;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = MAX_UPLOAD_BATCHES;
+  err = vkAllocateCommandBuffers(lime_device.device, &allocate_info, command_buffers);
+  ASSERT_VK_RESULT(err, "allocating upload command buffers");
+  for (i = 0; i < MAX_UPLOAD_BATCHES; i++)
+    batches[i].command_buffer = command_buffers[i];
+}
+
+static void
+create_upload_semaphore(void)
+{
+  VkSemaphoreTypeCreateInfo type_create_info;
+  VkSemaphoreCreateInfo create_info;
+  VkResult err;
+
+  type_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  type_create_info.pNext = NULL;
+  type_create_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  type_create_info.initialValue = 0;
+  create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  create_info.pNext = &type_create_info;
+  create_info.flags = 0;
+  assert(lime_uploads.semaphore == VK_NULL_HANDLE);
+  err = vkCreateSemaphore(lime_device.device, &create_info, NULL, &lime_uploads.semaphore);
+  ASSERT_VK_RESULT(err, "creating upload timeline semaphore");
+}
+
+static void
+create_staging_ring(void)
+{
+  VkBufferCreateInfo create_info;
+  VkResult err;
+
+  create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  create_info.pNext = NULL;
+  create_info.flags = 0;
+  create_info.size = STAGING_RING_SIZE;
+  create_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.queueFamilyIndexCount = 0;
+  create_info.pQueueFamilyIndices = NULL;
+  assert(staging_buffer == VK_NULL_HANDLE);
+  err = vkCreateBuffer(lime_device.device, &create_info, NULL, &staging_buffer);
+  ASSERT_VK_RESULT(err, "creating upload staging buffer");
+
+  lime_allocate_buffer_memory(staging_buffer,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+      &staging_allocation);
+  ring_head = ring_tail = 0;
+}
+
+static void
+retire_oldest_batch(void)
+{
+  assert(submitted_batch_count > 0);
+  lime_wait_for_upload(batches[oldest_batch].ticket);
+  ring_tail = batches[oldest_batch].ring_end;
+  oldest_batch = (oldest_batch + 1) % MAX_UPLOAD_BATCHES;
+  submitted_batch_count--;
+}
+
+/* Begins a new batch if none is being recorded. */
+static struct upload_batch *
+current_batch(void)
+{
+  struct upload_batch *batch;
+  VkCommandBufferBeginInfo begin_info;
+  VkResult err;
+
+  if (!recording) {
+    if (submitted_batch_count == MAX_UPLOAD_BATCHES)
+      retire_oldest_batch();
+    batch = &batches[(oldest_batch + submitted_batch_count) % MAX_UPLOAD_BATCHES];
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.pNext = NULL;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    begin_info.pInheritanceInfo = NULL;
+    err = vkBeginCommandBuffer(batch->command_buffer, &begin_info);
+    ASSERT_VK_RESULT(err, "begining upload command buffer");
+    batch->ticket = next_ticket++;
+    recording = 1;
+  }
+  return &batches[(oldest_batch + submitted_batch_count) % MAX_UPLOAD_BATCHES];
+}
+
+/*
+ * ring_head and ring_tail only grow until the ring drains, the bytes between
+ * them belong to batches that are recording or in flight. A range that would
+ * straddle the end of the ring starts again at its beginning. When the ring
+ * is full the recording batch is flushed and the oldest batch waited for.
+ */
+static long
+reserve_staging(long size)
+{
+  long position, needed;
+
+  size = (size + STAGING_ALIGNMENT - 1) & ~(long)(STAGING_ALIGNMENT - 1);
+  assert(size <= STAGING_RING_SIZE);
+  for (;;) {
+    if (submitted_batch_count == 0 && !recording)
+      ring_head = ring_tail = 0;
+    position = ring_head % STAGING_RING_SIZE;
+    needed = position + size > STAGING_RING_SIZE
+      ? STAGING_RING_SIZE - position + size : size;
+    if (ring_head - ring_tail + needed <= STAGING_RING_SIZE)
+      break;
+    if (submitted_batch_count > 0)
+      retire_oldest_batch();
+    else
+      lime_flush_uploads();
+  }
+  ring_head += needed - size;
+  position = ring_head % STAGING_RING_SIZE;
+  ring_head += size;
+  return position;
+}
+
+void
+lime_init_uploads(void)
+{
+  create_upload_command_pool();
+  create_upload_semaphore();
+  create_staging_ring();
+  oldest_batch = submitted_batch_count = recording = 0;
+  next_ticket = 1;
+  lime_uploads.submitted_ticket = 0;
+}
+
+/*
+ * Data written to buffers is made visible to later graphics submissions by
+ * the timeline semaphore wait, not by a barrier here, since the transfer
+ * queue may not support the stages that read it. Returns the ticket of the
+ * last chunk's batch.
+ */
+uint64_t
+lime_upload_buffer(VkBuffer buffer, VkDeviceSize offset, const void *data,
+    VkDeviceSize size)
+{
+  struct upload_batch *batch;
+  VkBufferCopy region;
+
+  batch = NULL;
+  while (size > 0) {
+    region.size = size < MAX_UPLOAD_CHUNK ? size : MAX_UPLOAD_CHUNK;
+    region.srcOffset = reserve_staging(region.size);
+    region.dstOffset = offset;
+    memcpy((char *)staging_allocation.mapped + region.srcOffset, data, region.size);
+    batch = current_batch();
+    vkCmdCopyBuffer(batch->command_buffer, staging_buffer, buffer, 1, &region);
+    offset += region.size;
+    data = (const char *)data + region.size;
+    size -= region.size;
+  }
+  return batch ? batch->ticket : lime_uploads.submitted_ticket;
+}
+
+/*
+ * Fills a box of a single mip, single layer colour image from tightly packed
+ * data. Boxes larger than a chunk are copied a few slices, or a few rows of
+ * one slice, at a time. Texels outside the box keep their contents unless
+ * old_layout is undefined. An image staying in the general layout is copied
+ * in place, otherwise the whole image is transitioned for the copy.
+ */
+static uint64_t
+upload_image(VkImage image, VkImageLayout old_layout, VkOffset3D offset,
+    VkExtent3D extent, VkImageLayout layout, const void *data, VkDeviceSize size)
+{
+  struct upload_batch *batch;
+  VkImageMemoryBarrier barrier;
+  VkBufferImageCopy region;
+  VkImageLayout copy_layout;
+  VkDeviceSize row_size, slice_size, chunk_size;
+  uint32_t rows, slices, y, z;
+
+  row_size = size / (extent.height * extent.depth);
+  slice_size = row_size * extent.height;
+  assert(row_size <= MAX_UPLOAD_CHUNK);
+  rows = slice_size <= MAX_UPLOAD_CHUNK ? extent.height : MAX_UPLOAD_CHUNK / row_size;
+  slices = rows == extent.height ? MAX_UPLOAD_CHUNK / slice_size : 1;
+  copy_layout = old_layout == VK_IMAGE_LAYOUT_GENERAL && layout == VK_IMAGE_LAYOUT_GENERAL
+    ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.pNext = NULL;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.oldLayout = old_layout;
+  barrier.newLayout = copy_layout;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image;
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.baseMipLevel = 0;
+  barrier.subresourceRange.levelCount = 1;
+  barrier.subresourceRange.baseArrayLayer = 0;
+  barrier.subresourceRange.layerCount = 1;
+  if (copy_layout != old_layout)
+    vkCmdPipelineBarrier(current_batch()->command_buffer,
+        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0, 0, NULL, 0, NULL, 1, &barrier);
+
+  region.bufferRowLength = 0;
+  region.bufferImageHeight = 0;
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.mipLevel = 0;
+  region.imageSubresource.baseArrayLayer = 0;
+  region.imageSubresource.layerCount = 1;
+  region.imageOffset.x = offset.x;
+  region.imageExtent.width = extent.width;
+  for (z = 0; z < extent.depth; z += slices) {
+    for (y = 0; y < extent.height; y += rows) {
+      region.imageOffset.y = offset.y + y;
+      region.imageOffset.z = offset.z + z;
+      region.imageExtent.height = y + rows < extent.height ? rows : extent.height - y;
+      region.imageExtent.depth = z + slices < extent.depth ? slices : extent.depth - z;
+      chunk_size = row_size * region.imageExtent.height * region.imageExtent.depth;
+      region.bufferOffset = reserve_staging(chunk_size);
+      memcpy((char *)staging_allocation.mapped + region.bufferOffset,
+          (const char *)data + z * slice_size + y * row_size, chunk_size);
+      vkCmdCopyBufferToImage(current_batch()->command_buffer, staging_buffer, image,
+          copy_layout, 1, &region);
+    }
+  }
+
+  batch = current_batch();
+  if (copy_layout == layout)
+    return batch->ticket;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = 0;
+  barrier.oldLayout = copy_layout;
+  barrier.newLayout = layout;
+  vkCmdPipelineBarrier(batch->command_buffer,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+      0, 0, NULL, 0, NULL, 1, &barrier);
+  return batch->ticket;
+}
+
+/* Fills the whole of a single mip, single layer colour image. */
+uint64_t
+lime_upload_image(VkImage image, VkExtent3D extent, VkImageLayout layout,
+    const void *data, VkDeviceSize size)
+{
+  return upload_image(image, VK_IMAGE_LAYOUT_UNDEFINED, (VkOffset3D){0, 0, 0}, extent,
+      layout, data, size);
+}
+
+/*
+ * Fills a box of an image already in layout, which it is left in. The box
+ * must be aligned with lime_align_image_box. The caller must make sure no
+ * submitted work still reads the box, or the whole image unless the layout
+ * is general.
+ */
+uint64_t
+lime_upload_image_region(VkImage image, VkOffset3D offset, VkExtent3D extent,
+    VkImageLayout layout, const void *data, VkDeviceSize size)
+{
+  return upload_image(image, layout, offset, extent, layout, data, size);
+}
+
+/*
+ * Grows the box from low to high, exclusive, of an image of the given
+ * extent to the transfer family's image transfer granularity. A granularity
+ * of zero only allows whole images.
+ */
+void
+lime_align_image_box(VkExtent3D extent, int low[3], int high[3])
+{
+  int granularity[3], size[3];
+  int i;
+
+  granularity[0] = lime_device.transfer_granularity.width;
+  granularity[1] = lime_device.transfer_granularity.height;
+  granularity[2] = lime_device.transfer_granularity.depth;
+  size[0] = extent.width;
+  size[1] = extent.height;
+  size[2] = extent.depth;
+  for (i = 0; i < 3; i++) {
+    if (granularity[i] == 0) {
+      low[i] = 0;
+      high[i] = size[i];
+      continue;
+    }
+    low[i] -= low[i] % granularity[i];
+    high[i] = (high[i] + granularity[i] - 1) / granularity[i] * granularity[i];
+    if (high[i] > size[i])
+      high[i] = size[i];
+  }
+}
+
+/* Submits the recording batch, if there is one. */
+void
+lime_flush_uploads(void)
+{
+  struct upload_batch *batch;
+  VkTimelineSemaphoreSubmitInfo timeline_info;
+  VkSubmitInfo submit_info;
+  VkResult err;
+
+  if (!recording)
+    return;
+  batch = current_batch();
+  err = vkEndCommandBuffer(batch->command_buffer);
+  ASSERT_VK_RESULT(err, "recording upload command buffer");
+
+  timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timeline_info.pNext = NULL;
+  timeline_info.waitSemaphoreValueCount = 0;
+  timeline_info.pWaitSemaphoreValues = NULL;
+  timeline_info.signalSemaphoreValueCount = 1;
+  timeline_info.pSignalSemaphoreValues = &batch->ticket;
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.pNext = &timeline_info;
+  submit_info.waitSemaphoreCount = 0;
+  submit_info.pWaitSemaphores = NULL;
+  submit_info.pWaitDstStageMask = NULL;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &batch->command_buffer;
+  submit_info.signalSemaphoreCount = 1;
+  submit_info.pSignalSemaphores = &lime_uploads.semaphore;
+  err = vkQueueSubmit(lime_device.transfer_queue, 1, &submit_info, VK_NULL_HANDLE);
+  ASSERT_VK_RESULT(err, "submitting upload command buffer");
+
+  batch->ring_end = ring_head;
+  recording = 0;
+  submitted_batch_count++;
+  lime_uploads.submitted_ticket = batch->ticket;
+}
+
+/* Flushes the ticket's batch first if it has not been submitted yet. */
+void
+lime_wait_for_upload(uint64_t ticket)
+{
+  VkSemaphoreWaitInfo wait_info;
+  VkResult err;
+
+  if (ticket > lime_uploads.submitted_ticket)
+    lime_flush_uploads();
+  wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+  wait_info.pNext = NULL;
+  wait_info.flags = 0;
+  wait_info.semaphoreCount = 1;
+  wait_info.pSemaphores = &lime_uploads.semaphore;
+  wait_info.pValues = &ticket;
+  err = vkWaitSemaphores(lime_device.device, &wait_info, UINT64_MAX);
+  ASSERT_VK_RESULT(err, "waiting for upload");
+}
+
+/* A batch still being recorded is dropped, its targets may be gone. */
+void
+lime_destroy_uploads(void)
+{
+  lime_wait_for_upload(lime_uploads.submitted_ticket);
+  vkDestroyBuffer(lime_device.device, staging_buffer, NULL);
+  lime_free_memory(&staging_allocation);
+  vkDestroySemaphore(lime_device.device, lime_uploads.semaphore, NULL);
+  vkDestroyCommandPool(lime_device.device, upload_command_pool, NULL);
+}
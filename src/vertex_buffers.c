@@ -9,11 +9,55 @@
 #include "obj_types.h"
 #include "block_allocation.h"
 #include "lime.h"
+#include "obj.h"
+#include "utils.h"
 
-static VkDeviceMemory vertex_buffer_memory;
-static VkDeviceMemory index_buffer_memory;
+/*
+ * A multiple of both vertex sizes, so indirect draws can address any range
+ * with a vertexOffset into the buffer bound at offset 0.
+ */
+#define VERTEX_ALIGNMENT 32
+#define INDEX_ALIGNMENT 4
+#define MAX_DEFRAGMENT_MOVES 64
+#define DEFRAGMENT_THRESHOLD 0.1f
 
-static void allocate_vertex_buffers(long vertex_count, long index_count);
+/* A live range being copied to a lower offset of the same buffer. */
+struct vertex_buffer_move {
+  struct graphics_vertex_obj *gvo;
+  int index_range;
+  long old_offset, new_offset, size;
+};
+
+static struct lime_allocation vertex_buffer_allocation;
+static struct lime_allocation index_buffer_allocation;
+static struct graphics_vertex_obj **objects;
+static int object_count, object_capacity;
+static VkCommandPool defragment_command_pool;
+static VkCommandBuffer defragment_command_buffer;
+static VkFence defragment_fence;
+static struct vertex_buffer_move moves[MAX_DEFRAGMENT_MOVES];
+static int move_count;
+/*
+ * Ranges moved away from, kept allocated until frames recorded with the old
+ * offsets have finished. Each slot is freed FRAMES_IN_FLIGHT calls to
+ * lime_defragment_vertex_buffers after it was filled.
+ */
+static struct vertex_buffer_move retired_moves[FRAMES_IN_FLIGHT][2 * MAX_DEFRAGMENT_MOVES];
+static int retired_move_counts[FRAMES_IN_FLIGHT];
+static int retire_slot;
+
+static void allocate_vertex_buffers(long vertex_memory, long index_memory);
+static void create_defragment_objects(void);
+static void write_range(VkBuffer buffer, const struct lime_allocation *allocation,
+    long offset, const void *data, long size);
+static long vertex_range_size(const struct graphics_vertex_obj *gvo);
+static long index_range_size(const struct graphics_vertex_obj *gvo);
+static int compare_moves(const void *a, const void *b);
+static void plan_moves(struct block_allocation_table *table, int index_range,
+    long *byte_budget);
+static void submit_moves(void);
+static void finish_moves(void);
+static void free_retired_ranges(int slot);
 
 struct lime_vertex_buffers lime_vertex_buffers;
 
@@ -21,18 +65,17 @@ static void
 allocate_vertex_buffers(long vertex_memory, long index_memory)
 {
   VkBufferCreateInfo create_info;
-  VkMemoryRequirements memory_requirements;
-  VkMemoryAllocateInfo allocate_info;
+  VkMemoryPropertyFlags properties;
   VkResult err;
 
   create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
   create_info.pNext = NULL;
   create_info.flags = 0;
   create_info.size = vertex_memory;
-  create_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  create_info.queueFamilyIndexCount = 0;
-  create_info.pQueueFamilyIndices = NULL;
+  create_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT
+    | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  lime_device_upload_sharing(&create_info.sharingMode,
+      &create_info.queueFamilyIndexCount, &create_info.pQueueFamilyIndices);
   assert(lime_vertex_buffers.vertex_buffer == VK_NULL_HANDLE);
   err = vkCreateBuffer(lime_device.device, &create_info, NULL, &lime_vertex_buffers.vertex_buffer);
   ASSERT_VK_RESULT(err, "creating vertex buffer");
@@ -40,65 +83,279 @@ allocate_vertex_buffers(long vertex_memory, long index_memory)
   create_info.pNext = NULL;
   create_info.flags = 0;
   create_info.size = index_memory;
-  create_info.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
-  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  create_info.queueFamilyIndexCount = 0;
-  create_info.pQueueFamilyIndices = NULL;
+  create_info.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT
+    | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  lime_device_upload_sharing(&create_info.sharingMode,
+      &create_info.queueFamilyIndexCount, &create_info.pQueueFamilyIndices);
   assert(lime_vertex_buffers.index_buffer == VK_NULL_HANDLE);
   err = vkCreateBuffer(lime_device.device, &create_info, NULL, &lime_vertex_buffers.index_buffer);
   ASSERT_VK_RESULT(err, "creating vertex index buffer");
 
-  vkGetBufferMemoryRequirements(lime_device.device, lime_vertex_buffers.vertex_buffer,
-      &memory_requirements);
-  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocate_info.pNext = NULL;
-  allocate_info.allocationSize = memory_requirements.size;
-  allocate_info.memoryTypeIndex = lime_device_find_memory_type(
-      memory_requirements.memoryTypeBits,
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-  assert(vertex_buffer_memory == VK_NULL_HANDLE);
-  err = vkAllocateMemory(lime_device.device, &allocate_info, NULL,
-      &vertex_buffer_memory);
-  ASSERT_VK_RESULT(err, "allocating vertex buffer memory");
-  err = vkBindBufferMemory(lime_device.device, lime_vertex_buffers.vertex_buffer,
-      vertex_buffer_memory, 0);
-  ASSERT_VK_RESULT(err, "binding vertex buffer memory");
-
-  vkGetBufferMemoryRequirements(lime_device.device, lime_vertex_buffers.index_buffer,
-      &memory_requirements);
-  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  if (lime_vertex_buffers.placement == VERTEX_BUFFERS_DEVICE_LOCAL)
+    properties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+  else
+    properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  lime_allocate_buffer_memory(lime_vertex_buffers.vertex_buffer, properties,
+      &vertex_buffer_allocation);
+  lime_allocate_buffer_memory(lime_vertex_buffers.index_buffer, properties,
+      &index_buffer_allocation);
+}
+
+static void
+create_defragment_objects(void)
+{
+  VkCommandPoolCreateInfo pool_create_info;
+  VkCommandBufferAllocateInfo allocate_info;
+  VkFenceCreateInfo fence_create_info;
+  VkResult err;
+
+  pool_create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_create_info.pNext = NULL;
+  pool_create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  pool_create_info.queueFamilyIndex = lime_device.graphics_family_index;
+  assert(defragment_command_pool == VK_NULL_HANDLE);
+  err = vkCreateCommandPool(lime_device.device, &pool_create_info, NULL,
+      &defragment_command_pool);
+  ASSERT_VK_RESULT(err, "creating defragment command pool");
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
   allocate_info.pNext = NULL;
-  allocate_info.allocationSize = memory_requirements.size;
-  allocate_info.memoryTypeIndex = lime_device_find_memory_type(
-      memory_requirements.memoryTypeBits,
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-  assert(index_buffer_memory == VK_NULL_HANDLE);
-  err = vkAllocateMemory(lime_device.device, &allocate_info, NULL, &index_buffer_memory);
-  ASSERT_VK_RESULT(err, "allocating vertex index buffer memory");
-  err = vkBindBufferMemory(lime_device.device, lime_vertex_buffers.index_buffer,
-      index_buffer_memory, 0);
-  ASSERT_VK_RESULT(err, "binding vertex index buffer memory");
+  allocate_info.commandPool = defragment_command_pool;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = 1;
+  err = vkAllocateCommandBuffers(lime_device.device, &allocate_info,
+      &defragment_command_buffer);
+  ASSERT_VK_RESULT(err, "allocating defragment command buffer");
+
+  fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  fence_create_info.pNext = NULL;
+  fence_create_info.flags = 0;
+  assert(defragment_fence == VK_NULL_HANDLE);
+  err = vkCreateFence(lime_device.device, &fence_create_info, NULL, &defragment_fence);
+  ASSERT_VK_RESULT(err, "creating defragment fence");
+}
+
+/* Device local memory that happens to be host coherent is written directly. */
+static void
+write_range(VkBuffer buffer, const struct lime_allocation *allocation,
+    long offset, const void *data, long size)
+{
+  if (allocation->mapped)
+    memcpy((char *)allocation->mapped + offset, data, size);
+  else
+    lime_upload_buffer(buffer, offset, data, size);
+}
+
+static long
+vertex_range_size(const struct graphics_vertex_obj *gvo)
+{
+  return gvo->vertex_count * (gvo->format == VERTEX_FORMAT_PACKED
+      ? sizeof(struct packed_vertex) : sizeof(struct vertex));
+}
+
+static long
+index_range_size(const struct graphics_vertex_obj *gvo)
+{
+  return gvo->index_count * gvo->index_size;
+}
+
+static int
+compare_moves(const void *a, const void *b)
+{
+  const struct vertex_buffer_move *x = a, *y = b;
+  return x->old_offset < y->old_offset ? 1 : x->old_offset > y->old_offset ? -1 : 0;
+}
+
+/*
+ * Compaction: starting from the highest range, each range that fits in the
+ * budget is given a new block and moved if that block is lower. The old
+ * block stays allocated until the copy has finished.
+ */
+static void
+plan_moves(struct block_allocation_table *table, int index_range, long *byte_budget)
+{
+  struct block_allocation_stats stats;
+  struct vertex_buffer_move *candidates;
+  long offset;
+  int i;
+
+  get_block_allocation_stats(table, &stats);
+  if (stats.fragmentation < DEFRAGMENT_THRESHOLD || object_count == 0)
+    return;
+  candidates = xmalloc(object_count * sizeof(struct vertex_buffer_move));
+  for (i = 0; i < object_count; i++) {
+    candidates[i].gvo = objects[i];
+    candidates[i].index_range = index_range;
+    candidates[i].old_offset = index_range
+      ? objects[i]->index_offset : objects[i]->vertex_offset;
+    candidates[i].size = index_range
+      ? index_range_size(objects[i]) : vertex_range_size(objects[i]);
+  }
+  qsort(candidates, object_count, sizeof(struct vertex_buffer_move), compare_moves);
+  for (i = 0; i < object_count && move_count < MAX_DEFRAGMENT_MOVES; i++) {
+    if (candidates[i].size > *byte_budget)
+      continue;
+    offset = allocate_aligned_block(table, candidates[i].size,
+        index_range ? INDEX_ALIGNMENT : VERTEX_ALIGNMENT);
+    if (offset < 0)
+      continue;
+    if (offset > candidates[i].old_offset) {
+      free_block(table, offset);
+      continue;
+    }
+    candidates[i].new_offset = offset;
+    moves[move_count++] = candidates[i];
+    *byte_budget -= candidates[i].size;
+  }
+  free(candidates);
+}
+
+/*
+ * The copies wait for every submitted upload, which may still be writing the
+ * ranges being moved. The barrier at the end makes the copies visible to
+ * vertex input in every later submission on the queue.
+ */
+static void
+submit_moves(void)
+{
+  VkCommandBufferBeginInfo begin_info;
+  VkBufferCopy regions[MAX_DEFRAGMENT_MOVES];
+  VkBufferMemoryBarrier barriers[2];
+  VkTimelineSemaphoreSubmitInfo timeline_info;
+  VkSubmitInfo submit_info;
+  int i, pass, region_count;
+  VkBuffer buffer;
+  VkResult err;
+
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.pNext = NULL;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  begin_info.pInheritanceInfo = NULL;
+  err = vkBeginCommandBuffer(defragment_command_buffer, &begin_info);
+  ASSERT_VK_RESULT(err, "begining defragment command buffer");
+  for (pass = 0; pass < 2; pass++) {
+    buffer = pass ? lime_vertex_buffers.index_buffer : lime_vertex_buffers.vertex_buffer;
+    region_count = 0;
+    for (i = 0; i < move_count; i++) {
+      if (moves[i].index_range != pass)
+        continue;
+      regions[region_count].srcOffset = moves[i].old_offset;
+      regions[region_count].dstOffset = moves[i].new_offset;
+      regions[region_count].size = moves[i].size;
+      region_count++;
+    }
+    if (region_count > 0)
+      vkCmdCopyBuffer(defragment_command_buffer, buffer, buffer, region_count, regions);
+    barriers[pass].sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barriers[pass].pNext = NULL;
+    barriers[pass].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barriers[pass].dstAccessMask = pass
+      ? VK_ACCESS_INDEX_READ_BIT : VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+    barriers[pass].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[pass].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[pass].buffer = buffer;
+    barriers[pass].offset = 0;
+    barriers[pass].size = VK_WHOLE_SIZE;
+  }
+  vkCmdPipelineBarrier(defragment_command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 0, NULL, 2, barriers, 0, NULL);
+  err = vkEndCommandBuffer(defragment_command_buffer);
+  ASSERT_VK_RESULT(err, "recording defragment command buffer");
+
+  lime_flush_uploads();
+  timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timeline_info.pNext = NULL;
+  timeline_info.waitSemaphoreValueCount = 1;
+  timeline_info.pWaitSemaphoreValues = &lime_uploads.submitted_ticket;
+  timeline_info.signalSemaphoreValueCount = 0;
+  timeline_info.pSignalSemaphoreValues = NULL;
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.pNext = &timeline_info;
+  submit_info.waitSemaphoreCount = 1;
+  submit_info.pWaitSemaphores = &lime_uploads.semaphore;
+  submit_info.pWaitDstStageMask = &(VkPipelineStageFlags){VK_PIPELINE_STAGE_TRANSFER_BIT};
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &defragment_command_buffer;
+  submit_info.signalSemaphoreCount = 0;
+  submit_info.pSignalSemaphores = NULL;
+  err = vkResetFences(lime_device.device, 1, &defragment_fence);
+  ASSERT_VK_RESULT(err, "resetting defragment fence");
+  err = vkQueueSubmit(lime_device.graphics_queue, 1, &submit_info, defragment_fence);
+  ASSERT_VK_RESULT(err, "submitting defragment command buffer");
+}
+
+/* Must only be called once the copies have finished. */
+static void
+finish_moves(void)
+{
+  int i;
+  for (i = 0; i < move_count; i++) {
+    if (moves[i].index_range)
+      moves[i].gvo->index_offset = moves[i].new_offset;
+    else
+      moves[i].gvo->vertex_offset = moves[i].new_offset;
+    assert(retired_move_counts[retire_slot] < 2 * MAX_DEFRAGMENT_MOVES);
+    retired_moves[retire_slot][retired_move_counts[retire_slot]++] = moves[i];
+  }
+  move_count = 0;
+}
+
+static void
+free_retired_ranges(int slot)
+{
+  struct vertex_buffer_move *move;
+  int i;
+  for (i = 0; i < retired_move_counts[slot]; i++) {
+    move = &retired_moves[slot][i];
+    free_block(move->index_range ? &lime_vertex_buffers.index_table
+        : &lime_vertex_buffers.vertex_table, move->old_offset);
+  }
+  retired_move_counts[slot] = 0;
 }
 
 void
-lime_init_vertex_buffers(long vertex_count, long index_count)
+lime_init_vertex_buffers(long vertex_memory, long index_memory,
+    enum vertex_buffer_placement placement)
 {
-  allocate_vertex_buffers(vertex_count * sizeof(struct vertex), index_count * sizeof(uint32_t));
-  init_block_allocation_table(&lime_vertex_buffers.vertex_table, vertex_count);
-  init_block_allocation_table(&lime_vertex_buffers.index_table, index_count);
+  lime_vertex_buffers.placement = placement;
+  allocate_vertex_buffers(vertex_memory, index_memory);
+  create_defragment_objects();
+  init_block_allocation_table(&lime_vertex_buffers.vertex_table, vertex_memory,
+      BLOCK_ALLOCATOR_TLSF);
+  init_block_allocation_table(&lime_vertex_buffers.index_table, index_memory,
+      BLOCK_ALLOCATOR_TLSF);
 }
 
+/*
+ * Indices are narrowed to 16 bits whenever every vertex can be addressed
+ * with them, and packed vertices are quantised while being copied. gvo must
+ * stay at the same address until it is freed since the defragmenter patches
+ * its offsets.
+ */
 void
 lime_create_graphics_vertex_obj(struct graphics_vertex_obj *gvo,
-  const struct indexed_vertex_obj *ivo)
+  const struct indexed_vertex_obj *ivo, enum vertex_format format)
 {
-  void *mapped;
-  VkResult err;
+  struct packed_vertex *packed_vertices;
+  uint16_t *short_indices;
+  long vertex_memory, index_memory;
+  int i;
 
   gvo->vertex_count = ivo->vertex_count;
   gvo->index_count = ivo->index_count;
-  gvo->vertex_offset = allocate_block(&lime_vertex_buffers.vertex_table, ivo->vertex_count);
-  gvo->index_offset = allocate_block(&lime_vertex_buffers.index_table, ivo->index_count);
+  gvo->format = format;
+  gvo->index_size = ivo->vertex_count < 65536 ? sizeof(uint16_t) : sizeof(uint32_t);
+  for (i = 0; i < 3; i++) {
+    gvo->position_offset[i] = ivo->min[i];
+    gvo->position_scale[i] = ivo->max[i] - ivo->min[i];
+  }
+  vertex_memory = ivo->vertex_count * (format == VERTEX_FORMAT_PACKED
+      ? sizeof(struct packed_vertex) : sizeof(struct vertex));
+  index_memory = ivo->index_count * gvo->index_size;
+  gvo->vertex_offset = allocate_aligned_block(&lime_vertex_buffers.vertex_table,
+      vertex_memory, VERTEX_ALIGNMENT);
+  gvo->index_offset = allocate_aligned_block(&lime_vertex_buffers.index_table,
+      index_memory, INDEX_ALIGNMENT);
   if (gvo->vertex_offset < 0) {
     fprintf(stderr, "Vertex buffer overflow.");
     exit(1);
@@ -108,34 +365,95 @@ lime_create_graphics_vertex_obj(struct graphics_vertex_obj *gvo,
     exit(1);
   }
 
-  err = vkMapMemory(lime_device.device, vertex_buffer_memory,
-      gvo->vertex_offset * sizeof(struct vertex),
-      ivo->vertex_count * sizeof(struct vertex), 0, &mapped);
-  ASSERT_VK_RESULT(err, "mapping vertex buffer");
-  memcpy(mapped, ivo->vertices, ivo->vertex_count * sizeof(struct vertex));
-  vkUnmapMemory(lime_device.device, vertex_buffer_memory);
-  err = vkMapMemory(lime_device.device, index_buffer_memory,
-      gvo->index_offset * sizeof(uint32_t),
-      ivo->index_count * sizeof(uint32_t), 0, &mapped);
-  ASSERT_VK_RESULT(err, "mapping vertex index buffer");
-  memcpy(mapped, ivo->indices, ivo->index_count * sizeof(uint32_t));
-  vkUnmapMemory(lime_device.device, index_buffer_memory);
+  if (format == VERTEX_FORMAT_PACKED) {
+    packed_vertices = xmalloc(vertex_memory);
+    pack_vertices(packed_vertices, ivo);
+    write_range(lime_vertex_buffers.vertex_buffer, &vertex_buffer_allocation,
+        gvo->vertex_offset, packed_vertices,
+        vertex_memory);
+    free(packed_vertices);
+  } else {
+    write_range(lime_vertex_buffers.vertex_buffer, &vertex_buffer_allocation,
+        gvo->vertex_offset, ivo->vertices,
+        vertex_memory);
+  }
+  if (gvo->index_size == sizeof(uint16_t)) {
+    short_indices = xmalloc(index_memory);
+    for (i = 0; i < ivo->index_count; i++)
+      short_indices[i] = ivo->indices[i];
+    write_range(lime_vertex_buffers.index_buffer, &index_buffer_allocation,
+        gvo->index_offset, short_indices, index_memory);
+    free(short_indices);
+  } else {
+    write_range(lime_vertex_buffers.index_buffer, &index_buffer_allocation,
+        gvo->index_offset, ivo->indices, index_memory);
+  }
+
+  if (object_count == object_capacity) {
+    object_capacity = object_capacity ? object_capacity * 2 : 16;
+    objects = xrealloc(objects, object_capacity * sizeof(struct graphics_vertex_obj *));
+  }
+  objects[object_count++] = gvo;
 }
 
 void
 lime_free_graphics_vertex_obj(struct graphics_vertex_obj *gvo)
 {
+  int i;
+
+  for (i = 0; i < move_count; i++)
+    if (moves[i].gvo == gvo)
+      break;
+  if (i < move_count) {
+    vkWaitForFences(lime_device.device, 1, &defragment_fence, VK_TRUE, UINT64_MAX);
+    finish_moves();
+  }
+  for (i = 0; i < object_count; i++)
+    if (objects[i] == gvo)
+      objects[i] = objects[--object_count];
   free_block(&lime_vertex_buffers.vertex_table, gvo->vertex_offset);
   free_block(&lime_vertex_buffers.index_table, gvo->index_offset);
 }
 
+/*
+ * Finishes the previous batch of moves if its copies are done, then starts
+ * a new one of at most byte_budget bytes. Must be called once per frame,
+ * after waiting for the frame that last used the same frame slot.
+ */
+void
+lime_defragment_vertex_buffers(long byte_budget)
+{
+  retire_slot = (retire_slot + 1) % FRAMES_IN_FLIGHT;
+  free_retired_ranges(retire_slot);
+  if (move_count > 0) {
+    if (vkGetFenceStatus(lime_device.device, defragment_fence) != VK_SUCCESS)
+      return;
+    finish_moves();
+  }
+  plan_moves(&lime_vertex_buffers.vertex_table, 0, &byte_budget);
+  plan_moves(&lime_vertex_buffers.index_table, 1, &byte_budget);
+  if (move_count > 0)
+    submit_moves();
+}
+
 void
 lime_destroy_vertex_buffers(void)
 {
+  int i;
+
+  if (move_count > 0) {
+    vkWaitForFences(lime_device.device, 1, &defragment_fence, VK_TRUE, UINT64_MAX);
+    finish_moves();
+  }
+  for (i = 0; i < FRAMES_IN_FLIGHT; i++)
+    free_retired_ranges(i);
+  vkDestroyFence(lime_device.device, defragment_fence, NULL);
+  vkDestroyCommandPool(lime_device.device, defragment_command_pool, NULL);
+  free(objects);
   vkDestroyBuffer(lime_device.device, lime_vertex_buffers.vertex_buffer, NULL);
   vkDestroyBuffer(lime_device.device, lime_vertex_buffers.index_buffer, NULL);
-  vkFreeMemory(lime_device.device, vertex_buffer_memory, NULL);
-  vkFreeMemory(lime_device.device, index_buffer_memory, NULL);
+  lime_free_memory(&vertex_buffer_allocation);
+  lime_free_memory(&index_buffer_allocation);
   destroy_block_allocation_table(&lime_vertex_buffers.vertex_table);
   destroy_block_allocation_table(&lime_vertex_buffers.index_table);
 }
@@ -1,38 +1,90 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <vulkan/vulkan.h>
 #include <GLFW/glfw3.h>
 #include "matrix.h"
 #include "obj_types.h"
 #include "block_allocation.h"
 #include "lime.h"
+#include "utils.h"
 #include <string.h>
 #include <assert.h>
 
 #define VOXEL_BLOCK_IMAGE_FORMAT VK_FORMAT_R8_UINT
+/* Must match the occupancy buffer header in the voxel shaders. */
+#define OCCUPANCY_MAX_LEVELS 16
+#define OCCUPANCY_HEADER_WORDS (1 + OCCUPANCY_MAX_LEVELS)
+/*
+ * Distances are capped so an edit only changes the field this far around
+ * the edited voxels.
+ */
+#define DISTANCE_FIELD_MAX 16
+#define DISTANCE_FIELD_THREADS 8
+/* Voxels a side of the bricks packed into 64 bit occupancy masks. */
+#define BRICK_SIZE 4
+
+enum distance_pass_axis {
+  DISTANCE_PASS_X,
+  DISTANCE_PASS_Y,
+  DISTANCE_PASS_Z,
+};
+
+/*
+ * Shared state of one build_distance_field call. Passes read and write
+ * boxes of voxels, the first two only within the box around the rebuilt one
+ * that can hold its nearest solid voxels.
+ */
+struct distance_build {
+  int size;
+  const char *voxels;
+  unsigned char *along_x, *along_y, *distances;
+  int low[3], high[3], outer_low[3], outer_high[3];
+  pthread_barrier_t pass_done;
+};
+
+/* One thread of a distance build, taking a z slice of every pass. */
+struct distance_worker {
+  struct distance_build *build;
+  int index;
+};
 
 static void allocate_voxel_block_uniform_buffer(void);
-static void create_transfer_command_pool(void);
-static void allocate_staging_buffer(VkDeviceSize size);
-static void allocate_voxel_image(int size, VkImage *image, VkDeviceMemory *memory,
-    VkImageView *view);
-static void init_voxel_image(VkImage image);
-static void fill_voxel_block_image(int size, const char *voxels, VkImage image);
+static uint32_t *build_occupancy(int size, const char *voxels, size_t *word_count);
+static uint32_t *build_bricks(int size, const char *voxels, size_t *word_count);
+static void allocate_block_buffer(size_t size, VkBuffer *buffer,
+    struct lime_allocation *allocation);
+static int min_max_along(const unsigned char *from, size_t index, size_t stride,
+    int below, int above);
+static void run_distance_pass(const struct distance_build *b,
+    enum distance_pass_axis axis, int first_z, int last_z);
+static void *run_distance_worker(void *arg);
+static void build_distance_field(int size, const char *voxels, unsigned char *distances,
+    const int low[3], const int high[3]);
+static void upload_box(VkImage image, const void *data, const int low[3],
+    const int high[3]);
+static void upload_occupancy(const char *voxels, int allocate);
+static void allocate_voxel_image(int size, VkImage *image,
+    struct lime_allocation *allocation, VkImageView *view);
 static void create_voxel_block_descriptor_pool(void);
 static void allocate_voxel_block_descriptor_set(void);
 static void write_voxel_block_descriptor_set(void);
 
 static VkBuffer voxel_block_uniform_buffer;
-static VkDeviceMemory voxel_block_uniform_buffer_memory;
-static VkCommandPool transfer_command_pool;
-static VkDeviceSize staging_buffer_size;
-static VkBuffer staging_buffer;
-static VkDeviceMemory staging_buffer_memory;
+static struct lime_allocation voxel_block_uniform_buffer_allocation;
+static VkBuffer occupancy_buffer, brick_buffer;
+static struct lime_allocation occupancy_buffer_allocation, brick_buffer_allocation;
 static VkImage voxel_image;
-static VkDeviceMemory voxel_image_memory;
+static struct lime_allocation voxel_image_allocation;
 static VkImageView voxel_image_view;
+static VkImage distance_image;
+static struct lime_allocation distance_image_allocation;
+static VkImageView distance_image_view;
 static VkDescriptorPool voxel_block_descriptor_pool;
+/* Kept so edits only rebuild the distances around them. */
+static int block_size;
+static unsigned char *distances;
 
 struct lime_voxel_blocks lime_voxel_blocks;
 
@@ -40,8 +92,6 @@ static void
 allocate_voxel_block_uniform_buffer(void)
 {
   VkBufferCreateInfo create_info;
-  VkMemoryRequirements memory_requirements;
-  VkMemoryAllocateInfo allocate_info;
   VkResult err;
 
   create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -56,80 +106,314 @@ allocate_voxel_block_uniform_buffer(void)
   err = vkCreateBuffer(lime_device.device, &create_info, NULL, &voxel_block_uniform_buffer);
   ASSERT_VK_RESULT(err, "creating voxel block uniform buffer");
 
-  vkGetBufferMemoryRequirements(lime_device.device, voxel_block_uniform_buffer,
-      &memory_requirements);
-  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocate_info.pNext = NULL;
-  allocate_info.allocationSize = memory_requirements.size;
-  allocate_info.memoryTypeIndex = lime_device_find_memory_type(
-      memory_requirements.memoryTypeBits,
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-  assert(voxel_block_uniform_buffer_memory == VK_NULL_HANDLE);
-  err = vkAllocateMemory(lime_device.device, &allocate_info, NULL,
-      &voxel_block_uniform_buffer_memory);
-  ASSERT_VK_RESULT(err, "allocating voxel block uniform buffer memory");
-  err = vkBindBufferMemory(lime_device.device, voxel_block_uniform_buffer,
-      voxel_block_uniform_buffer_memory, 0);
-  ASSERT_VK_RESULT(err, "binding voxel block uniform buffer memory");
+  lime_allocate_buffer_memory(voxel_block_uniform_buffer,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+      &voxel_block_uniform_buffer_allocation);
+}
+
+/*
+ * Level n of the occupancy pyramid holds one bit per 2^n voxel cell, set if
+ * any voxel in the cell is. Levels run from 1 up to the level with a single
+ * cell, level 0 being the voxel image itself. The buffer starts with the
+ * top level and each level's word offset into the bits that follow.
+ */
+static uint32_t *
+build_occupancy(int size, const char *voxels, size_t *word_count)
+{
+  uint32_t *words, *bits, *below;
+  int top, level, dims, below_dims, x, y, z;
+  size_t index, offsets[OCCUPANCY_MAX_LEVELS], total;
+
+  for (top = 0; (1 << top) < size; top++);
+  if (top >= OCCUPANCY_MAX_LEVELS) {
+    fprintf(stderr, "Voxel block size %d is too large.\n", size);
+    exit(1);
+  }
+  offsets[0] = total = 0;
+  for (level = 1; level <= top; level++) {
+    dims = (size + (1 << level) - 1) >> level;
+    offsets[level] = total;
+    total += ((size_t)dims * dims * dims + 31) / 32;
+  }
+  *word_count = OCCUPANCY_HEADER_WORDS + total;
+  words = xmalloc(*word_count * sizeof(uint32_t));
+  memset(words, 0, *word_count * sizeof(uint32_t));
+  words[0] = top;
+  for (level = 0; level <= top; level++)
+    words[1 + level] = offsets[level];
+  bits = words + OCCUPANCY_HEADER_WORDS;
+
+  for (level = 1; level <= top; level++) {
+    dims = (size + (1 << level) - 1) >> level;
+    below_dims = (size + (1 << (level - 1)) - 1) >> (level - 1);
+    below = bits + offsets[level - 1];
+    for (z = 0; z < below_dims; z++)
+      for (y = 0; y < below_dims; y++)
+        for (x = 0; x < below_dims; x++) {
+          index = ((size_t)z * below_dims + y) * below_dims + x;
+          if (level == 1 ? voxels[index] == 0 : (below[index / 32] >> (index % 32) & 1) == 0)
+            continue;
+          index = ((size_t)(z >> 1) * dims + (y >> 1)) * dims + (x >> 1);
+          bits[offsets[level] + index / 32] |= 1u << (index % 32);
+        }
+  }
+  return words;
+}
+
+/*
+ * The smallest of max(|k|, from[index + k * stride]) for k from -below to
+ * above, capped at DISTANCE_FIELD_MAX. Stops once |k| alone is too large.
+ */
+static int
+min_max_along(const unsigned char *from, size_t index, size_t stride, int below,
+    int above)
+{
+  int k, best;
+  for (k = 0, best = DISTANCE_FIELD_MAX; k < best; k++) {
+    if (k <= below && from[index - k * stride] < best)
+      best = from[index - k * stride] > k ? from[index - k * stride] : k;
+    if (k <= above && from[index + k * stride] < best)
+      best = from[index + k * stride] > k ? from[index + k * stride] : k;
+  }
+  return best;
 }
 
+/*
+ * Each pass takes the minimum along one axis of the offset or the last
+ * pass's distance there, whichever is larger, which composes to the
+ * Chebyshev distance to the nearest solid voxel. The first pass reads the
+ * voxels themselves as distances of 0 or the cap.
+ */
 static void
-create_transfer_command_pool(void)
+run_distance_pass(const struct distance_build *b, enum distance_pass_axis axis,
+    int first_z, int last_z)
 {
-  VkCommandPoolCreateInfo create_info;
-  VkResult err;
-  create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-  create_info.pNext = NULL;
-  create_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
-  create_info.queueFamilyIndex = lime_device.graphics_family_index;
-  assert(transfer_command_pool == VK_NULL_HANDLE);
-  err = vkCreateCommandPool(lime_device.device, &create_info, NULL, &transfer_command_pool);
-  ASSERT_VK_RESULT(err, "creating voxel block transfer command pool");
+  const char *row;
+  size_t x_count, y_count, outer_y_count, index;
+  int x, y, z, k, best;
+
+  x_count = b->high[0] - b->low[0];
+  y_count = b->high[1] - b->low[1];
+  outer_y_count = b->outer_high[1] - b->outer_low[1];
+  for (z = first_z; z < last_z; z++) {
+    switch (axis) {
+    case DISTANCE_PASS_X:
+      for (y = b->outer_low[1]; y < b->outer_high[1]; y++) {
+        row = b->voxels + ((size_t)z * b->size + y) * b->size;
+        for (x = b->low[0]; x < b->high[0]; x++) {
+          for (k = 0, best = DISTANCE_FIELD_MAX; k < best; k++)
+            if ((x - k >= b->outer_low[0] && row[x - k])
+                || (x + k < b->outer_high[0] && row[x + k]))
+              best = k;
+          b->along_x[((z - b->outer_low[2]) * outer_y_count
+              + y - b->outer_low[1]) * x_count + x - b->low[0]] = best;
+        }
+      }
+      break;
+    case DISTANCE_PASS_Y:
+      for (y = b->low[1]; y < b->high[1]; y++)
+        for (x = 0; x < x_count; x++) {
+          index = ((z - b->outer_low[2]) * outer_y_count + y - b->outer_low[1])
+            * x_count + x;
+          b->along_y[((z - b->outer_low[2]) * y_count + y - b->low[1])
+            * x_count + x] = min_max_along(b->along_x, index, x_count,
+                y - b->outer_low[1], b->outer_high[1] - 1 - y);
+        }
+      break;
+    case DISTANCE_PASS_Z:
+      for (y = 0; y < y_count; y++)
+        for (x = 0; x < x_count; x++) {
+          index = ((z - b->outer_low[2]) * y_count + y) * x_count + x;
+          b->distances[((size_t)z * b->size + b->low[1] + y) * b->size
+            + b->low[0] + x] = min_max_along(b->along_y, index, y_count * x_count,
+                z - b->outer_low[2], b->outer_high[2] - 1 - z);
+        }
+      break;
+    }
+  }
+}
+
+/*
+ * Runs the worker's z slice of every pass, waiting for all workers to
+ * finish a pass before starting the next.
+ */
+static void *
+run_distance_worker(void *arg)
+{
+  const struct distance_worker *worker;
+  const struct distance_build *b;
+  enum distance_pass_axis axis;
+  int first_z, z_count;
+
+  worker = arg;
+  b = worker->build;
+  for (axis = DISTANCE_PASS_X; axis <= DISTANCE_PASS_Z; axis++) {
+    first_z = axis == DISTANCE_PASS_Z ? b->low[2] : b->outer_low[2];
+    z_count = (axis == DISTANCE_PASS_Z ? b->high[2] : b->outer_high[2]) - first_z;
+    run_distance_pass(b, axis, first_z + z_count * worker->index / DISTANCE_FIELD_THREADS,
+        first_z + z_count * (worker->index + 1) / DISTANCE_FIELD_THREADS);
+    pthread_barrier_wait(&worker->build->pass_done);
+  }
+  return NULL;
+}
+
+/*
+ * Rebuilds the distances of the voxels in the box from low to high,
+ * exclusive. An edit changes the field at most DISTANCE_FIELD_MAX voxels
+ * beyond the edited box, so that grown box is all that needs rebuilding.
+ */
+static void
+build_distance_field(int size, const char *voxels, unsigned char *distances,
+    const int low[3], const int high[3])
+{
+  struct distance_build build;
+  struct distance_worker workers[DISTANCE_FIELD_THREADS];
+  pthread_t threads[DISTANCE_FIELD_THREADS];
+  size_t x_count, y_count, outer_y_count, outer_z_count;
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    build.low[i] = low[i];
+    build.high[i] = high[i];
+    build.outer_low[i] = low[i] > DISTANCE_FIELD_MAX ? low[i] - DISTANCE_FIELD_MAX : 0;
+    build.outer_high[i] = high[i] + DISTANCE_FIELD_MAX < size
+      ? high[i] + DISTANCE_FIELD_MAX : size;
+  }
+  x_count = high[0] - low[0];
+  y_count = high[1] - low[1];
+  outer_y_count = build.outer_high[1] - build.outer_low[1];
+  outer_z_count = build.outer_high[2] - build.outer_low[2];
+  build.size = size;
+  build.voxels = voxels;
+  build.along_x = xmalloc(x_count * outer_y_count * outer_z_count);
+  build.along_y = xmalloc(x_count * y_count * outer_z_count);
+  build.distances = distances;
+  pthread_barrier_init(&build.pass_done, NULL, DISTANCE_FIELD_THREADS);
+
+  for (i = 0; i < DISTANCE_FIELD_THREADS; i++) {
+    workers[i].build = &build;
+    workers[i].index = i;
+  }
+  for (i = 1; i < DISTANCE_FIELD_THREADS; i++) {
+    if (pthread_create(&threads[i], NULL, run_distance_worker, &workers[i])) {
+      fprintf(stderr, "Failed to create distance field thread.\n");
+      exit(1);
+    }
+  }
+  run_distance_worker(&workers[0]);
+  for (i = 1; i < DISTANCE_FIELD_THREADS; i++)
+    pthread_join(threads[i], NULL);
+  pthread_barrier_destroy(&build.pass_done);
+  free(build.along_x);
+  free(build.along_y);
+}
+
+/*
+ * One bit per voxel, packed into two words per 4x4x4 brick so the tracer
+ * walks a brick with one load and reads the material byte only once it has
+ * found a solid voxel. Bricks are ordered like voxels, and voxels within a
+ * brick x fastest.
+ */
+static uint32_t *
+build_bricks(int size, const char *voxels, size_t *word_count)
+{
+  uint32_t *words;
+  int dims, x, y, z, bit;
+  size_t brick;
+
+  dims = (size + BRICK_SIZE - 1) / BRICK_SIZE;
+  *word_count = (size_t)dims * dims * dims * 2;
+  words = xmalloc(*word_count * sizeof(uint32_t));
+  memset(words, 0, *word_count * sizeof(uint32_t));
+  for (z = 0; z < size; z++)
+    for (y = 0; y < size; y++)
+      for (x = 0; x < size; x++) {
+        if (voxels[((size_t)z * size + y) * size + x] == 0)
+          continue;
+        brick = ((size_t)(z / BRICK_SIZE) * dims + y / BRICK_SIZE) * dims + x / BRICK_SIZE;
+        bit = ((z % BRICK_SIZE) * BRICK_SIZE + y % BRICK_SIZE) * BRICK_SIZE + x % BRICK_SIZE;
+        words[brick * 2 + bit / 32] |= 1u << (bit % 32);
+      }
+  return words;
 }
 
 static void
-allocate_staging_buffer(VkDeviceSize size)
+allocate_block_buffer(size_t size, VkBuffer *buffer, struct lime_allocation *allocation)
 {
   VkBufferCreateInfo create_info;
-  VkMemoryRequirements memory_requirements;
-  VkMemoryAllocateInfo allocate_info;
   VkResult err;
 
-  staging_buffer_size = size;
-
   create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
   create_info.pNext = NULL;
   create_info.flags = 0;
   create_info.size = size;
-  create_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  create_info.queueFamilyIndexCount = 0;
-  create_info.pQueueFamilyIndices = NULL;
-  assert(staging_buffer == VK_NULL_HANDLE);
-  err = vkCreateBuffer(lime_device.device, &create_info, NULL, &staging_buffer);
-  ASSERT_VK_RESULT(err, "creating voxel block staging buffer");
+  create_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  lime_device_upload_sharing(&create_info.sharingMode,
+      &create_info.queueFamilyIndexCount, &create_info.pQueueFamilyIndices);
+  assert(*buffer == VK_NULL_HANDLE);
+  err = vkCreateBuffer(lime_device.device, &create_info, NULL, buffer);
+  ASSERT_VK_RESULT(err, "creating voxel block storage buffer");
+
+  lime_allocate_buffer_memory(*buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, allocation);
+}
 
-  vkGetBufferMemoryRequirements(lime_device.device, staging_buffer, &memory_requirements);
-  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocate_info.pNext = NULL;
-  allocate_info.allocationSize = memory_requirements.size;
-  allocate_info.memoryTypeIndex = lime_device_find_memory_type(
-      memory_requirements.memoryTypeBits,
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-  assert(staging_buffer_memory == VK_NULL_HANDLE);
-  err = vkAllocateMemory(lime_device.device, &allocate_info, NULL, &staging_buffer_memory);
-  ASSERT_VK_RESULT(err, "allocating voxel block staging buffer memory");
-  err = vkBindBufferMemory(lime_device.device, staging_buffer, staging_buffer_memory, 0);
-  ASSERT_VK_RESULT(err, "binding voxel block staging buffer memory");
+/*
+ * Uploads the box from low to high, exclusive, of a block sized image, grown
+ * to what the transfer queue can copy.
+ */
+static void
+upload_box(VkImage image, const void *data, const int box_low[3], const int box_high[3])
+{
+  char *box;
+  size_t row_size, i;
+  int low[3], high[3], y, z;
+
+  for (i = 0; i < 3; i++) {
+    low[i] = box_low[i];
+    high[i] = box_high[i];
+  }
+  lime_align_image_box((VkExtent3D){block_size, block_size, block_size}, low, high);
+  row_size = high[0] - low[0];
+  box = xmalloc(row_size * (high[1] - low[1]) * (high[2] - low[2]));
+  for (i = 0, z = low[2]; z < high[2]; z++)
+    for (y = low[1]; y < high[1]; y++, i += row_size)
+      memcpy(box + i, (const char *)data
+          + ((size_t)z * block_size + y) * block_size + low[0], row_size);
+  lime_upload_image_region(image, (VkOffset3D){low[0], low[1], low[2]},
+      (VkExtent3D){high[0] - low[0], high[1] - low[1], high[2] - low[2]},
+      VK_IMAGE_LAYOUT_GENERAL, box, i);
+  free(box);
 }
 
+/*
+ * Builds and uploads the occupancy pyramid and bricks, first allocating
+ * their buffers if asked. Their sizes only depend on the block size.
+ */
 static void
-allocate_voxel_image(int size, VkImage *image, VkDeviceMemory *memory,
-    VkImageView *view)
+upload_occupancy(const char *voxels, int allocate)
+{
+  uint32_t *words;
+  size_t word_count;
+
+  words = build_occupancy(block_size, voxels, &word_count);
+  if (allocate)
+    allocate_block_buffer(word_count * sizeof(uint32_t), &occupancy_buffer,
+        &occupancy_buffer_allocation);
+  lime_upload_buffer(occupancy_buffer, 0, words, word_count * sizeof(uint32_t));
+  free(words);
+  words = build_bricks(block_size, voxels, &word_count);
+  if (allocate)
+    allocate_block_buffer(word_count * sizeof(uint32_t), &brick_buffer,
+        &brick_buffer_allocation);
+  lime_upload_buffer(brick_buffer, 0, words, word_count * sizeof(uint32_t));
+  free(words);
+}
+
+static void
+allocate_voxel_image(int size, VkImage *image,
+    struct lime_allocation *allocation, VkImageView *view)
 {
   VkImageCreateInfo create_info;
-  VkMemoryRequirements memory_requirements;
-  VkMemoryAllocateInfo allocate_info;
   VkImageViewCreateInfo view_create_info;
   VkResult err;
 
@@ -147,25 +431,14 @@ allocate_voxel_image(int size, VkImage *image, VkDeviceMemory *memory,
   create_info.samples = VK_SAMPLE_COUNT_1_BIT;
   create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
   create_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
-  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  create_info.queueFamilyIndexCount = 0;
-  create_info.pQueueFamilyIndices = NULL;
+  lime_device_upload_sharing(&create_info.sharingMode,
+      &create_info.queueFamilyIndexCount, &create_info.pQueueFamilyIndices);
   create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
   assert(*image == VK_NULL_HANDLE);
   err = vkCreateImage(lime_device.device, &create_info, NULL, image);
   ASSERT_VK_RESULT(err, "creating voxel block image");
 
-  vkGetImageMemoryRequirements(lime_device.device, *image, &memory_requirements);
-  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocate_info.pNext = NULL;
-  allocate_info.allocationSize = memory_requirements.size;
-  allocate_info.memoryTypeIndex = lime_device_find_memory_type(
-      memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-  assert(*memory == VK_NULL_HANDLE);
-  err = vkAllocateMemory(lime_device.device, &allocate_info, NULL, memory);
-  ASSERT_VK_RESULT(err, "allocating voxel block image memory");
-  err = vkBindImageMemory(lime_device.device, *image, *memory, 0);
-  ASSERT_VK_RESULT(err, "binding voxel block image memory");
+  lime_allocate_image_memory(*image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, allocation);
 
   view_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
   view_create_info.pNext = NULL;
@@ -187,147 +460,19 @@ allocate_voxel_image(int size, VkImage *image, VkDeviceMemory *memory,
   ASSERT_VK_RESULT(err, "creating voxel block image view");
 }
 
-static void
-init_voxel_image(VkImage image)
-{
-  VkCommandBufferAllocateInfo command_buffer_allocate_info;
-  VkCommandBuffer command_buffer;
-  VkCommandBufferBeginInfo begin_info;
-  VkImageMemoryBarrier barrier;
-  VkSubmitInfo submit_info;
-  VkResult err;
-
-  command_buffer_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  command_buffer_allocate_info.pNext = NULL;
-  command_buffer_allocate_info.commandPool = transfer_command_pool;
-  command_buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  command_buffer_allocate_info.commandBufferCount = 1;
-  err = vkAllocateCommandBuffers(lime_device.device, &command_buffer_allocate_info, &command_buffer);
-  ASSERT_VK_RESULT(err, "allocating voxel image init command buffer");
-
-  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  begin_info.pNext = NULL;
-  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-  begin_info.pInheritanceInfo = NULL;
-  err = vkBeginCommandBuffer(command_buffer, &begin_info);
-  ASSERT_VK_RESULT(err, "begining voxel image init command buffer");
-
-  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  barrier.pNext = NULL;
-  barrier.srcAccessMask = 0;
-  barrier.dstAccessMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
-  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.image = image;
-  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  barrier.subresourceRange.baseMipLevel = 0;
-  barrier.subresourceRange.levelCount = 1;
-  barrier.subresourceRange.baseArrayLayer = 0;
-  barrier.subresourceRange.layerCount = 1;
-  vkCmdPipelineBarrier(command_buffer,
-      VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-      0, 0, NULL, 0, NULL, 1, &barrier);
-
-  err = vkEndCommandBuffer(command_buffer);
-  ASSERT_VK_RESULT(err, "ending voxel image init command buffer");
-
-  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submit_info.pNext = NULL;
-  submit_info.waitSemaphoreCount = 0;
-  submit_info.pWaitSemaphores = NULL;
-  submit_info.pWaitDstStageMask = NULL;
-  submit_info.commandBufferCount = 1;
-  submit_info.pCommandBuffers = &command_buffer;
-  submit_info.signalSemaphoreCount = 0;
-  submit_info.pSignalSemaphores = NULL;
-  err = vkQueueSubmit(lime_device.graphics_queue, 1, &submit_info, VK_NULL_HANDLE);
-  ASSERT_VK_RESULT(err, "submitting voxel image init command buffer");
-  err = vkQueueWaitIdle(lime_device.graphics_queue);
-  ASSERT_VK_RESULT(err, "awaiting voxel image init");
-  vkFreeCommandBuffers(lime_device.device, transfer_command_pool, 1, &command_buffer);
-}
-
-static void
-fill_voxel_block_image(int size, const char *voxels, VkImage image)
-{
-  char *mapped;
-  VkCommandBufferAllocateInfo command_buffer_allocate_info;
-  VkCommandBuffer command_buffer;
-  VkCommandBufferBeginInfo begin_info;
-  VkBufferImageCopy region;
-  VkSubmitInfo submit_info;
-  VkResult err;
-
-  assert(size * size * size <= staging_buffer_size);
-  err = vkMapMemory(lime_device.device, staging_buffer_memory, 0, size * size * size,
-      0, (void **)&mapped);
-  ASSERT_VK_RESULT(err, "mapping voxel block staging buffer memory");
-  memcpy(mapped, voxels, size * size * size);
-  vkUnmapMemory(lime_device.device, staging_buffer_memory);
-
-  command_buffer_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  command_buffer_allocate_info.pNext = NULL;
-  command_buffer_allocate_info.commandPool = transfer_command_pool;
-  command_buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  command_buffer_allocate_info.commandBufferCount = 1;
-  err = vkAllocateCommandBuffers(lime_device.device, &command_buffer_allocate_info, &command_buffer);
-  ASSERT_VK_RESULT(err, "allocating voxel image transfer command buffer");
-
-  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  begin_info.pNext = NULL;
-  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-  begin_info.pInheritanceInfo = NULL;
-  err = vkBeginCommandBuffer(command_buffer, &begin_info);
-  ASSERT_VK_RESULT(err, "begining voxel image transfer command buffer");
-
-  /* TODO: Proper synchronization before and after. */
-
-  region.bufferOffset = 0;
-  region.bufferRowLength = 0;
-  region.bufferImageHeight = 0;
-  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  region.imageSubresource.mipLevel = 0;
-  region.imageSubresource.baseArrayLayer = 0;
-  region.imageSubresource.layerCount = 1;
-  region.imageOffset.x = region.imageOffset.y = region.imageOffset.z = 0;
-  region.imageExtent.width = size;
-  region.imageExtent.height = size;
-  region.imageExtent.depth = size;
-  vkCmdCopyBufferToImage(command_buffer, staging_buffer, image,
-      VK_IMAGE_LAYOUT_GENERAL, 1, &region);
-
-  err = vkEndCommandBuffer(command_buffer);
-  ASSERT_VK_RESULT(err, "ending voxel image transfer command buffer");
-
-  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submit_info.pNext = NULL;
-  submit_info.waitSemaphoreCount = 0;
-  submit_info.pWaitSemaphores = NULL;
-  submit_info.pWaitDstStageMask = NULL;
-  submit_info.commandBufferCount = 1;
-  submit_info.pCommandBuffers = &command_buffer;
-  submit_info.signalSemaphoreCount = 0;
-  submit_info.pSignalSemaphores = NULL;
-  err = vkQueueSubmit(lime_device.graphics_queue, 1, &submit_info, VK_NULL_HANDLE);
-  ASSERT_VK_RESULT(err, "submitting voxel image transfer command buffer");
-  err = vkQueueWaitIdle(lime_device.graphics_queue);
-  ASSERT_VK_RESULT(err, "awaiting voxel image transfer");
-  vkFreeCommandBuffers(lime_device.device, transfer_command_pool, 1, &command_buffer);
-}
-
 static void
 create_voxel_block_descriptor_pool(void)
 {
-  VkDescriptorPoolSize pool_sizes[2];
+  VkDescriptorPoolSize pool_sizes[3];
   VkDescriptorPoolCreateInfo create_info;
   VkResult err;
 
   pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
   pool_sizes[0].descriptorCount = 1;
   pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-  pool_sizes[1].descriptorCount = 1;
+  pool_sizes[1].descriptorCount = 2;
+  pool_sizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  pool_sizes[2].descriptorCount = 2;
   create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
   create_info.pNext = NULL;
   create_info.flags = 0;
@@ -360,9 +505,9 @@ allocate_voxel_block_descriptor_set(void)
 static void
 write_voxel_block_descriptor_set(void)
 {
-  VkDescriptorBufferInfo buffer_info;
-  VkDescriptorImageInfo image_info;
-  VkWriteDescriptorSet writes[2];
+  VkDescriptorBufferInfo buffer_info, occupancy_info, brick_info;
+  VkDescriptorImageInfo image_info, distance_info;
+  VkWriteDescriptorSet writes[5];
   buffer_info.buffer = voxel_block_uniform_buffer;
   buffer_info.offset = 0;
   buffer_info.range = sizeof(struct voxel_block_uniform_data);
@@ -389,6 +534,45 @@ write_voxel_block_descriptor_set(void)
   writes[1].pImageInfo = &image_info;
   writes[1].pBufferInfo = NULL;
   writes[1].pTexelBufferView = NULL;
+  occupancy_info.buffer = occupancy_buffer;
+  occupancy_info.offset = 0;
+  occupancy_info.range = VK_WHOLE_SIZE;
+  writes[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  writes[2].pNext = NULL;
+  writes[2].dstSet = lime_voxel_blocks.descriptor_set;
+  writes[2].dstBinding = 2;
+  writes[2].dstArrayElement = 0;
+  writes[2].descriptorCount = 1;
+  writes[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  writes[2].pImageInfo = NULL;
+  writes[2].pBufferInfo = &occupancy_info;
+  writes[2].pTexelBufferView = NULL;
+  distance_info.sampler = VK_NULL_HANDLE;
+  distance_info.imageView = distance_image_view;
+  distance_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+  writes[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  writes[3].pNext = NULL;
+  writes[3].dstSet = lime_voxel_blocks.descriptor_set;
+  writes[3].dstBinding = 3;
+  writes[3].dstArrayElement = 0;
+  writes[3].descriptorCount = 1;
+  writes[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  writes[3].pImageInfo = &distance_info;
+  writes[3].pBufferInfo = NULL;
+  writes[3].pTexelBufferView = NULL;
+  brick_info.buffer = brick_buffer;
+  brick_info.offset = 0;
+  brick_info.range = VK_WHOLE_SIZE;
+  writes[4].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  writes[4].pNext = NULL;
+  writes[4].dstSet = lime_voxel_blocks.descriptor_set;
+  writes[4].dstBinding = 4;
+  writes[4].dstArrayElement = 0;
+  writes[4].descriptorCount = 1;
+  writes[4].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  writes[4].pImageInfo = NULL;
+  writes[4].pBufferInfo = &brick_info;
+  writes[4].pTexelBufferView = NULL;
   vkUpdateDescriptorSets(lime_device.device, sizeof(writes) / sizeof(writes[0]),
       writes, 0, NULL);
 }
@@ -397,26 +581,52 @@ void
 lime_init_voxel_blocks(struct voxel_block_uniform_data uniform_data, int size, const char *voxels)
 {
   struct voxel_block_uniform_data *mapped;
-  VkResult err;
+  int low[3] = {0, 0, 0}, high[3] = {size, size, size};
 
+  block_size = size;
   allocate_voxel_block_uniform_buffer();
-  create_transfer_command_pool();
-  assert(size <= 256);
-  allocate_staging_buffer(256 * 256 * 256);
-  allocate_voxel_image(size, &voxel_image, &voxel_image_memory,
+  allocate_voxel_image(size, &voxel_image, &voxel_image_allocation,
     &voxel_image_view);
-  init_voxel_image(voxel_image);
-  fill_voxel_block_image(size, voxels, voxel_image);
+  lime_upload_image(voxel_image, (VkExtent3D){size, size, size},
+      VK_IMAGE_LAYOUT_GENERAL, voxels, size * size * size);
+  upload_occupancy(voxels, 1);
+  distances = xmalloc((size_t)size * size * size);
+  build_distance_field(size, voxels, distances, low, high);
+  allocate_voxel_image(size, &distance_image, &distance_image_allocation,
+    &distance_image_view);
+  lime_upload_image(distance_image, (VkExtent3D){size, size, size},
+      VK_IMAGE_LAYOUT_GENERAL, distances, size * size * size);
   create_voxel_block_descriptor_pool();
   allocate_voxel_block_descriptor_set();
   write_voxel_block_descriptor_set();
 
-  err = vkMapMemory(lime_device.device, voxel_block_uniform_buffer_memory,
-      0, sizeof(struct voxel_block_uniform_data),
-      0, (void **)&mapped);
-  ASSERT_VK_RESULT(err, "mapping voxel block uniform buffer data");
+  mapped = voxel_block_uniform_buffer_allocation.mapped;
   *mapped = uniform_data;
-  vkUnmapMemory(lime_device.device, voxel_block_uniform_buffer_memory);
+  memcpy(lime_voxel_blocks.model, uniform_data.model, sizeof(mat4));
+}
+
+/*
+ * Takes the whole block again after the voxels from low to high, exclusive,
+ * have changed. Only that box of the voxel image is uploaded, and only the
+ * distances within DISTANCE_FIELD_MAX of it are rebuilt and uploaded. The
+ * occupancy pyramid and bricks are small enough to rebuild whole.
+ */
+void
+lime_update_voxel_blocks(const char *voxels, const int low[3], const int high[3])
+{
+  int grown_low[3], grown_high[3], i;
+
+  /* Frames in flight may still read the block. */
+  vkQueueWaitIdle(lime_device.graphics_queue);
+  for (i = 0; i < 3; i++) {
+    grown_low[i] = low[i] > DISTANCE_FIELD_MAX ? low[i] - DISTANCE_FIELD_MAX : 0;
+    grown_high[i] = high[i] + DISTANCE_FIELD_MAX < block_size
+      ? high[i] + DISTANCE_FIELD_MAX : block_size;
+  }
+  upload_box(voxel_image, voxels, low, high);
+  upload_occupancy(voxels, 0);
+  build_distance_field(block_size, voxels, distances, grown_low, grown_high);
+  upload_box(distance_image, distances, grown_low, grown_high);
 }
 
 void
@@ -425,10 +635,16 @@ lime_destroy_voxel_blocks(void)
   vkDestroyDescriptorPool(lime_device.device, voxel_block_descriptor_pool, NULL);
   vkDestroyImageView(lime_device.device, voxel_image_view, NULL);
   vkDestroyImage(lime_device.device, voxel_image, NULL);
-  vkFreeMemory(lime_device.device, voxel_image_memory, NULL);
-  vkDestroyBuffer(lime_device.device, staging_buffer, NULL);
-  vkFreeMemory(lime_device.device, staging_buffer_memory, NULL);
+  lime_free_memory(&voxel_image_allocation);
+  vkDestroyImageView(lime_device.device, distance_image_view, NULL);
+  vkDestroyImage(lime_device.device, distance_image, NULL);
+  lime_free_memory(&distance_image_allocation);
+  vkDestroyBuffer(lime_device.device, occupancy_buffer, NULL);
+  lime_free_memory(&occupancy_buffer_allocation);
+  vkDestroyBuffer(lime_device.device, brick_buffer, NULL);
+  lime_free_memory(&brick_buffer_allocation);
   vkDestroyBuffer(lime_device.device, voxel_block_uniform_buffer, NULL);
-  vkFreeMemory(lime_device.device, voxel_block_uniform_buffer_memory, NULL);
-  vkDestroyCommandPool(lime_device.device, transfer_command_pool, NULL);
+  lime_free_memory(&voxel_block_uniform_buffer_allocation);
+  free(distances);
+  distances = NULL;
 }
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <vulkan/vulkan.h>
+#include <GLFW/glfw3.h>
+#include "matrix.h"
+#include "obj_types.h"
+#include "block_allocation.h"
+#include "lime.h"
+
+/*
+ * Traces every pixel of the swapchain extent once against the voxel block
+ * in 8x8 tiles, rather than once per rasterized fragment of its cube. The
+ * late pass composites the result against the triangles by depth.
+ */
+
+/* Must match local_size_x and local_size_y in voxel_trace.comp. */
+#define VOXEL_TRACE_WORKGROUP_SIZE 8
+
+static void create_trace_image(VkFormat format, VkImage *image,
+    struct lime_allocation *allocation, VkImageView *view);
+static void create_voxel_trace_descriptor_pool(void);
+static void allocate_voxel_trace_descriptor_set(void);
+static void write_voxel_trace_descriptor_set(void);
+
+static VkImage color_image, depth_image;
+static struct lime_allocation color_image_allocation, depth_image_allocation;
+static VkImageView color_image_view, depth_image_view;
+static VkDescriptorPool descriptor_pool;
+
+struct lime_voxel_trace lime_voxel_trace;
+
+static void
+create_trace_image(VkFormat format, VkImage *image, struct lime_allocation *allocation,
+    VkImageView *view)
+{
+  VkImageCreateInfo create_info;
+  VkImageViewCreateInfo view_create_info;
+  VkResult err;
+
+  create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  create_info.pNext = NULL;
+  create_info.flags = 0;
+  create_info.imageType = VK_IMAGE_TYPE_2D;
+  create_info.format = format;
+  create_info.extent.width = lime_resources.swapchain_extent.width;
+  create_info.extent.height = lime_resources.swapchain_extent.height;
+  create_info.extent.depth = 1;
+  create_info.mipLevels = 1;
+  create_info.arrayLayers = 1;
+  create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  create_info.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.queueFamilyIndexCount = 0;
+  create_info.pQueueFamilyIndices = NULL;
+  create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  assert(*image == VK_NULL_HANDLE);
+  err = vkCreateImage(lime_device.device, &create_info, NULL, image);
+  ASSERT_VK_RESULT(err, "creating voxel trace image");
+  lime_allocate_image_memory(*image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, allocation);
+
+  view_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_create_info.pNext = NULL;
+  view_create_info.flags = 0;
+  view_create_info.image = *image;
+  view_create_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_create_info.format = format;
+  view_create_info.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+  view_create_info.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+  view_create_info.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+  view_create_info.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+  view_create_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  view_create_info.subresourceRange.baseMipLevel = 0;
+  view_create_info.subresourceRange.levelCount = 1;
+  view_create_info.subresourceRange.baseArrayLayer = 0;
+  view_create_info.subresourceRange.layerCount = 1;
+  assert(*view == VK_NULL_HANDLE);
+  err = vkCreateImageView(lime_device.device, &view_create_info, NULL, view);
+  ASSERT_VK_RESULT(err, "creating voxel trace image view");
+}
+
+static void
+create_voxel_trace_descriptor_pool(void)
+{
+  VkDescriptorPoolSize pool_size;
+  VkDescriptorPoolCreateInfo create_info;
+  VkResult err;
+
+  pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  pool_size.descriptorCount = 2;
+  create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  create_info.pNext = NULL;
+  create_info.flags = 0;
+  create_info.maxSets = 1;
+  create_info.poolSizeCount = 1;
+  create_info.pPoolSizes = &pool_size;
+  assert(descriptor_pool == VK_NULL_HANDLE);
+  err = vkCreateDescriptorPool(lime_device.device, &create_info, NULL, &descriptor_pool);
+  ASSERT_VK_RESULT(err, "creating voxel trace descriptor pool");
+}
+
+static void
+allocate_voxel_trace_descriptor_set(void)
+{
+  VkDescriptorSetAllocateInfo allocate_info;
+  VkResult err;
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocate_info.pNext = NULL;
+  allocate_info.descriptorPool = descriptor_pool;
+  allocate_info.descriptorSetCount = 1;
+  allocate_info.pSetLayouts = &lime_pipelines.voxel_trace_descriptor_set_layout;
+  assert(lime_voxel_trace.descriptor_set == VK_NULL_HANDLE);
+  err = vkAllocateDescriptorSets(lime_device.device, &allocate_info,
+      &lime_voxel_trace.descriptor_set);
+  ASSERT_VK_RESULT(err, "allocating voxel trace descriptor set");
+}
+
+static void
+write_voxel_trace_descriptor_set(void)
+{
+  VkDescriptorImageInfo image_infos[2];
+  VkWriteDescriptorSet write;
+  int i;
+
+  image_infos[0].imageView = color_image_view;
+  image_infos[1].imageView = depth_image_view;
+  for (i = 0; i < 2; i++) {
+    image_infos[i].sampler = VK_NULL_HANDLE;
+    image_infos[i].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+  }
+  write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  write.pNext = NULL;
+  write.dstSet = lime_voxel_trace.descriptor_set;
+  write.dstBinding = 0;
+  write.dstArrayElement = 0;
+  write.descriptorCount = 2;
+  write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  write.pImageInfo = image_infos;
+  write.pBufferInfo = NULL;
+  write.pTexelBufferView = NULL;
+  vkUpdateDescriptorSets(lime_device.device, 1, &write, 0, NULL);
+}
+
+void
+lime_init_voxel_trace(void)
+{
+  create_trace_image(VK_FORMAT_R8G8B8A8_UNORM, &color_image, &color_image_allocation,
+      &color_image_view);
+  create_trace_image(VK_FORMAT_R32_SFLOAT, &depth_image, &depth_image_allocation,
+      &depth_image_view);
+  create_voxel_trace_descriptor_pool();
+  allocate_voxel_trace_descriptor_set();
+  write_voxel_trace_descriptor_set();
+  lime_voxel_trace.enabled = 1;
+}
+
+/*
+ * Records the trace for the given camera, leaving the images ready for the
+ * composite pass's fragment shader.
+ */
+void
+lime_record_voxel_trace(VkCommandBuffer command_buffer,
+    const struct camera_uniform_data *camera)
+{
+  struct voxel_trace_push_constants push_constants;
+  VkImageMemoryBarrier barriers[2];
+  mat4 view_model;
+  int i;
+
+  mat4_multiply(view_model, camera->view, lime_voxel_blocks.model);
+  mat4_multiply(push_constants.block_to_clip, camera->proj, view_model);
+  if (!mat4_inverse(push_constants.clip_to_block, push_constants.block_to_clip)) {
+    fprintf(stderr, "Voxel block transform is singular.\n");
+    exit(1);
+  }
+
+  barriers[0].image = color_image;
+  barriers[1].image = depth_image;
+  for (i = 0; i < 2; i++) {
+    barriers[i].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barriers[i].pNext = NULL;
+    /* The last frame's composite has read the images, which are rewritten. */
+    barriers[i].srcAccessMask = 0;
+    barriers[i].dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barriers[i].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barriers[i].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barriers[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[i].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barriers[i].subresourceRange.baseMipLevel = 0;
+    barriers[i].subresourceRange.levelCount = 1;
+    barriers[i].subresourceRange.baseArrayLayer = 0;
+    barriers[i].subresourceRange.layerCount = 1;
+  }
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 0, NULL, 2, barriers);
+
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      lime_pipelines.voxel_trace_pipeline);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      lime_pipelines.voxel_trace_pipeline_layout, 0, 1,
+      &lime_voxel_blocks.descriptor_set, 0, NULL);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      lime_pipelines.voxel_trace_pipeline_layout, 1, 1,
+      &lime_voxel_trace.descriptor_set, 0, NULL);
+  vkCmdPushConstants(command_buffer, lime_pipelines.voxel_trace_pipeline_layout,
+      VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants), &push_constants);
+  vkCmdDispatch(command_buffer,
+      (lime_resources.swapchain_extent.width + VOXEL_TRACE_WORKGROUP_SIZE - 1)
+      / VOXEL_TRACE_WORKGROUP_SIZE,
+      (lime_resources.swapchain_extent.height + VOXEL_TRACE_WORKGROUP_SIZE - 1)
+      / VOXEL_TRACE_WORKGROUP_SIZE, 1);
+
+  for (i = 0; i < 2; i++) {
+    barriers[i].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barriers[i].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barriers[i].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+  }
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, 0, NULL, 2, barriers);
+}
+
+void
+lime_destroy_voxel_trace(void)
+{
+  vkDestroyDescriptorPool(lime_device.device, descriptor_pool, NULL);
+  vkDestroyImageView(lime_device.device, color_image_view, NULL);
+  vkDestroyImageView(lime_device.device, depth_image_view, NULL);
+  vkDestroyImage(lime_device.device, color_image, NULL);
+  vkDestroyImage(lime_device.device, depth_image, NULL);
+  lime_free_memory(&color_image_allocation);
+  lime_free_memory(&depth_image_allocation);
+  lime_voxel_trace.enabled = 0;
+}